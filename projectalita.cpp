@@ -1,785 +1,7976 @@
-#include <iostream>
-#include <vector>
-#include <string>
-#include <algorithm>
-#include <map>
-#include <ctime>
-#include <cstdlib>
-
-using namespace std;
-
-enum PlaybackMode { SEQUENTIAL, SHUFFLE, REPEAT };
-
-class Song {
-public:
-    string name;
-    string artistName;
-    int releaseYear;
-    string genre;
-
-    Song(string n = "", string a = "", int y = 0, string g = "")
-        : name(n), artistName(a), releaseYear(y), genre(g) {}
-
-    bool operator==(const Song& other) const {
-        return name == other.name && artistName == other.artistName;
-    }
-};
-
-class Playlist {
-public:
-    string name;
-    vector<Song> songs;
-    PlaybackMode playbackMode;
-    int currentSongIndex;
-
-    Playlist(string n = "")
-        : name(n), playbackMode(SEQUENTIAL), currentSongIndex(0) {}
-
-    void addSong(const Song& song) {
-        songs.push_back(song);
-    }
-
-    void removeSong(const Song& song) {
-        songs.erase(remove(songs.begin(), songs.end(), song), songs.end());
-        if (currentSongIndex >= (int)songs.size())
-            currentSongIndex = 0;
-    }
-
-    int getNumberOfSongs() const {
-        return (int)songs.size();
-    }
-
-    void nextSong() {
-        if (songs.empty()) return;
-        if (playbackMode == SHUFFLE) {
-            currentSongIndex = rand() % songs.size();
-        }
-        else if (playbackMode == REPEAT) {
-            currentSongIndex = (currentSongIndex + 1) % songs.size();
-        }
-        else {
-            if (currentSongIndex < (int)songs.size() - 1)
-                ++currentSongIndex;
-            else
-                currentSongIndex = 0;
-        }
-    }
-
-    void previousSong() {
-        if (songs.empty()) return;
-        if (playbackMode == SHUFFLE) {
-            currentSongIndex = rand() % songs.size();
-        }
-        else if (playbackMode == REPEAT) {
-            if (currentSongIndex == 0)
-                currentSongIndex = (int)songs.size() - 1;
-            else
-                --currentSongIndex;
-        }
-        else {
-            if (currentSongIndex > 0)
-                --currentSongIndex;
-            else
-                currentSongIndex = (int)songs.size() - 1;
-        }
-    }
-
-    Song currentSong() {
-        if (songs.empty())
-            return Song();
-        return songs[currentSongIndex];
-    }
-
-    void setPlaybackMode(PlaybackMode mode) {
-        playbackMode = mode;
-    }
-
-    void displaySongs() {
-        cout << "Playlist: " << name << " (" << getNumberOfSongs() << " songs)\n";
-        for (size_t i = 0; i < songs.size(); ++i) {
-            cout << i + 1 << ". " << songs[i].name
-                << " by " << songs[i].artistName
-                << " (" << songs[i].releaseYear << ", " << songs[i].genre << ")\n";
-        }
-    }
-};
-
-class Artist {
-public:
-    string name;
-    int numberOfAlbums;
-    int numberOfReleasedSongs;
-    vector<Song> releasedSongs;
-
-    Artist(string n = "", int albums = 0)
-        : name(n), numberOfAlbums(albums), numberOfReleasedSongs(0) {}
-
-    void addSong(const Song& song) {
-        releasedSongs.push_back(song);
-        numberOfReleasedSongs = (int)releasedSongs.size();
-    }
-
-    void editArtist(int albums) {
-        numberOfAlbums = albums;
-    }
-
-    void displayInfo() {
-        cout << "Artist: " << name << "\nAlbums: " << numberOfAlbums
-            << "\nReleased Songs: " << numberOfReleasedSongs << '\n';
-        for (const auto& s : releasedSongs) {
-            cout << "- " << s.name << "\n";
-        }
-    }
-};
-
-class User {
-public:
-    string username;
-    string password;
-    vector<Song> savedSongs;
-    vector<Song> favoriteSongs;
-    vector<Playlist> favoritePlaylists;
-    vector<Playlist> personalPlaylists;
-
-    User(string u = "", string p = "") : username(u), password(p) {}
-
-    bool checkPassword(const string& p) {
-        return password == p;
-    }
-
-    void addToSavedSongs(const Song& song) {
-        if (find(savedSongs.begin(), savedSongs.end(), song) == savedSongs.end())
-            savedSongs.push_back(song);
-    }
-
-    void removeFromSavedSongs(const Song& song) {
-        savedSongs.erase(remove(savedSongs.begin(), savedSongs.end(), song), savedSongs.end());
-    }
-
-    void addToFavoriteSongs(const Song& song) {
-        if (find(favoriteSongs.begin(), favoriteSongs.end(), song) == favoriteSongs.end())
-            favoriteSongs.push_back(song);
-    }
-
-    void removeFromFavoriteSongs(const Song& song) {
-        favoriteSongs.erase(remove(favoriteSongs.begin(), favoriteSongs.end(), song), favoriteSongs.end());
-    }
-
-    void addPlaylist(const Playlist& playlist) {
-        personalPlaylists.push_back(playlist);
-    }
-
-    void deletePlaylist(const string& playlistName) {
-        personalPlaylists.erase(remove_if(personalPlaylists.begin(), personalPlaylists.end(),
-            [&](const Playlist& p) { return p.name == playlistName; }), personalPlaylists.end());
-    }
-
-    Playlist* findPlaylist(const string& playlistName) {
-        for (auto& playlist : personalPlaylists) {
-            if (playlist.name == playlistName) return &playlist;
-        }
-        return nullptr;
-    }
-
-    void displaySavedSongs() {
-        cout << "Saved Songs:\n";
-        for (size_t i = 0; i < savedSongs.size(); ++i) {
-            cout << i + 1 << ". " << savedSongs[i].name << " by " << savedSongs[i].artistName << '\n';
-        }
-    }
-
-    void displayFavoriteSongs() {
-        cout << "Favorite Songs:\n";
-        for (size_t i = 0; i < favoriteSongs.size(); ++i) {
-            cout << i + 1 << ". " << favoriteSongs[i].name << " by " << favoriteSongs[i].artistName << '\n';
-        }
-    }
-
-    void displayFavoritePlaylists() {
-        cout << "Favorite Playlists:\n";
-        for (size_t i = 0; i < favoritePlaylists.size(); ++i) {
-            cout << i + 1 << ". " << favoritePlaylists[i].name << " (" << favoritePlaylists[i].getNumberOfSongs() << " songs)\n";
-        }
-    }
-
-    void displayPersonalPlaylists() {
-        cout << "Personal Playlists:\n";
-        for (size_t i = 0; i < personalPlaylists.size(); ++i) {
-            cout << i + 1 << ". " << personalPlaylists[i].name << " (" << personalPlaylists[i].getNumberOfSongs() << " songs)\n";
-        }
-    }
-};
-
-class Admin {
-public:
-    string username;
-    string password;
-
-    Admin(string u = "admin", string p = "password") : username(u), password(p) {}
-
-    bool login(const string& u, const string& p) {
-        return (username == u && password == p);
-    }
-};
-
-class MusicSystem {
-public:
-    vector<User> users;
-    Admin admin;
-    vector<Song> songs;
-    vector<Playlist> playlists;
-    map<string, Artist> artists;
-
-    MusicSystem() {
-        srand((unsigned int)time(NULL));
-    }
-
-    User* findUser(const string& username) {
-        for (auto& user : users) {
-            if (user.username == username) return &user;
-        }
-        return nullptr;
-    }
-
-    Artist* findArtist(const string& artistName) {
-        auto it = artists.find(artistName);
-        if (it != artists.end()) return &it->second;
-        return nullptr;
-    }
-
-    void addUser(const User& user) {
-        users.push_back(user);
-    }
-
-    void addSong(const Song& song) {
-        songs.push_back(song);
-        if (artists.find(song.artistName) == artists.end()) {
-            artists[song.artistName] = Artist(song.artistName, 0);
-        }
-        artists[song.artistName].addSong(song);
-    }
-
-    void createPlaylist(const string& name) {
-        playlists.push_back(Playlist(name));
-    }
-
-    Playlist* findPlaylist(const string& name) {
-        for (auto& playlist : playlists) {
-            if (playlist.name == name) return &playlist;
-        }
-        return nullptr;
-    }
-
-    void displaySongs(const vector<Song>& list) {
-        for (size_t i = 0; i < list.size(); ++i) {
-            const auto& s = list[i];
-            cout << i + 1 << ". Song: " << s.name << ", Artist: " << s.artistName << ", Year: " << s.releaseYear << ", Genre: " << s.genre << endl;
-        }
-        if (list.empty()) {
-            cout << "No songs to display.\n";
-        }
-    }
-
-    void displayPlaylists(const vector<Playlist>& list) {
-        for (size_t i = 0; i < list.size(); ++i) {
-            const auto& p = list[i];
-            cout << i + 1 << ". Playlist: " << p.name << " (" << p.getNumberOfSongs() << " songs)" << endl;
-        }
-        if (list.empty()) {
-            cout << "No playlists to display.\n";
-        }
-    }
-
-    vector<Song> searchSongs(const string& keyword) {
-        vector<Song> results;
-        for (const auto& s : songs) {
-            string lowerName = s.name, lowerArtist = s.artistName;
-            transform(lowerName.begin(), lowerName.end(), lowerName.begin(), ::tolower);
-            transform(lowerArtist.begin(), lowerArtist.end(), lowerArtist.begin(), ::tolower);
-            string lowerKeyword = keyword;
-            transform(lowerKeyword.begin(), lowerKeyword.end(), lowerKeyword.begin(), ::tolower);
-            if (lowerName.find(lowerKeyword) != string::npos || lowerArtist.find(lowerKeyword) != string::npos) {
-                results.push_back(s);
-            }
-        }
-        return results;
-    }
-
-    void filterSongsByArtist(const string& artistName) {
-        vector<Song> filtered;
-        for (const auto& s : songs) {
-            if (s.artistName == artistName) filtered.push_back(s);
-        }
-        displaySongs(filtered);
-    }
-
-    void filterSongsByYear(int year) {
-        vector<Song> filtered;
-        for (const auto& s : songs) {
-            if (s.releaseYear == year) filtered.push_back(s);
-        }
-        displaySongs(filtered);
-    }
-
-    void filterSongsByGenre(const string& genre) {
-        vector<Song> filtered;
-        for (const auto& s : songs) {
-            if (s.genre == genre) filtered.push_back(s);
-        }
-        displaySongs(filtered);
-    }
-
-    void sortSongsAlphabetically() {
-        vector<Song> sorted = songs;
-        sort(sorted.begin(), sorted.end(), [](const Song& a, const Song& b) {
-            return a.name < b.name;
-            });
-        displaySongs(sorted);
-    }
-
-    void displayArtistPage(const string& artistName) {
-        Artist* artist = findArtist(artistName);
-        if (artist) {
-            artist->displayInfo();
-        }
-        else {
-            cout << "Artist not found." << endl;
-        }
-    }
-};
-
-void adminMenu(MusicSystem& system);
-void userMenu(MusicSystem& system, User* user);
-
-int main() {
-    MusicSystem system;
-
-    cout << "Welcome to Music Player\n";
-    while (true) {
-        cout << "\n1. Admin login\n2. User login\n3. Register new user\n4. Exit\nChoose option: ";
-        int choice;
-        cin >> choice;
-        if (choice == 1) {
-            string u, p;
-            cout << "Admin username: ";
-            cin >> u;
-            cout << "Admin password: ";
-            cin >> p;
-            if (system.admin.login(u, p)) {
-                cout << "Admin logged in successfully.\n";
-                adminMenu(system);
-            }
-            else {
-                cout << "Invalid admin credentials.\n";
-            }
-        }
-        else if (choice == 2) {
-            string u, p;
-            cout << "User username: ";
-            cin >> u;
-            cout << "User password: ";
-            cin >> p;
-            User* user = system.findUser(u);
-            if (user && user->checkPassword(p)) {
-                cout << "User logged in successfully.\n";
-                userMenu(system, user);
-            }
-            else {
-                cout << "Invalid user credentials.\n";
-            }
-        }
-        else if (choice == 3) {
-            string u, p;
-            cout << "Enter new username: ";
-            cin >> u;
-            if (system.findUser(u)) {
-                cout << "Username already exists.\n";
-                continue;
-            }
-            cout << "Enter new password: ";
-            cin >> p;
-            system.addUser(User(u, p));
-            cout << "User registered successfully.\n";
-        }
-        else if (choice == 4) {
-            cout << "Exiting...\n";
-            break;
-        }
-        else {
-            cout << "Invalid option.\n";
-        }
-    }
-
-    return 0;
-}
-
-void addSongInteractive(MusicSystem& system) {
-    string name, artistName, genre;
-    int year;
-    cout << "Enter song name: ";
-    cin.ignore();
-    getline(cin, name);
-    cout << "Enter artist name: ";
-    getline(cin, artistName);
-    cout << "Enter release year: ";
-    cin >> year;
-    cout << "Enter genre: ";
-    cin.ignore();
-    getline(cin, genre);
-    Song song(name, artistName, year, genre);
-    system.addSong(song);
-    cout << "Song added successfully.\n";
-}
-
-void createPlaylistInteractive(MusicSystem& system) {
-    string name;
-    cout << "Enter playlist name: ";
-    cin.ignore();
-    getline(cin, name);
-    if (system.findPlaylist(name)) {
-        cout << "Playlist already exists.\n";
-        return;
-    }
-    system.createPlaylist(name);
-    cout << "Playlist created successfully.\n";
-}
-
-void addSongToPlaylistInteractive(MusicSystem& system) {
-    string playlistName;
-    cout << "Enter playlist name to add song to: ";
-    cin.ignore();
-    getline(cin, playlistName);
-    Playlist* playlist = system.findPlaylist(playlistName);
-    if (!playlist) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    cout << "System Songs:\n";
-    system.displaySongs(system.songs);
-    int songIndex;
-    cout << "Enter song number to add: ";
-    cin >> songIndex;
-    if (songIndex < 1 || songIndex >(int)system.songs.size()) {
-        cout << "Invalid song selection.\n";
-        return;
-    }
-    playlist->addSong(system.songs[songIndex - 1]);
-    cout << "Song added to playlist.\n";
-}
-
-void removeSongFromPlaylistInteractive(MusicSystem& system) {
-    string playlistName;
-    cout << "Enter playlist name to remove song from: ";
-    cin.ignore();
-    getline(cin, playlistName);
-    Playlist* playlist = system.findPlaylist(playlistName);
-    if (!playlist) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    playlist->displaySongs();
-    int songIndex;
-    cout << "Enter song number to remove: ";
-    cin >> songIndex;
-    if (songIndex < 1 || songIndex > playlist->getNumberOfSongs()) {
-        cout << "Invalid song selection.\n";
-        return;
-    }
-    playlist->removeSong(playlist->songs[songIndex - 1]);
-    cout << "Song removed from playlist.\n";
-}
-
-void createArtistPageInteractive(MusicSystem& system) {
-    string artistName;
-    int albums;
-    cout << "Enter artist name: ";
-    cin.ignore();
-    getline(cin, artistName);
-    cout << "Enter number of albums: ";
-    cin >> albums;
-    Artist* artist = system.findArtist(artistName);
-    if (artist) {
-        artist->editArtist(albums);
-        cout << "Artist updated successfully.\n";
-    }
-    else {
-        Artist newArtist(artistName, albums);
-        system.artists[artistName] = newArtist;
-        cout << "Artist created successfully.\n";
-    }
-}
-
-void addSongToArtistInteractive(MusicSystem& system) {
-    string artistName;
-    cout << "Enter artist name to add song to: ";
-    cin.ignore();
-    getline(cin, artistName);
-    Artist* artist = system.findArtist(artistName);
-    if (!artist) {
-        cout << "Artist not found.\n";
-        return;
-    }
-    cout << "System Songs:\n";
-    system.displaySongs(system.songs);
-    int songIndex;
-    cout << "Enter song number to add: ";
-    cin >> songIndex;
-    if (songIndex < 1 || songIndex >(int)system.songs.size()) {
-        cout << "Invalid song selection.\n";
-        return;
-    }
-    Song song = system.songs[songIndex - 1];
-    if (song.artistName != artistName) {
-        cout << "Song's artist does not match.\n";
-        return;
-    }
-    artist->addSong(song);
-    cout << "Song added to artist's page.\n";
-}
-
-void adminMenu(MusicSystem& system) {
-    while (true) {
-        cout << "\nAdmin Menu:\n"
-            << "1. Add Song\n"
-            << "2. Create Playlist\n"
-            << "3. Add Song to Playlist\n"
-            << "4. Remove Song from Playlist\n"
-            << "5. Create/Edit Artist Page\n"
-            << "6. Add Song to Artist Page\n"
-            << "7. Display All Songs\n"
-            << "8. Display All Playlists\n"
-            << "9. Logout\n"
-            << "Choose option: ";
-        int opt; cin >> opt;
-        switch (opt) {
-        case 1: addSongInteractive(system); break;
-        case 2: createPlaylistInteractive(system); break;
-        case 3: addSongToPlaylistInteractive(system); break;
-        case 4: removeSongFromPlaylistInteractive(system); break;
-        case 5: createArtistPageInteractive(system); break;
-        case 6: addSongToArtistInteractive(system); break;
-        case 7: system.displaySongs(system.songs); break;
-        case 8: system.displayPlaylists(system.playlists); break;
-        case 9: return;
-        default: cout << "Invalid option.\n";
-        }
-    }
-}
-
-void userAddSongToPlaylist(User* user, MusicSystem& system) {
-    string playlistName;
-    cout << "Enter your playlist name: ";
-    cin.ignore();
-    getline(cin, playlistName);
-    Playlist* playlist = user->findPlaylist(playlistName);
-    if (!playlist) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    cout << "System Songs:\n";
-    system.displaySongs(system.songs);
-    int songIndex;
-    cout << "Enter song number to add: ";
-    cin >> songIndex;
-    if (songIndex < 1 || songIndex >(int)system.songs.size()) {
-        cout << "Invalid song selection.\n";
-        return;
-    }
-    playlist->addSong(system.songs[songIndex - 1]);
-    cout << "Song added to playlist.\n";
-}
-
-void userRemoveSongFromPlaylist(User* user) {
-    string playlistName;
-    cout << "Enter your playlist name: ";
-    cin.ignore();
-    getline(cin, playlistName);
-    Playlist* playlist = user->findPlaylist(playlistName);
-    if (!playlist) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    playlist->displaySongs();
-    int songIndex;
-    cout << "Enter song number to remove: ";
-    cin >> songIndex;
-    if (songIndex < 1 || songIndex > playlist->getNumberOfSongs()) {
-        cout << "Invalid song selection.\n";
-        return;
-    }
-    playlist->removeSong(playlist->songs[songIndex - 1]);
-    cout << "Song removed from playlist.\n";
-}
-
-void userCreatePlaylist(User* user) {
-    string name;
-    cout << "Enter new playlist name: ";
-    cin.ignore();
-    getline(cin, name);
-    if (user->findPlaylist(name)) {
-        cout << "Playlist already exists.\n";
-        return;
-    }
-    user->addPlaylist(Playlist(name));
-    cout << "Playlist created.\n";
-}
-
-void userDeletePlaylist(User* user) {
-    string name;
-    cout << "Enter playlist name to delete: ";
-    cin.ignore();
-    getline(cin, name);
-    if (!user->findPlaylist(name)) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    user->deletePlaylist(name);
-    cout << "Playlist deleted.\n";
-}
-
-void userPlaylistPlayback(User* user) {
-    string playlistName;
-    cout << "Enter playlist name to play: ";
-    cin.ignore();
-    getline(cin, playlistName);
-    Playlist* playlist = user->findPlaylist(playlistName);
-    if (!playlist) {
-        cout << "Playlist not found.\n";
-        return;
-    }
-    int mode;
-    cout << "Select playback mode:\n1. Sequential\n2. Shuffle\n3. Repeat\nChoice: ";
-    cin >> mode;
-    if (mode == 1) playlist->setPlaybackMode(SEQUENTIAL);
-    else if (mode == 2) playlist->setPlaybackMode(SHUFFLE);
-    else if (mode == 3) playlist->setPlaybackMode(REPEAT);
-    else {
-        cout << "Invalid playback mode. Default sequential used.\n";
-        playlist->setPlaybackMode(SEQUENTIAL);
-    }
-    char cmd;
-    cout << "Playing playlist \"" << playlist->name << "\". Commands: n = next, p = previous, q = quit\n";
-    cout << "Current song: " << playlist->currentSong().name << " by " << playlist->currentSong().artistName << '\n';
-    while (true) {
-        cout << "Command: ";
-        cin >> cmd;
-        if (cmd == 'n') {
-            playlist->nextSong();
-            cout << "Now playing: " << playlist->currentSong().name << " by " << playlist->currentSong().artistName << '\n';
-        }
-        else if (cmd == 'p') {
-            playlist->previousSong();
-            cout << "Now playing: " << playlist->currentSong().name << " by " << playlist->currentSong().artistName << '\n';
-        }
-        else if (cmd == 'q') {
-            break;
-        }
-        else {
-            cout << "Unknown command.\n";
-        }
-    }
-}
-
-void userMenu(MusicSystem& system, User* user) {
-    while (true) {
-        cout << "\nUser Menu:\n"
-            << "1. View Saved Songs\n"
-            << "2. View Favorite Songs\n"
-            << "3. View Favorite Playlists\n"
-            << "4. View Personal Playlists\n"
-            << "5. Create Playlist\n"
-            << "6. Delete Playlist\n"
-            << "7. Add Song to Playlist\n"
-            << "8. Remove Song from Playlist\n"
-            << "9. Search Songs\n"
-            << "10. Filter Songs by Artist\n"
-            << "11. Filter Songs by Year\n"
-            << "12. Filter Songs by Genre\n"
-            << "13. Sort Songs Alphabetically\n"
-            << "14. Add Song to Saved Songs\n"
-            << "15. Remove Song from Saved Songs\n"
-            << "16. Add Song to Favorite Songs\n"
-            << "17. Remove Song from Favorite Songs\n"
-            << "18. Playback Playlist\n"
-            << "19. View Artist Page\n"
-            << "20. Logout\n"
-            << "Choose option: ";
-        int opt; cin >> opt;
-        switch (opt) {
-        case 1: user->displaySavedSongs(); break;
-        case 2: user->displayFavoriteSongs(); break;
-        case 3: user->displayFavoritePlaylists(); break;
-        case 4: user->displayPersonalPlaylists(); break;
-        case 5: userCreatePlaylist(user); break;
-        case 6: userDeletePlaylist(user); break;
-        case 7: userAddSongToPlaylist(user, system); break;
-        case 8: userRemoveSongFromPlaylist(user); break;
-        case 9: {
-            cout << "Enter keyword to search: ";
-            string kw; cin.ignore(); getline(cin, kw);
-            vector<Song> results = system.searchSongs(kw);
-            cout << "Search Results:\n";
-            system.displaySongs(results);
-            break;
-        }
-        case 10: {
-            cout << "Enter artist name: ";
-            string artist; cin.ignore(); getline(cin, artist);
-            system.filterSongsByArtist(artist);
-            break;
-        }
-        case 11: {
-            cout << "Enter release year: ";
-            int year; cin >> year;
-            system.filterSongsByYear(year);
-            break;
-        }
-        case 12: {
-            cout << "Enter genre: ";
-            string genre; cin.ignore(); getline(cin, genre);
-            system.filterSongsByGenre(genre);
-            break;
-        }
-        case 13: system.sortSongsAlphabetically(); break;
-        case 14: {
-            cout << "System Songs:\n";
-            system.displaySongs(system.songs);
-            int idx; cout << "Enter song number to add to saved songs: "; cin >> idx;
-            if (idx < 1 || idx >(int)system.songs.size()) cout << "Invalid song number.\n";
-            else user->addToSavedSongs(system.songs[idx - 1]);
-            break;
-        }
-        case 15: {
-            user->displaySavedSongs();
-            int idx; cout << "Enter song number to remove from saved songs: "; cin >> idx;
-            if (idx < 1 || idx >(int)user->savedSongs.size()) cout << "Invalid song number.\n";
-            else user->removeFromSavedSongs(user->savedSongs[idx - 1]);
-            break;
-        }
-        case 16: {
-            cout << "System Songs:\n";
-            system.displaySongs(system.songs);
-            int idx; cout << "Enter song number to add to favorite songs: "; cin >> idx;
-            if (idx < 1 || idx >(int)system.songs.size()) cout << "Invalid song number.\n";
-            else user->addToFavoriteSongs(system.songs[idx - 1]);
-            break;
-        }
-        case 17: {
-            user->displayFavoriteSongs();
-            int idx; cout << "Enter song number to remove from favorite songs: "; cin >> idx;
-            if (idx < 1 || idx >(int)user->favoriteSongs.size()) cout << "Invalid song number.\n";
-            else user->removeFromFavoriteSongs(user->favoriteSongs[idx - 1]);
-            break;
-        }
-        case 18: userPlaylistPlayback(user); break;
-        case 19: {
-            cout << "Enter artist name: ";
-            string artist; cin.ignore(); getline(cin, artist);
-            system.displayArtistPage(artist);
-            break;
-        }
-        case 20: return;
-        default: cout << "Invalid option.\n";
-        }
-    }
+// Build: g++ -std=c++17 -O2 -pthread projectalita.cpp -o musicplayer
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <ctime>
+#include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cmath>
+#include <iterator>
+#include <locale>
+#include <stdexcept>
+#include <string_view>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FOLDED_SEARCH_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FOLDED_SEARCH_AVX2 1
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+enum PlaybackMode { SEQUENTIAL, SHUFFLE, REPEAT, AUTOPLAY };
+
+class Song {
+public:
+    string name;
+    string artistName;
+    int releaseYear;
+    string genre;
+
+    Song(string n = "", string a = "", int y = 0, string g = "")
+        : name(n), artistName(a), releaseYear(y), genre(g) {}
+
+    bool operator==(const Song& other) const {
+        return name == other.name && artistName == other.artistName;
+    }
+};
+
+// Non-owning view of a song; valid until the catalog that produced it grows.
+class SongView {
+public:
+    string_view name;
+    string_view artistName;
+    int releaseYear;
+    string_view genre;
+
+    SongView(string_view n = "", string_view a = "", int y = 0, string_view g = "")
+        : name(n), artistName(a), releaseYear(y), genre(g) {}
+
+    SongView(const Song& s)
+        : name(s.name), artistName(s.artistName), releaseYear(s.releaseYear), genre(s.genre) {}
+
+    Song toSong() const {
+        return Song(string(name), string(artistName), releaseYear, string(genre));
+    }
+};
+
+typedef unsigned int SongId;
+const SongId NO_SONG = (SongId)-1;
+
+size_t stringFootprint(const string& s) {
+    size_t bytes = sizeof(string);
+    if (s.capacity() >= sizeof(string))
+        bytes += s.capacity() + 1;
+    return bytes;
+}
+
+size_t songFootprint(const Song& s) {
+    return sizeof(Song) - 3 * sizeof(string)
+        + stringFootprint(s.name) + stringFootprint(s.artistName) + stringFootprint(s.genre);
+}
+
+const uint64_t FNV_OFFSET = 1469598103934665603ULL;
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = FNV_OFFSET) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Binary snapshot layout. All integers are native-endian; every section
+// starts on an 8-byte boundary and is covered by its own checksum.
+const char SNAPSHOT_MAGIC[8] = { 'R', 'K', 'L', 'M', 'S', 'N', 'A', 'P' };
+// Version 2 stores followed playlists as references into the playlist table.
+const uint32_t SNAPSHOT_VERSION = 2;
+
+enum SnapshotSectionKind {
+    SEC_META, SEC_STRINGS, SEC_IDS, SEC_SONGS, SEC_SONG_KEYS, SEC_TRIGRAMS,
+    SEC_ARTIST_POSTINGS, SEC_GENRE_POSTINGS, SEC_YEAR_POSTINGS, SEC_COLLATION,
+    SEC_ORDER_NAME, SEC_ORDER_ARTIST, SEC_ORDER_YEAR, SEC_ARTISTS, SEC_USERS, SEC_PLAYLISTS,
+    SEC_COUNT
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+    uint64_t checksum;
+};
+
+struct SnapshotSection {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+struct SnapshotString {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct SnapshotIdRange {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SnapshotMeta {
+    uint64_t songCount;
+    uint64_t systemPlaylistCount;
+    uint64_t keySlotCount;
+    SnapshotString collationLocale;
+};
+
+struct SnapshotSong {
+    SnapshotString name;
+    SnapshotString artistName;
+    SnapshotString genre;
+    int32_t releaseYear;
+    uint32_t reserved;
+};
+
+struct SnapshotTrigram {
+    uint32_t trigram;
+    uint32_t reserved;
+    SnapshotIdRange ids;
+};
+
+struct SnapshotKeyPostings {
+    SnapshotString key;
+    SnapshotIdRange ids;
+};
+
+struct SnapshotYearPostings {
+    int32_t year;
+    uint32_t reserved;
+    SnapshotIdRange ids;
+};
+
+struct SnapshotCollation {
+    SnapshotString nameKey;
+    SnapshotString artistKey;
+};
+
+struct SnapshotArtist {
+    SnapshotString name;
+    int32_t albums;
+    uint32_t reserved;
+    SnapshotIdRange songs;
+};
+
+struct SnapshotPlaylist {
+    SnapshotString name;
+    int32_t playbackMode;
+    int32_t currentSongIndex;
+    SnapshotIdRange songs;
+};
+
+struct SnapshotUser {
+    SnapshotString username;
+    SnapshotString password;
+    SnapshotIdRange savedSongs;
+    SnapshotIdRange favoriteSongs;
+    SnapshotIdRange personalPlaylists;
+    SnapshotIdRange favoritePlaylists;
+};
+
+bool syncFile(FILE* f) {
+    if (fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+bool replaceFile(const string& from, const string& to) {
+#ifdef _WIN32
+    remove(to.c_str());
+#endif
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+class MappedFile {
+public:
+    const char* data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+#ifdef _WIN32
+    vector<char> buffer;
+
+    bool open(const string& path) {
+        close();
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+    }
+
+    void close() {
+        buffer.clear();
+        data = nullptr;
+        size = 0;
+    }
+#else
+    bool open(const string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        data = (const char*)p;
+        size = (size_t)st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (data) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+    }
+#endif
+};
+
+class SnapshotImage {
+public:
+    MappedFile file;
+    const SnapshotHeader* header;
+    const SnapshotSection* sections[SEC_COUNT];
+    const SnapshotMeta* meta;
+    const char* strings;
+    const SongId* idPool;
+
+    SnapshotImage() : header(nullptr), meta(nullptr), strings(nullptr), idPool(nullptr) {
+        for (auto& s : sections) s = nullptr;
+    }
+
+    static uint64_t headerChecksum(const SnapshotHeader& h, const SnapshotSection* table) {
+        SnapshotHeader copy = h;
+        copy.checksum = 0;
+        uint64_t hash = fnv1a(&copy, sizeof(copy));
+        return fnv1a(table, sizeof(SnapshotSection) * h.sectionCount, hash);
+    }
+
+    // Structural checks only. Section payloads, and so every string and id
+    // range in them, are checked by verify(), which must pass before any of
+    // them is read.
+    bool open(const string& path, string& error) {
+        if (!file.open(path)) {
+            error = "cannot map " + path;
+            return false;
+        }
+        if (file.size < sizeof(SnapshotHeader)) {
+            error = "file too small";
+            return false;
+        }
+        header = (const SnapshotHeader*)file.data;
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            error = "not a snapshot file";
+            return false;
+        }
+        if (header->version < 1 || header->version > SNAPSHOT_VERSION) {
+            error = "unsupported snapshot version " + to_string(header->version);
+            return false;
+        }
+        if (header->fileSize != file.size || header->sectionCount != SEC_COUNT
+            || sizeof(SnapshotHeader) + SEC_COUNT * sizeof(SnapshotSection) > file.size) {
+            error = "truncated or malformed header";
+            return false;
+        }
+        const SnapshotSection* directory = (const SnapshotSection*)(file.data + sizeof(SnapshotHeader));
+        if (headerChecksum(*header, directory) != header->checksum) {
+            error = "header checksum mismatch";
+            return false;
+        }
+        for (uint32_t i = 0; i < SEC_COUNT; ++i) {
+            const SnapshotSection& s = directory[i];
+            if (s.kind != i || s.offset % 8 != 0 || s.offset > file.size || s.size > file.size - s.offset) {
+                error = "bad section table entry " + to_string(i);
+                return false;
+            }
+            sections[i] = &s;
+        }
+        if (sections[SEC_META]->size != sizeof(SnapshotMeta)) {
+            error = "bad metadata section";
+            return false;
+        }
+        meta = (const SnapshotMeta*)section(SEC_META);
+        strings = section(SEC_STRINGS);
+        idPool = (const SongId*)section(SEC_IDS);
+        size_t songCount = 0;
+        table<SnapshotSong>(SEC_SONGS, songCount);
+        if (songCount != meta->songCount) {
+            error = "song table size mismatch";
+            return false;
+        }
+        return true;
+    }
+
+    bool verify(string& error) const {
+        for (uint32_t i = 0; i < SEC_COUNT; ++i) {
+            if (fnv1a(section(i), sections[i]->size) != sections[i]->checksum) {
+                error = "checksum mismatch in section " + to_string(i);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const char* section(uint32_t kind) const {
+        return file.data + sections[kind]->offset;
+    }
+
+    template <class T>
+    const T* table(uint32_t kind, size_t& count) const {
+        count = sections[kind]->size / sizeof(T);
+        return (const T*)section(kind);
+    }
+
+    string_view str(const SnapshotString& s) const {
+        return string_view(strings + s.offset, s.length);
+    }
+
+    const SongId* ids(const SnapshotIdRange& r) const {
+        return idPool + r.offset;
+    }
+
+    bool validIds(const SnapshotIdRange& r) const {
+        size_t poolSize = sections[SEC_IDS]->size / sizeof(SongId);
+        return r.offset <= poolSize && r.count <= poolSize - r.offset;
+    }
+
+    // validIds, and every id in the range names a song in this snapshot.
+    bool validSongs(const SnapshotIdRange& r) const {
+        if (!validIds(r)) return false;
+        const SongId* first = ids(r);
+        return all_of(first, first + r.count, [this](SongId id) { return id < meta->songCount; });
+    }
+};
+
+inline uint64_t songKeyHash(string_view name, string_view artistName) {
+    uint64_t hash = fnv1a(name.data(), name.size());
+    hash = fnv1a("\x1f", 1, hash);
+    return fnv1a(artistName.data(), artistName.size(), hash);
+}
+
+// Fixed set of threads for data-parallel scans. parallelFor hands each
+// thread a contiguous block of [0, count); a thread that runs dry steals from
+// the far end of another's block, so uneven shards still finish together.
+// The calling thread takes a block too. One call runs on the pool at a
+// time; a call that finds it busy runs on the calling thread instead, so
+// concurrent sessions never queue behind each other. Calls must not nest.
+class WorkerPool {
+public:
+    struct Queue {
+        mutex lock;
+        deque<size_t> items;
+    };
+
+    size_t threads;
+    vector<thread> workers;
+    vector<unique_ptr<Queue>> queues;
+    mutex lock;
+    mutex running;
+    condition_variable wake;
+    condition_variable finished;
+    function<void(size_t)> job;
+    uint64_t generation;
+    size_t active;
+    bool stopping;
+
+    WorkerPool(size_t n) : threads(max<size_t>(n, 1)), generation(0), active(0), stopping(false) {
+        for (size_t t = 0; t < threads; ++t) queues.push_back(unique_ptr<Queue>(new Queue()));
+        for (size_t t = 1; t < threads; ++t) workers.push_back(thread(&WorkerPool::workerLoop, this, t));
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void parallelFor(size_t count, const function<void(size_t)>& fn) {
+        unique_lock<mutex> serial(running, try_to_lock);
+        if (threads == 1 || count <= 1 || !serial.owns_lock()) {
+            for (size_t i = 0; i < count; ++i) fn(i);
+            return;
+        }
+        for (size_t t = 0; t < threads; ++t) {
+            lock_guard<mutex> guard(queues[t]->lock);
+            for (size_t i = t * count / threads; i < (t + 1) * count / threads; ++i) queues[t]->items.push_back(i);
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            job = fn;
+            active = threads - 1;
+            ++generation;
+        }
+        wake.notify_all();
+        drain(0);
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&] { return active == 0; });
+        job = nullptr;
+    }
+
+    bool take(size_t self, size_t& item) {
+        for (size_t k = 0; k < threads; ++k) {
+            Queue& q = *queues[(self + k) % threads];
+            lock_guard<mutex> guard(q.lock);
+            if (q.items.empty()) continue;
+            if (k == 0) {
+                item = q.items.front();
+                q.items.pop_front();
+            }
+            else {
+                item = q.items.back();
+                q.items.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void drain(size_t self) {
+        size_t item;
+        while (take(self, item)) job(item);
+    }
+
+    void workerLoop(size_t self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain(self);
+            lock_guard<mutex> guard(lock);
+            if (--active == 0) finished.notify_one();
+        }
+    }
+};
+
+// Per-operation counters and latency histograms. Each thread records into
+// its own slots, registered once on first use, so the hot path is a clock
+// read and a few relaxed stores with no locks; readers sum the slots.
+// Build with -DNO_METRICS to compile the timers out entirely.
+enum MetricOp {
+    OP_SEARCH, OP_RANKED_SEARCH, OP_FILTER_ARTIST, OP_FILTER_YEAR, OP_FILTER_YEAR_RANGE, OP_FILTER_GENRE,
+    OP_SORT, OP_FIND_USER, OP_PLAYLIST_ADD, OP_PLAYLIST_REMOVE, OP_PLAY_NEXT, OP_PLAY_PREVIOUS,
+    METRIC_OP_COUNT
+};
+
+const char* const METRIC_OP_NAMES[METRIC_OP_COUNT] = {
+    "search", "ranked_search", "filter_artist", "filter_year", "filter_year_range", "filter_genre",
+    "sort", "find_user", "playlist_add", "playlist_remove", "play_next", "play_previous"
+};
+
+// Log-linear nanosecond buckets in the style of HdrHistogram: 16 linear
+// sub-buckets per power of two keep every bucket within 1/16 of its value.
+struct LatencyBuckets {
+    static const unsigned SUB_BITS = 4;
+    static const size_t SUB = (size_t)1 << SUB_BITS;
+    static const size_t COUNT = (64 - SUB_BITS + 1) * SUB;
+
+    static unsigned highestBit(uint64_t v) {
+#ifdef _MSC_VER
+        unsigned long bit;
+        _BitScanReverse64(&bit, v);
+        return (unsigned)bit;
+#else
+        return 63 - (unsigned)__builtin_clzll(v);
+#endif
+    }
+
+    static size_t of(uint64_t ns) {
+        if (ns < SUB) return (size_t)ns;
+        unsigned e = highestBit(ns);
+        return (e - SUB_BITS + 1) * SUB + ((ns >> (e - SUB_BITS)) & (SUB - 1));
+    }
+
+    static uint64_t lowest(size_t bucket) {
+        if (bucket < SUB) return bucket;
+        unsigned e = (unsigned)(bucket / SUB) + SUB_BITS - 1;
+        return (uint64_t)(SUB + bucket % SUB) << (e - SUB_BITS);
+    }
+
+    static uint64_t middle(size_t bucket) {
+        if (bucket + 1 >= COUNT) return lowest(bucket);
+        return lowest(bucket) + (lowest(bucket + 1) - lowest(bucket)) / 2;
+    }
+};
+
+struct ThreadMetrics {
+    atomic<uint64_t> count[METRIC_OP_COUNT];
+    atomic<uint64_t> totalNs[METRIC_OP_COUNT];
+    atomic<uint64_t> maxNs[METRIC_OP_COUNT];
+    atomic<uint64_t> buckets[METRIC_OP_COUNT][LatencyBuckets::COUNT];
+
+    ThreadMetrics() {
+        for (size_t op = 0; op < METRIC_OP_COUNT; ++op) {
+            count[op].store(0);
+            totalNs[op].store(0);
+            maxNs[op].store(0);
+            for (auto& b : buckets[op]) b.store(0);
+        }
+    }
+
+    // Only the owning thread writes, so load-then-store needs no lock.
+    static void bump(atomic<uint64_t>& slot, uint64_t by) {
+        slot.store(slot.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+    void record(MetricOp op, uint64_t ns) {
+        bump(count[op], 1);
+        bump(totalNs[op], ns);
+        if (ns > maxNs[op].load(memory_order_relaxed)) maxNs[op].store(ns, memory_order_relaxed);
+        bump(buckets[op][LatencyBuckets::of(ns)], 1);
+    }
+};
+
+struct MetricSummary {
+    uint64_t count = 0, totalNs = 0, maxNs = 0;
+    uint64_t p50 = 0, p90 = 0, p99 = 0, p999 = 0;
+
+    double meanNs() const {
+        return count ? (double)totalNs / count : 0;
+    }
+
+    // Quantiles from LatencyBuckets counts; maxNs must already be set.
+    void quantilesFrom(const vector<uint64_t>& buckets) {
+        uint64_t* targets[] = { &p50, &p90, &p99, &p999 };
+        const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        uint64_t seen = 0, total = 0;
+        size_t next = 0;
+        for (uint64_t c : buckets) total += c;
+        for (size_t b = 0; b < buckets.size() && next < 4 && total > 0; ++b) {
+            seen += buckets[b];
+            while (next < 4 && seen >= (uint64_t)ceil(quantiles[next] * total)) {
+                *targets[next++] = min(LatencyBuckets::middle(b), maxNs);
+            }
+        }
+    }
+};
+
+class Metrics {
+public:
+#ifdef NO_METRICS
+    static const bool enabled = false;
+#else
+    static const bool enabled = true;
+#endif
+
+    mutex lock;
+    vector<unique_ptr<ThreadMetrics>> threads;
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    // Slots outlive their thread so short-lived threads still count.
+    static ThreadMetrics& local() {
+        thread_local ThreadMetrics* mine = instance().addThread();
+        return *mine;
+    }
+
+    ThreadMetrics* addThread() {
+        lock_guard<mutex> guard(lock);
+        threads.push_back(unique_ptr<ThreadMetrics>(new ThreadMetrics()));
+        return threads.back().get();
+    }
+
+    MetricSummary summarize(MetricOp op) {
+        MetricSummary s;
+        vector<uint64_t> merged(LatencyBuckets::COUNT, 0);
+        lock_guard<mutex> guard(lock);
+        for (const auto& t : threads) {
+            s.count += t->count[op].load(memory_order_relaxed);
+            s.totalNs += t->totalNs[op].load(memory_order_relaxed);
+            s.maxNs = max(s.maxNs, t->maxNs[op].load(memory_order_relaxed));
+            for (size_t b = 0; b < LatencyBuckets::COUNT; ++b) merged[b] += t->buckets[op][b].load(memory_order_relaxed);
+        }
+        s.quantilesFrom(merged);
+        return s;
+    }
+
+    void writeText(ostream& os) {
+        if (!enabled) {
+            os << "Operation metrics were compiled out (built with -DNO_METRICS).\n";
+            return;
+        }
+        os << left << setw(20) << "operation" << right << setw(12) << "count" << setw(11) << "mean us"
+            << setw(11) << "p50 us" << setw(11) << "p90 us" << setw(11) << "p99 us" << setw(11) << "p99.9 us"
+            << setw(11) << "max us" << '\n';
+        for (size_t op = 0; op < METRIC_OP_COUNT; ++op) {
+            MetricSummary s = summarize((MetricOp)op);
+            os << left << setw(20) << METRIC_OP_NAMES[op] << right << setw(12) << s.count << fixed << setprecision(2)
+                << setw(11) << s.meanNs() / 1e3 << setw(11) << s.p50 / 1e3 << setw(11) << s.p90 / 1e3
+                << setw(11) << s.p99 / 1e3 << setw(11) << s.p999 / 1e3 << setw(11) << s.maxNs / 1e3 << '\n';
+        }
+        os.unsetf(ios::floatfield);
+        os << setprecision(6);
+    }
+
+    void writeJson(ostream& os) {
+        os << "{\"enabled\": " << (enabled ? "true" : "false") << ", \"unit\": \"ns\", \"operations\": [";
+        for (size_t op = 0; op < METRIC_OP_COUNT && enabled; ++op) {
+            MetricSummary s = summarize((MetricOp)op);
+            os << (op ? ",\n  " : "\n  ") << "{\"op\": \"" << METRIC_OP_NAMES[op] << "\", \"count\": " << s.count
+                << ", \"total\": " << s.totalNs << ", \"mean\": " << s.meanNs() << ", \"p50\": " << s.p50
+                << ", \"p90\": " << s.p90 << ", \"p99\": " << s.p99 << ", \"p999\": " << s.p999
+                << ", \"max\": " << s.maxNs << "}";
+        }
+        os << "]}\n";
+    }
+};
+
+// Times the enclosing scope into op.
+class MetricTimer {
+public:
+    MetricOp op;
+    chrono::steady_clock::time_point start;
+
+    explicit MetricTimer(MetricOp o) : op(o), start(chrono::steady_clock::now()) {}
+
+    ~MetricTimer() {
+        uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        Metrics::local().record(op, ns);
+    }
+};
+
+#ifdef NO_METRICS
+#define METRIC_SCOPE(op) ((void)0)
+#else
+#define METRIC_SCOPE(op) MetricTimer metricTimer(op)
+#endif
+
+// Epoch-based read sections. A reader publishes the global epoch in its own
+// slot while it reads; a writer that has swapped out a version bumps the
+// epoch and waits until no slot shows an older one, after which nobody can
+// still be looking at the old version. Entering a section is a store and
+// leaving it another, so reads never wait; only writers do. Sections nest
+// and must not block on anything a writer may hold.
+class EpochDomain {
+public:
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch;
+        unsigned depth;
+
+        Slot() : epoch(0), depth(0) {}
+    };
+
+    atomic<uint64_t> epoch;
+    mutex lock;
+    vector<unique_ptr<Slot>> slots;
+
+    EpochDomain() : epoch(1) {}
+
+    static EpochDomain& instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    static Slot& local() {
+        thread_local Slot* mine = instance().addSlot();
+        return *mine;
+    }
+
+    Slot* addSlot() {
+        lock_guard<mutex> guard(lock);
+        slots.push_back(unique_ptr<Slot>(new Slot()));
+        return slots.back().get();
+    }
+
+    void enter() {
+        Slot& slot = local();
+        if (slot.depth++ == 0) slot.epoch.store(epoch.load());
+    }
+
+    void leave() {
+        Slot& slot = local();
+        if (--slot.depth == 0) slot.epoch.store(0, memory_order_release);
+    }
+
+    // Returns once every section entered before the call has been left.
+    // Must not be called from inside a section.
+    void synchronize() {
+        uint64_t target = epoch.fetch_add(1) + 1;
+        vector<Slot*> active;
+        {
+            lock_guard<mutex> guard(lock);
+            for (const auto& slot : slots) active.push_back(slot.get());
+        }
+        for (Slot* slot : active) {
+            while (true) {
+                uint64_t seen = slot->epoch.load();
+                if (seen == 0 || seen >= target) break;
+                this_thread::yield();
+            }
+        }
+    }
+};
+
+class ReadSection {
+public:
+    ReadSection() {
+        EpochDomain::instance().enter();
+    }
+
+    ~ReadSection() {
+        EpochDomain::instance().leave();
+    }
+
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+};
+
+// Mutexes picked by address, so each object gets its own lock in effect
+// without carrying one (objects that collide just share a lock).
+class LockStripes {
+public:
+    static const unsigned BITS = 6;
+
+    struct alignas(64) Stripe {
+        mutex lock;
+    };
+
+    Stripe stripes[1 << BITS];
+
+    mutex& of(const void* object) {
+        uint64_t h = (uint64_t)(uintptr_t)object * 0x9E3779B97F4A7C15ull;
+        return stripes[h >> (64 - BITS)].lock;
+    }
+};
+
+// Interned strings numbered in insertion order. Codes stay valid for the
+// life of the dictionary; the map nodes own the text.
+class StringDictionary {
+public:
+    static const uint32_t NO_CODE = (uint32_t)-1;
+    unordered_map<string, uint32_t> codes;
+    vector<const string*> values;
+
+    uint32_t intern(string_view s) {
+        auto it = codes.find(string(s));
+        if (it != codes.end()) return it->second;
+        uint32_t code = (uint32_t)values.size();
+        it = codes.emplace(string(s), code).first;
+        values.push_back(&it->first);
+        return code;
+    }
+
+    uint32_t find(string_view s) const {
+        auto it = codes.find(string(s));
+        return it == codes.end() ? NO_CODE : it->second;
+    }
+
+    string_view operator[](uint32_t code) const {
+        return *values[code];
+    }
+
+    size_t memoryUsage() const {
+        size_t bytes = values.capacity() * sizeof(const string*) + codes.bucket_count() * sizeof(void*);
+        for (const auto& kv : codes)
+            bytes += stringFootprint(kv.first) + sizeof(uint32_t) + 2 * sizeof(void*);
+        return bytes;
+    }
+};
+
+// ASCII-only, like tolower in the "C" locale; the vector kernels below
+// fold exactly the same bytes.
+inline char foldCase(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+string foldString(string_view s) {
+    string folded(s);
+    for (auto& c : folded) c = foldCase(c);
+    return folded;
+}
+
+// Case-insensitive substring kernels: return the first position in
+// [first, last) where the already folded keyword starts, or last. The text is
+// folded on the fly and nothing is allocated. The vector kernels test 16 or
+// 32 start positions at once against the keyword's first and last byte and
+// compare the middle only where both match.
+const char* findFoldedScalar(const char* first, const char* last, string_view foldedKeyword) {
+    size_t m = foldedKeyword.size();
+    if ((size_t)(last - first) < m) return last;
+    for (const char* p = first; p + m <= last; ++p) {
+        size_t j = 0;
+        while (j < m && foldCase(p[j]) == foldedKeyword[j]) ++j;
+        if (j == m) return p;
+    }
+    return last;
+}
+
+inline bool middleMatches(const char* text, const char* foldedKeyword, size_t m) {
+    for (size_t j = 1; j + 1 < m; ++j)
+        if (foldCase(text[j]) != foldedKeyword[j]) return false;
+    return true;
+}
+
+inline unsigned lowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward(&bit, mask);
+    return (unsigned)bit;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+#ifdef FOLDED_SEARCH_SSE2
+inline __m128i foldBytes(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+
+const char* findFoldedSse2(const char* first, const char* last, string_view foldedKeyword) {
+    size_t m = foldedKeyword.size();
+    if (m == 0) return first;
+    if ((size_t)(last - first) < m) return last;
+    const char* k = foldedKeyword.data();
+    __m128i head = _mm_set1_epi8(k[0]), tail = _mm_set1_epi8(k[m - 1]);
+    const char* p = first;
+    for (; p + m + 15 <= last; p += 16) {
+        __m128i a = foldBytes(_mm_loadu_si128((const __m128i*)p));
+        __m128i b = foldBytes(_mm_loadu_si128((const __m128i*)(p + m - 1)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, head), _mm_cmpeq_epi8(b, tail)));
+        for (; mask; mask &= mask - 1)
+            if (middleMatches(p + lowestBit(mask), k, m)) return p + lowestBit(mask);
+    }
+    return findFoldedScalar(p, last, foldedKeyword);
+}
+#endif
+
+#ifdef FOLDED_SEARCH_AVX2
+__attribute__((target("avx2"))) inline __m256i foldBytes(__m256i x) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8('a' - 'A')));
+}
+
+__attribute__((target("avx2")))
+const char* findFoldedAvx2(const char* first, const char* last, string_view foldedKeyword) {
+    size_t m = foldedKeyword.size();
+    if (m == 0) return first;
+    if ((size_t)(last - first) < m) return last;
+    const char* k = foldedKeyword.data();
+    __m256i head = _mm256_set1_epi8(k[0]), tail = _mm256_set1_epi8(k[m - 1]);
+    const char* p = first;
+    for (; p + m + 31 <= last; p += 32) {
+        __m256i a = foldBytes(_mm256_loadu_si256((const __m256i*)p));
+        __m256i b = foldBytes(_mm256_loadu_si256((const __m256i*)(p + m - 1)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, head), _mm256_cmpeq_epi8(b, tail)));
+        for (; mask; mask &= mask - 1)
+            if (middleMatches(p + lowestBit(mask), k, m)) return p + lowestBit(mask);
+    }
+    return findFoldedScalar(p, last, foldedKeyword);
+}
+#endif
+
+typedef const char* (*FoldedFind)(const char* first, const char* last, string_view foldedKeyword);
+
+struct FoldedSearchKernel {
+    const char* name;
+    FoldedFind find;
+};
+
+// Kernels this CPU can run, slowest first; the last one is used.
+vector<FoldedSearchKernel> foldedSearchKernels() {
+    vector<FoldedSearchKernel> kernels = { { "scalar", findFoldedScalar } };
+#ifdef FOLDED_SEARCH_SSE2
+    kernels.push_back({ "sse2", findFoldedSse2 });
+#endif
+#ifdef FOLDED_SEARCH_AVX2
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({ "avx2", findFoldedAvx2 });
+#endif
+    return kernels;
+}
+
+const FoldedFind findFolded = foldedSearchKernels().back().find;
+
+inline bool containsFolded(string_view text, string_view foldedKeyword) {
+    const char* last = text.data() + text.size();
+    return foldedKeyword.empty() || findFolded(text.data(), last, foldedKeyword) != last;
+}
+
+struct SearchHit {
+    SongId id;
+    int score;
+};
+
+// Best first: higher score, then catalog order.
+inline bool betterHit(const SearchHit& a, const SearchHit& b) {
+    return a.score != b.score ? a.score > b.score : a.id < b.id;
+}
+
+// The k best hits offered so far, kept in a heap whose top is the worst one.
+class TopHits {
+public:
+    size_t k;
+    vector<SearchHit> heap;
+
+    TopHits(size_t limit = 0) : k(limit) {}
+
+    // Score a new hit must beat to get in.
+    int floor() const {
+        return heap.size() < k ? 0 : heap.front().score;
+    }
+
+    void offer(SongId id, int score) {
+        if (k == 0 || score <= 0) return;
+        SearchHit hit = { id, score };
+        if (heap.size() < k) {
+            heap.push_back(hit);
+            push_heap(heap.begin(), heap.end(), betterHit);
+        }
+        else if (betterHit(hit, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), betterHit);
+            heap.back() = hit;
+            push_heap(heap.begin(), heap.end(), betterHit);
+        }
+    }
+
+    void merge(const TopHits& other) {
+        for (const auto& hit : other.heap) offer(hit.id, hit.score);
+    }
+
+    vector<SearchHit> ranked() const {
+        vector<SearchHit> out = heap;
+        sort_heap(out.begin(), out.end(), betterHit);
+        return out;
+    }
+};
+
+// Scores how well a field matches a search keyword. Substring matches rank
+// by where they start: the whole field, its start, a word start, anywhere.
+// Otherwise the field may still match within maxEdits edits (one for
+// keywords of 4-7 bytes, two from 8), found with Myers' bit-vector
+// approximate substring search. 0 means no match.
+class KeywordScorer {
+public:
+    enum { EXACT = 100, PREFIX = 80, WORD = 60, INFIX = 40, FUZZY = 30, EDIT_COST = 10, NAME_BONUS = 5 };
+    string keyword;
+    int maxEdits;
+    uint64_t peq[256];
+    uint64_t lastBit;
+
+    KeywordScorer(string_view text) : keyword(foldString(text)), maxEdits(0), lastBit(0) {
+        memset(peq, 0, sizeof(peq));
+        size_t m = keyword.size();
+        if (m >= 4 && m <= 64) {
+            maxEdits = m >= 8 ? 2 : 1;
+            for (size_t i = 0; i < m; ++i) peq[(unsigned char)keyword[i]] |= 1ULL << i;
+            lastBit = 1ULL << (m - 1);
+        }
+    }
+
+    int substringScore(string_view field) const {
+        if (keyword.empty()) return 0;
+        const char* first = field.data();
+        const char* last = first + field.size();
+        const char* p = findFolded(first, last, keyword);
+        if (p == last) return 0;
+        if (p == first) return keyword.size() == field.size() ? EXACT : PREFIX;
+        for (; p != last; p = findFolded(p + 1, last, keyword))
+            if (!isalnum((unsigned char)p[-1])) return WORD;
+        return INFIX;
+    }
+
+    // Fewest edits turning the keyword into some substring of field.
+    int editDistance(string_view field) const {
+        uint64_t pv = ~0ULL, mv = 0;
+        int score = (int)keyword.size(), best = score;
+        for (char c : field) {
+            uint64_t eq = peq[(unsigned char)foldCase(c)];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & lastBit) ++score;
+            else if (mh & lastBit) --score;
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            best = min(best, score);
+        }
+        return best;
+    }
+
+    int fuzzyScore(string_view field) const {
+        if (maxEdits == 0) return 0;
+        int edits = editDistance(field);
+        return edits <= maxEdits ? FUZZY - EDIT_COST * max(edits, 1) : 0;
+    }
+
+    int score(string_view field) const {
+        int s = substringScore(field);
+        return s ? s : fuzzyScore(field);
+    }
+
+    // A song scores its better field, the name getting NAME_BONUS. The fuzzy
+    // name match is skipped when it cannot beat the artist score or floor.
+    int songScore(string_view name, int artistScore, int floor) const {
+        int s = substringScore(name);
+        if (s) return max(s + NAME_BONUS, artistScore);
+        int bestFuzzy = FUZZY - EDIT_COST + NAME_BONUS;
+        if (maxEdits == 0 || artistScore >= bestFuzzy || floor >= bestFuzzy) return artistScore;
+        s = fuzzyScore(name);
+        return s ? max(s + NAME_BONUS, artistScore) : artistScore;
+    }
+};
+
+class SongCatalog {
+public:
+    // Songs [0, baseCount) are read in place from a mapped snapshot.
+    const SnapshotImage* image;
+    const SnapshotSong* baseSongs;
+    size_t baseCount;
+    const SongId* baseKeySlots;
+    size_t baseKeySlotCount;
+    // Songs added since are stored column-wise: names back to back in one
+    // arena, artists and genres as dictionary codes, years in a packed array.
+    string nameArena;
+    vector<uint64_t> nameEnds;
+    vector<uint32_t> artistCodes;
+    vector<uint32_t> genreCodes;
+    vector<int32_t> years;
+    StringDictionary artists;
+    StringDictionary genres;
+    // Open-addressing table of added ids keyed by songKeyHash, kept at most half full.
+    vector<SongId> keySlots;
+    // Full scans over at least parallelThreshold songs are cut into shards of
+    // SHARD_SONGS and run on the pool; results are merged in catalog order.
+    static const size_t SHARD_SONGS = 1 << 16;
+    WorkerPool* workers;
+    size_t parallelThreshold;
+
+    SongCatalog()
+        : image(nullptr), baseSongs(nullptr), baseCount(0), baseKeySlots(nullptr), baseKeySlotCount(0),
+        workers(nullptr), parallelThreshold(1 << 18) {}
+
+    void attach(const SnapshotImage& img) {
+        image = &img;
+        baseSongs = img.table<SnapshotSong>(SEC_SONGS, baseCount);
+        baseKeySlots = img.table<SongId>(SEC_SONG_KEYS, baseKeySlotCount);
+    }
+
+    size_t addedCount() const {
+        return years.size();
+    }
+
+    SongId intern(const Song& song) {
+        SongId existing = find(song.name, song.artistName);
+        if (existing != NO_SONG) return existing;
+        SongId id = (SongId)size();
+        nameArena.append(song.name);
+        nameEnds.push_back(nameArena.size());
+        artistCodes.push_back(artists.intern(song.artistName));
+        genreCodes.push_back(genres.intern(song.genre));
+        years.push_back(song.releaseYear);
+        if ((addedCount() + 1) * 2 > keySlots.size()) rehash(max<size_t>(16, keySlots.size() * 2));
+        else insertKey(id);
+        return id;
+    }
+
+    void insertKey(SongId id) {
+        SongView s = (*this)[id];
+        size_t mask = keySlots.size() - 1;
+        size_t slot = songKeyHash(s.name, s.artistName) & mask;
+        while (keySlots[slot] != NO_SONG) slot = (slot + 1) & mask;
+        keySlots[slot] = id;
+    }
+
+    void rehash(size_t slots) {
+        keySlots.assign(slots, NO_SONG);
+        for (size_t i = 0; i < addedCount(); ++i) insertKey((SongId)(baseCount + i));
+    }
+
+    SongId find(string_view name, string_view artistName) const {
+        uint64_t hash = songKeyHash(name, artistName);
+        if (baseKeySlotCount > 0) {
+            size_t mask = baseKeySlotCount - 1;
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                SongId id = baseKeySlots[slot];
+                if (id == NO_SONG) break;
+                SongView s = (*this)[id];
+                if (s.name == name && s.artistName == artistName) return id;
+            }
+        }
+        if (keySlots.empty()) return NO_SONG;
+        size_t mask = keySlots.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            SongId id = keySlots[slot];
+            if (id == NO_SONG) return NO_SONG;
+            SongView s = (*this)[id];
+            if (s.name == name && s.artistName == artistName) return id;
+        }
+    }
+
+    bool contains(SongId id) const {
+        return id < size();
+    }
+
+    SongView operator[](SongId id) const {
+        if (id < baseCount) {
+            const SnapshotSong& s = baseSongs[id];
+            return SongView(image->str(s.name), image->str(s.artistName), s.releaseYear, image->str(s.genre));
+        }
+        size_t i = id - baseCount;
+        size_t begin = i == 0 ? 0 : nameEnds[i - 1];
+        return SongView(string_view(nameArena.data() + begin, nameEnds[i] - begin),
+            artists[artistCodes[i]], years[i], genres[genreCodes[i]]);
+    }
+
+    int year(SongId id) const {
+        return id < baseCount ? baseSongs[id].releaseYear : years[id - baseCount];
+    }
+
+    // Calls fn(first, last) for consecutive shards covering [0, n), on the
+    // pool when n is large enough.
+    template <class Fn>
+    void forShards(size_t n, Fn fn) const {
+        if (!workers || workers->threads == 1 || n < parallelThreshold) {
+            fn((size_t)0, n);
+            return;
+        }
+        workers->parallelFor((n + SHARD_SONGS - 1) / SHARD_SONGS, [&](size_t shard) {
+            fn(shard * SHARD_SONGS, min(n, (shard + 1) * SHARD_SONGS));
+        });
+    }
+
+    // Collects what fill(first, last, out) finds in each shard of [0, n), in order.
+    template <class Fill>
+    vector<SongId> collectShards(size_t n, Fill fill) const {
+        vector<vector<SongId>> parts((n + SHARD_SONGS - 1) / SHARD_SONGS);
+        forShards(n, [&](size_t first, size_t last) {
+            fill(first, last, parts[first / SHARD_SONGS]);
+        });
+        if (parts.size() == 1) return move(parts[0]);
+        size_t total = 0;
+        for (const auto& part : parts) total += part.size();
+        vector<SongId> out;
+        out.reserve(total);
+        for (const auto& part : parts) out.insert(out.end(), part.begin(), part.end());
+        return out;
+    }
+
+    // Column scans: songs in ids, or in the whole catalog when ids is null,
+    // that pass the test. Added songs compare plain integers.
+    template <class BaseTest, class AddedTest>
+    vector<SongId> scan(const vector<SongId>* ids, BaseTest baseTest, AddedTest addedTest) const {
+        if (ids) {
+            return collectShards(ids->size(), [&](size_t first, size_t last, vector<SongId>& out) {
+                for (size_t k = first; k < last; ++k) {
+                    SongId id = (*ids)[k];
+                    if (id < baseCount ? baseTest(id) : addedTest(id - baseCount)) out.push_back(id);
+                }
+            });
+        }
+        return collectShards(size(), [&](size_t first, size_t last, vector<SongId>& out) {
+            for (size_t id = first; id < min(last, baseCount); ++id)
+                if (baseTest((SongId)id)) out.push_back((SongId)id);
+            for (size_t id = max(first, baseCount); id < last; ++id)
+                if (addedTest(id - baseCount)) out.push_back((SongId)id);
+        });
+    }
+
+    vector<SongId> scanYears(int fromYear, int toYear, const vector<SongId>* ids = nullptr) const {
+        const int32_t* y = years.data();
+        return scan(ids,
+            [&](SongId id) { return baseSongs[id].releaseYear >= fromYear && baseSongs[id].releaseYear <= toYear; },
+            [=](size_t i) { return y[i] >= fromYear && y[i] <= toYear; });
+    }
+
+    vector<SongId> scanGenre(string_view genre, const vector<SongId>* ids = nullptr) const {
+        uint32_t code = genres.find(genre);
+        const uint32_t* g = genreCodes.data();
+        return scan(ids,
+            [&](SongId id) { return image->str(baseSongs[id].genre) == genre; },
+            [=](size_t i) { return g[i] == code; });
+    }
+
+    vector<SongId> scanArtist(string_view artistName, const vector<SongId>* ids = nullptr) const {
+        uint32_t code = artists.find(artistName);
+        const uint32_t* a = artistCodes.data();
+        return scan(ids,
+            [&](SongId id) { return image->str(baseSongs[id].artistName) == artistName; },
+            [=](size_t i) { return a[i] == code; });
+    }
+
+    // Songs whose name and/or artist contain the folded keyword. A full scan
+    // runs the substring kernel once over the whole name arena and once per
+    // distinct artist instead of once per song.
+    vector<SongId> scanText(string_view foldedKeyword, bool inName, bool inArtist,
+        const vector<SongId>* ids = nullptr) const {
+        auto test = [&](SongId id) {
+            SongView s = (*this)[id];
+            return (inName && containsFolded(s.name, foldedKeyword))
+                || (inArtist && containsFolded(s.artistName, foldedKeyword));
+        };
+        if (ids) return scan(ids, test, [&](size_t i) { return test((SongId)(baseCount + i)); });
+        vector<char> hit(addedCount(), 0);
+        size_t m = foldedKeyword.size();
+        if (inName && m == 0) hit.assign(addedCount(), 1);
+        else if (inName) {
+            forShards(addedCount(), [&](size_t first, size_t end) {
+                if (first == end) return;
+                const char* arena = nameArena.data();
+                const char* last = arena + nameEnds[end - 1];
+                size_t i = first;
+                const char* p = arena + (first == 0 ? 0 : nameEnds[first - 1]);
+                for (p = findFolded(p, last, foldedKeyword); p != last; p = findFolded(p, last, foldedKeyword)) {
+                    uint64_t offset = (uint64_t)(p - arena);
+                    i = upper_bound(nameEnds.begin() + i, nameEnds.begin() + end, offset) - nameEnds.begin();
+                    if (offset + m <= nameEnds[i]) {
+                        hit[i] = 1;
+                        p = arena + nameEnds[i];
+                    }
+                    else {
+                        ++p;
+                    }
+                }
+            });
+        }
+        if (inArtist) {
+            vector<char> artistHit(artists.values.size());
+            forShards(artistHit.size(), [&](size_t first, size_t last) {
+                for (size_t code = first; code < last; ++code)
+                    artistHit[code] = containsFolded(*artists.values[code], foldedKeyword);
+            });
+            forShards(hit.size(), [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i) hit[i] |= artistHit[artistCodes[i]];
+            });
+        }
+        const char* h = hit.data();
+        return scan(nullptr, test, [=](size_t i) { return h[i] != 0; });
+    }
+
+    // The k best-scoring songs, best first, among ids or the whole catalog.
+    // Each shard keeps its own bounded heap, so the full match set is never
+    // built or sorted. A full scan scores every artist once, not every song.
+    vector<SearchHit> topMatches(const KeywordScorer& scorer, size_t k, const vector<SongId>* ids = nullptr) const {
+        size_t n = ids ? ids->size() : size();
+        if (n == 0 || k == 0) return vector<SearchHit>();
+        vector<int> artistScore;
+        if (!ids) {
+            artistScore.resize(artists.values.size());
+            forShards(artistScore.size(), [&](size_t first, size_t last) {
+                for (size_t code = first; code < last; ++code) artistScore[code] = scorer.score(*artists.values[code]);
+            });
+        }
+        vector<TopHits> parts((n + SHARD_SONGS - 1) / SHARD_SONGS, TopHits(k));
+        forShards(n, [&](size_t first, size_t last) {
+            TopHits& top = parts[first / SHARD_SONGS];
+            for (size_t pos = first; pos < last; ++pos) {
+                SongId id = ids ? (*ids)[pos] : (SongId)pos;
+                SongView s = (*this)[id];
+                int artist = !ids && id >= baseCount ? artistScore[artistCodes[id - baseCount]] : scorer.score(s.artistName);
+                top.offer(id, scorer.songScore(s.name, artist, top.floor()));
+            }
+        });
+        TopHits all(k);
+        for (const auto& part : parts) all.merge(part);
+        return all.ranked();
+    }
+
+    size_t size() const {
+        return baseCount + addedCount();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Heap bytes only; songs read from a snapshot live in the page cache.
+    size_t memoryUsage() const {
+        return nameArena.capacity() + nameEnds.capacity() * sizeof(uint64_t)
+            + (artistCodes.capacity() + genreCodes.capacity()) * sizeof(uint32_t)
+            + years.capacity() * sizeof(int32_t) + keySlots.capacity() * sizeof(SongId)
+            + artists.memoryUsage() + genres.memoryUsage();
+    }
+};
+
+void intersectSorted(vector<SongId>& ids, const SongId* first, const SongId* last) {
+    const SongId* pos = first;
+    size_t kept = 0;
+    for (SongId id : ids) {
+        pos = lower_bound(pos, last, id);
+        if (pos == last) break;
+        if (*pos == id) ids[kept++] = id;
+    }
+    ids.resize(kept);
+}
+
+void intersectSorted(vector<SongId>& ids, const vector<SongId>& other) {
+    intersectSorted(ids, other.data(), other.data() + other.size());
+}
+
+// Sorted id list made of a snapshot part followed by in-memory additions.
+// Every added id is larger than every snapshot id, so the whole list is sorted.
+class PostingList {
+public:
+    const SongId* base;
+    size_t baseCount;
+    const vector<SongId>* added;
+
+    PostingList(const SongId* b = nullptr, size_t n = 0, const vector<SongId>* a = nullptr)
+        : base(b), baseCount(n), added(a) {}
+
+    size_t size() const {
+        return baseCount + (added ? added->size() : 0);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void appendTo(vector<SongId>& out) const {
+        out.insert(out.end(), base, base + baseCount);
+        if (added) out.insert(out.end(), added->begin(), added->end());
+    }
+
+    vector<SongId> toVector() const {
+        vector<SongId> out;
+        out.reserve(size());
+        appendTo(out);
+        return out;
+    }
+
+    vector<SongId> slice(size_t offset, size_t count) const {
+        vector<SongId> out;
+        out.reserve(count);
+        for (size_t i = offset; i < offset + count; ++i) out.push_back(i < baseCount ? base[i] : (*added)[i - baseCount]);
+        return out;
+    }
+
+    void intersectInto(vector<SongId>& ids) const {
+        if (!added || added->empty()) {
+            intersectSorted(ids, base, base + baseCount);
+            return;
+        }
+        SongId firstAdded = added->front();
+        auto split = lower_bound(ids.begin(), ids.end(), firstAdded);
+        vector<SongId> upper(split, ids.end());
+        ids.erase(split, ids.end());
+        intersectSorted(ids, base, base + baseCount);
+        intersectSorted(upper, *added);
+        ids.insert(ids.end(), upper.begin(), upper.end());
+    }
+};
+
+class TrigramIndex {
+public:
+    const SnapshotImage* image;
+    const SnapshotTrigram* baseTrigrams;
+    size_t baseTrigramCount;
+    unordered_map<unsigned int, vector<SongId>> postings;
+
+    TrigramIndex() : image(nullptr), baseTrigrams(nullptr), baseTrigramCount(0) {}
+
+    void attach(const SnapshotImage& img) {
+        image = &img;
+        baseTrigrams = img.table<SnapshotTrigram>(SEC_TRIGRAMS, baseTrigramCount);
+    }
+
+    static unsigned int trigramAt(const string& folded, size_t i) {
+        return ((unsigned int)(unsigned char)folded[i] << 16)
+            | ((unsigned int)(unsigned char)folded[i + 1] << 8)
+            | (unsigned int)(unsigned char)folded[i + 2];
+    }
+
+    // Ids must be added in increasing order so posting lists stay sorted.
+    void addText(SongId id, string_view text) {
+        if (text.size() < 3) return;
+        string folded = foldString(text);
+        for (size_t i = 0; i + 3 <= folded.size(); ++i) {
+            vector<SongId>& list = postings[trigramAt(folded, i)];
+            if (list.empty() || list.back() != id)
+                list.push_back(id);
+        }
+    }
+
+    void addSong(SongId id, const SongView& song) {
+        addText(id, song.name);
+        addText(id, song.artistName);
+    }
+
+    PostingList lookup(unsigned int trigram) const {
+        PostingList list;
+        const SnapshotTrigram* end = baseTrigrams + baseTrigramCount;
+        const SnapshotTrigram* it = lower_bound(baseTrigrams, end, trigram,
+            [](const SnapshotTrigram& t, unsigned int v) { return t.trigram < v; });
+        if (it != end && it->trigram == trigram) {
+            list.base = image->ids(it->ids);
+            list.baseCount = (size_t)it->ids.count;
+        }
+        auto added = postings.find(trigram);
+        if (added != postings.end()) list.added = &added->second;
+        return list;
+    }
+
+    vector<unsigned int> trigrams() const {
+        vector<unsigned int> keys;
+        for (size_t i = 0; i < baseTrigramCount; ++i) keys.push_back(baseTrigrams[i].trigram);
+        for (const auto& kv : postings) keys.push_back(kv.first);
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+    // Returns false when the keyword is too short to use the index.
+    bool candidates(const string& foldedKeyword, vector<SongId>& out) const {
+        out.clear();
+        if (foldedKeyword.size() < 3) return false;
+        vector<PostingList> lists;
+        vector<unsigned int> seen;
+        for (size_t i = 0; i + 3 <= foldedKeyword.size(); ++i) {
+            unsigned int trigram = trigramAt(foldedKeyword, i);
+            if (find(seen.begin(), seen.end(), trigram) != seen.end()) continue;
+            seen.push_back(trigram);
+            PostingList list = lookup(trigram);
+            if (list.empty()) return true;
+            lists.push_back(list);
+        }
+        sort(lists.begin(), lists.end(), [](const PostingList& a, const PostingList& b) {
+            return a.size() < b.size();
+            });
+        out = lists[0].toVector();
+        for (size_t k = 1; k < lists.size() && !out.empty(); ++k)
+            lists[k].intersectInto(out);
+        return true;
+    }
+
+    // Upper bound on the candidate count, or SIZE_MAX when the keyword is too short.
+    size_t estimate(const string& foldedKeyword) const {
+        if (foldedKeyword.size() < 3) return SIZE_MAX;
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i + 3 <= foldedKeyword.size(); ++i)
+            best = min(best, lookup(trigramAt(foldedKeyword, i)).size());
+        return best;
+    }
+
+    size_t memoryUsage() const {
+        size_t bytes = postings.bucket_count() * sizeof(void*);
+        for (const auto& kv : postings)
+            bytes += sizeof(kv) + 2 * sizeof(void*) + kv.second.capacity() * sizeof(SongId);
+        return bytes;
+    }
+};
+
+class AttributeIndex {
+public:
+    const SnapshotImage* image;
+    const SnapshotKeyPostings* baseArtists;
+    size_t baseArtistCount;
+    const SnapshotKeyPostings* baseGenres;
+    size_t baseGenreCount;
+    const SnapshotYearPostings* baseYears;
+    size_t baseYearCount;
+    unordered_map<string, vector<SongId>> byArtist;
+    unordered_map<string, vector<SongId>> byGenre;
+    map<int, vector<SongId>> byYear;
+
+    AttributeIndex()
+        : image(nullptr), baseArtists(nullptr), baseArtistCount(0), baseGenres(nullptr), baseGenreCount(0),
+        baseYears(nullptr), baseYearCount(0) {}
+
+    void attach(const SnapshotImage& img) {
+        image = &img;
+        baseArtists = img.table<SnapshotKeyPostings>(SEC_ARTIST_POSTINGS, baseArtistCount);
+        baseGenres = img.table<SnapshotKeyPostings>(SEC_GENRE_POSTINGS, baseGenreCount);
+        baseYears = img.table<SnapshotYearPostings>(SEC_YEAR_POSTINGS, baseYearCount);
+    }
+
+    void addSong(SongId id, const SongView& song) {
+        byArtist[string(song.artistName)].push_back(id);
+        byGenre[string(song.genre)].push_back(id);
+        byYear[song.releaseYear].push_back(id);
+    }
+
+    PostingList artist(const string& artistName) const {
+        return lookup(baseArtists, baseArtistCount, byArtist, artistName);
+    }
+
+    PostingList genre(const string& genre) const {
+        return lookup(baseGenres, baseGenreCount, byGenre, genre);
+    }
+
+    PostingList year(int year) const {
+        PostingList list;
+        const SnapshotYearPostings* base = findYear(year);
+        if (base) {
+            list.base = image->ids(base->ids);
+            list.baseCount = (size_t)base->ids.count;
+        }
+        auto it = byYear.find(year);
+        if (it != byYear.end()) list.added = &it->second;
+        return list;
+    }
+
+    size_t yearRangeCount(int fromYear, int toYear) const {
+        size_t count = 0;
+        if (fromYear > toYear) return count;
+        for (const SnapshotYearPostings* p = firstYear(fromYear); p != baseYears + baseYearCount && p->year <= toYear; ++p)
+            count += (size_t)p->ids.count;
+        for (auto it = byYear.lower_bound(fromYear); it != byYear.end() && it->first <= toYear; ++it)
+            count += it->second.size();
+        return count;
+    }
+
+    // Ids come back in catalog order, like a full scan would return them.
+    vector<SongId> yearRange(int fromYear, int toYear) const {
+        vector<SongId> ids;
+        if (fromYear > toYear) return ids;
+        size_t parts = 0;
+        for (const SnapshotYearPostings* p = firstYear(fromYear); p != baseYears + baseYearCount && p->year <= toYear; ++p, ++parts)
+            ids.insert(ids.end(), image->ids(p->ids), image->ids(p->ids) + p->ids.count);
+        for (auto it = byYear.lower_bound(fromYear); it != byYear.end() && it->first <= toYear; ++it, ++parts)
+            ids.insert(ids.end(), it->second.begin(), it->second.end());
+        if (parts > 1) sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    vector<string> artistNames() const {
+        return keys(baseArtists, baseArtistCount, byArtist);
+    }
+
+    vector<string> genreNames() const {
+        return keys(baseGenres, baseGenreCount, byGenre);
+    }
+
+    vector<int> years() const {
+        vector<int> all;
+        for (size_t i = 0; i < baseYearCount; ++i) all.push_back(baseYears[i].year);
+        for (const auto& kv : byYear) all.push_back(kv.first);
+        sort(all.begin(), all.end());
+        all.erase(unique(all.begin(), all.end()), all.end());
+        return all;
+    }
+
+private:
+    const SnapshotYearPostings* firstYear(int year) const {
+        return lower_bound(baseYears, baseYears + baseYearCount, year,
+            [](const SnapshotYearPostings& p, int v) { return p.year < v; });
+    }
+
+    const SnapshotYearPostings* findYear(int year) const {
+        const SnapshotYearPostings* p = firstYear(year);
+        return (p != baseYears + baseYearCount && p->year == year) ? p : nullptr;
+    }
+
+    PostingList lookup(const SnapshotKeyPostings* base, size_t baseCount,
+        const unordered_map<string, vector<SongId>>& added, const string& key) const {
+        PostingList list;
+        const SnapshotKeyPostings* end = base + baseCount;
+        const SnapshotKeyPostings* it = lower_bound(base, end, string_view(key),
+            [this](const SnapshotKeyPostings& p, string_view v) { return image->str(p.key) < v; });
+        if (it != end && image->str(it->key) == key) {
+            list.base = image->ids(it->ids);
+            list.baseCount = (size_t)it->ids.count;
+        }
+        auto found = added.find(key);
+        if (found != added.end()) list.added = &found->second;
+        return list;
+    }
+
+    vector<string> keys(const SnapshotKeyPostings* base, size_t baseCount,
+        const unordered_map<string, vector<SongId>>& added) const {
+        vector<string> all;
+        for (size_t i = 0; i < baseCount; ++i) all.push_back(string(image->str(base[i].key)));
+        for (const auto& kv : added) all.push_back(kv.first);
+        sort(all.begin(), all.end());
+        all.erase(unique(all.begin(), all.end()), all.end());
+        return all;
+    }
+};
+
+enum PredicateKind { MATCH_ALL, ARTIST_IS, GENRE_IS, YEAR_BETWEEN, KEYWORD, NAME_CONTAINS, ARTIST_CONTAINS, ALL_OF, ANY_OF, NOT };
+
+class Predicate {
+public:
+    PredicateKind kind;
+    string text;
+    int fromYear;
+    int toYear;
+    vector<Predicate> children;
+
+    Predicate(PredicateKind k = MATCH_ALL, string t = "", int from = 0, int to = 0)
+        : kind(k), text(t), fromYear(from), toYear(to) {}
+
+    static Predicate artistIs(const string& artistName) { return Predicate(ARTIST_IS, artistName); }
+    static Predicate genreIs(const string& genre) { return Predicate(GENRE_IS, genre); }
+    static Predicate yearBetween(int from, int to) { return Predicate(YEAR_BETWEEN, "", from, to); }
+    static Predicate keyword(const string& kw) { return Predicate(KEYWORD, foldString(kw)); }
+    static Predicate nameContains(const string& kw) { return Predicate(NAME_CONTAINS, foldString(kw)); }
+    static Predicate artistContains(const string& kw) { return Predicate(ARTIST_CONTAINS, foldString(kw)); }
+
+    static Predicate allOf(vector<Predicate> preds) {
+        Predicate p(ALL_OF);
+        p.children = move(preds);
+        return p;
+    }
+
+    static Predicate anyOf(vector<Predicate> preds) {
+        Predicate p(ANY_OF);
+        p.children = move(preds);
+        return p;
+    }
+
+    static Predicate negate(Predicate pred) {
+        Predicate p(NOT);
+        p.children.push_back(move(pred));
+        return p;
+    }
+
+    bool matches(const SongView& s) const {
+        switch (kind) {
+        case ARTIST_IS: return s.artistName == text;
+        case GENRE_IS: return s.genre == text;
+        case YEAR_BETWEEN: return s.releaseYear >= fromYear && s.releaseYear <= toYear;
+        case KEYWORD: return containsFolded(s.name, text) || containsFolded(s.artistName, text);
+        case NAME_CONTAINS: return containsFolded(s.name, text);
+        case ARTIST_CONTAINS: return containsFolded(s.artistName, text);
+        case ALL_OF:
+            for (const auto& c : children) if (!c.matches(s)) return false;
+            return true;
+        case ANY_OF:
+            for (const auto& c : children) if (c.matches(s)) return true;
+            return false;
+        case NOT: return !children[0].matches(s);
+        default: return true;
+        }
+    }
+};
+
+enum SortField { SORT_CATALOG, SORT_NAME, SORT_ARTIST, SORT_YEAR };
+
+class Collator {
+public:
+    string localeName;
+    locale loc;
+
+    // An empty name picks the locale from the environment; unknown names fall back to "C".
+    Collator(const string& name = "") : loc(locale::classic()) {
+        use(name);
+    }
+
+    void use(const string& name) {
+        try {
+            loc = locale(name.c_str());
+        }
+        catch (const runtime_error&) {
+            loc = locale::classic();
+        }
+        localeName = loc.name();
+    }
+
+    // Case-folded collation order first, original spelling as the tie-breaker.
+    string key(string_view text) const {
+        string folded = foldString(text);
+        string primary = use_facet<collate<char>>(loc).transform(folded.data(), folded.data() + folded.size());
+        primary += '\0';
+        primary.append(text);
+        return primary;
+    }
+};
+
+class CollationKeys {
+public:
+    Collator collator;
+    const SnapshotImage* image;
+    const SnapshotCollation* baseKeys;
+    const SnapshotSong* baseSongs;
+    size_t baseCount;
+    vector<string> nameKeys;
+    vector<string> artistKeys;
+    vector<int> years;
+
+    CollationKeys() : image(nullptr), baseKeys(nullptr), baseSongs(nullptr), baseCount(0) {}
+
+    void attach(const SnapshotImage& img) {
+        image = &img;
+        collator.use(string(img.str(img.meta->collationLocale)));
+        size_t keyCount = 0;
+        baseKeys = img.table<SnapshotCollation>(SEC_COLLATION, keyCount);
+        baseSongs = img.table<SnapshotSong>(SEC_SONGS, baseCount);
+        if (keyCount < baseCount) baseCount = keyCount;
+    }
+
+    void addSong(SongId id, const SongView& song) {
+        size_t slot = id - baseCount;
+        if (nameKeys.size() <= slot) {
+            nameKeys.resize(slot + 1);
+            artistKeys.resize(slot + 1);
+            years.resize(slot + 1);
+        }
+        nameKeys[slot] = collator.key(song.name);
+        artistKeys[slot] = collator.key(song.artistName);
+        years[slot] = song.releaseYear;
+    }
+
+    string_view nameKey(SongId id) const {
+        return id < baseCount ? image->str(baseKeys[id].nameKey) : string_view(nameKeys[id - baseCount]);
+    }
+
+    string_view artistKey(SongId id) const {
+        return id < baseCount ? image->str(baseKeys[id].artistKey) : string_view(artistKeys[id - baseCount]);
+    }
+
+    int year(SongId id) const {
+        return id < baseCount ? baseSongs[id].releaseYear : years[id - baseCount];
+    }
+
+    bool less(SortField field, SongId a, SongId b) const {
+        int cmp = 0;
+        if (field == SORT_NAME) {
+            cmp = nameKey(a).compare(nameKey(b));
+            if (cmp == 0) cmp = artistKey(a).compare(artistKey(b));
+        }
+        else if (field == SORT_ARTIST) {
+            cmp = artistKey(a).compare(artistKey(b));
+            if (cmp == 0) cmp = nameKey(a).compare(nameKey(b));
+        }
+        else if (field == SORT_YEAR) {
+            int ya = year(a), yb = year(b);
+            cmp = ya < yb ? -1 : (ya > yb ? 1 : 0);
+            if (cmp == 0) cmp = nameKey(a).compare(nameKey(b));
+        }
+        return cmp != 0 ? cmp < 0 : a < b;
+    }
+};
+
+// Sorted list split into bounded blocks, with a Fenwick tree over block
+// sizes so that rank lookups cost O(log n) and inserts O(log n + BLOCK).
+// Songs loaded from a snapshot stay in a mapped sorted array and are
+// merged with the blocks on read.
+class OrderedView {
+public:
+    static const size_t BLOCK = 512;
+    SortField field;
+    const SongId* base;
+    size_t baseCount;
+    vector<vector<SongId>> blocks;
+    vector<size_t> fenwick;
+    size_t count;
+
+    OrderedView(SortField f = SORT_NAME) : field(f), base(nullptr), baseCount(0), count(0) {}
+
+    void attach(const SongId* ids, size_t n) {
+        base = ids;
+        baseCount = n;
+    }
+
+    void insert(SongId id, const CollationKeys& keys) {
+        auto before = [&](SongId a, SongId b) { return keys.less(field, a, b); };
+        if (blocks.empty()) {
+            blocks.push_back(vector<SongId>(1, id));
+            ++count;
+            rebuildFenwick();
+            return;
+        }
+        size_t b = lower_bound(blocks.begin(), blocks.end(), id,
+            [&](const vector<SongId>& block, SongId v) { return before(block.back(), v); }) - blocks.begin();
+        if (b == blocks.size()) --b;
+        vector<SongId>& block = blocks[b];
+        block.insert(upper_bound(block.begin(), block.end(), id, before), id);
+        ++count;
+        if (block.size() > 2 * BLOCK) {
+            vector<SongId> upper(block.begin() + BLOCK, block.end());
+            block.resize(BLOCK);
+            blocks.insert(blocks.begin() + b + 1, move(upper));
+            rebuildFenwick();
+        }
+        else {
+            for (size_t i = b + 1; i < fenwick.size(); i += i & (0 - i)) ++fenwick[i];
+        }
+    }
+
+    // Sorts the batch once, then walks the blocks left to right so every id
+    // lands in its block without a search; the Fenwick tree is rebuilt once.
+    void insertBatch(vector<SongId> ids, const CollationKeys& keys) {
+        if (ids.empty()) return;
+        auto before = [&](SongId a, SongId b) { return keys.less(field, a, b); };
+        sort(ids.begin(), ids.end(), before);
+        if (blocks.empty()) blocks.push_back(vector<SongId>());
+        size_t b = 0;
+        for (SongId id : ids) {
+            while (b + 1 < blocks.size() && before(blocks[b].back(), id)) ++b;
+            vector<SongId>& block = blocks[b];
+            block.insert(upper_bound(block.begin(), block.end(), id, before), id);
+            if (block.size() > 2 * BLOCK) {
+                vector<SongId> upper(block.begin() + BLOCK, block.end());
+                block.resize(BLOCK);
+                blocks.insert(blocks.begin() + b + 1, move(upper));
+            }
+        }
+        count += ids.size();
+        rebuildFenwick();
+    }
+
+    vector<SongId> page(size_t offset, size_t n, const CollationKeys& keys) const {
+        vector<SongId> ids;
+        if (offset >= size()) return ids;
+        n = min(n, size() - offset);
+        ids.reserve(n);
+        if (baseCount == 0) {
+            appendAdded(ids, offset, n);
+            return ids;
+        }
+        size_t lo = offset > count ? offset - count : 0, hi = min(offset, baseCount);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2, j = offset - mid;
+            if (j > 0 && keys.less(field, base[mid], addedAt(j - 1))) lo = mid + 1;
+            else hi = mid;
+        }
+        size_t i = lo, j = offset - lo, b = 0, within = j < count ? locate(j, b) : 0;
+        while (ids.size() < n) {
+            bool takeBase = j >= count
+                || (i < baseCount && keys.less(field, base[i], blocks[b][within]));
+            if (takeBase) {
+                ids.push_back(base[i++]);
+                continue;
+            }
+            ids.push_back(blocks[b][within]);
+            ++j;
+            if (++within == blocks[b].size()) {
+                ++b;
+                within = 0;
+            }
+        }
+        return ids;
+    }
+
+    size_t size() const {
+        return baseCount + count;
+    }
+
+private:
+    SongId addedAt(size_t rank) const {
+        size_t b = 0, within = locate(rank, b);
+        return blocks[b][within];
+    }
+
+    void appendAdded(vector<SongId>& ids, size_t offset, size_t n) const {
+        size_t b = 0, within = locate(offset, b);
+        for (; b < blocks.size() && ids.size() < n; ++b, within = 0) {
+            size_t take = min(blocks[b].size() - within, n - ids.size());
+            ids.insert(ids.end(), blocks[b].begin() + within, blocks[b].begin() + within + take);
+        }
+    }
+
+    void rebuildFenwick() {
+        fenwick.assign(blocks.size() + 1, 0);
+        for (size_t i = 1; i < fenwick.size(); ++i) {
+            fenwick[i] += blocks[i - 1].size();
+            size_t parent = i + (i & (0 - i));
+            if (parent < fenwick.size()) fenwick[parent] += fenwick[i];
+        }
+    }
+
+    // Finds the block holding position rank and returns the offset inside it.
+    size_t locate(size_t rank, size_t& block) const {
+        size_t pos = 0, step = 1;
+        while (step * 2 < fenwick.size()) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (pos + step < fenwick.size() && fenwick[pos + step] <= rank) {
+                pos += step;
+                rank -= fenwick[pos];
+            }
+        }
+        block = pos;
+        return rank;
+    }
+};
+
+class SortedViews {
+public:
+    CollationKeys keys;
+    OrderedView byName;
+    OrderedView byArtist;
+    OrderedView byYear;
+
+    SortedViews() : byName(SORT_NAME), byArtist(SORT_ARTIST), byYear(SORT_YEAR) {}
+
+    void attach(const SnapshotImage& img) {
+        keys.attach(img);
+        size_t n = 0;
+        const SongId* ids = img.table<SongId>(SEC_ORDER_NAME, n);
+        byName.attach(ids, n);
+        ids = img.table<SongId>(SEC_ORDER_ARTIST, n);
+        byArtist.attach(ids, n);
+        ids = img.table<SongId>(SEC_ORDER_YEAR, n);
+        byYear.attach(ids, n);
+    }
+
+    void addSong(SongId id, const SongView& song) {
+        keys.addSong(id, song);
+        byName.insert(id, keys);
+        byArtist.insert(id, keys);
+        byYear.insert(id, keys);
+    }
+
+    template <class Catalog>
+    void addSongs(SongId first, SongId last, const Catalog& catalog) {
+        vector<SongId> ids;
+        ids.reserve(last - first);
+        for (SongId id = first; id < last; ++id) {
+            keys.addSong(id, catalog[id]);
+            ids.push_back(id);
+        }
+        // The views only share the keys, read-only, so large batches sort in parallel.
+        if (ids.size() < 4096) {
+            byName.insertBatch(ids, keys);
+            byArtist.insertBatch(ids, keys);
+            byYear.insertBatch(move(ids), keys);
+            return;
+        }
+        thread artist([&] { byArtist.insertBatch(ids, keys); });
+        thread year([&] { byYear.insertBatch(ids, keys); });
+        byName.insertBatch(ids, keys);
+        artist.join();
+        year.join();
+    }
+
+    const OrderedView& view(SortField field) const {
+        if (field == SORT_ARTIST) return byArtist;
+        if (field == SORT_YEAR) return byYear;
+        return byName;
+    }
+
+    vector<SongId> page(SortField field, size_t offset, size_t n) const {
+        return view(field).page(offset, n, keys);
+    }
+};
+
+class SongQuery {
+public:
+    Predicate where;
+    SortField orderBy;
+    bool descending;
+    size_t limit;
+
+    SongQuery(Predicate w = Predicate(), SortField o = SORT_CATALOG, bool desc = false, size_t lim = 0)
+        : where(w), orderBy(o), descending(desc), limit(lim) {}
+};
+
+class QueryCursor {
+public:
+    vector<SongId> ids;
+    size_t position;
+    string plan;
+
+    QueryCursor(vector<SongId> r = vector<SongId>(), string p = "")
+        : ids(move(r)), position(0), plan(p) {}
+
+    bool hasNext() const {
+        return position < ids.size();
+    }
+
+    SongId next() {
+        return ids[position++];
+    }
+
+    vector<SongId> fetch(size_t count) {
+        size_t end = min(ids.size(), position + count);
+        vector<SongId> page(ids.begin() + position, ids.begin() + end);
+        position = end;
+        return page;
+    }
+
+    void rewind() {
+        position = 0;
+    }
+
+    size_t size() const {
+        return ids.size();
+    }
+};
+
+class QueryPlanner {
+public:
+    const SongCatalog& catalog;
+    const TrigramIndex& searchIndex;
+    const AttributeIndex& attributeIndex;
+    const SortedViews& sortedViews;
+    string plan;
+
+    QueryPlanner(const SongCatalog& c, const TrigramIndex& s, const AttributeIndex& a, const SortedViews& v)
+        : catalog(c), searchIndex(s), attributeIndex(a), sortedViews(v) {}
+
+    QueryCursor run(const SongQuery& query) {
+        plan.clear();
+        if (query.orderBy != SORT_CATALOG && matchesEverything(query.where))
+            return QueryCursor(readView(query), plan);
+        vector<SongId> ids = candidates(query.where);
+        order(ids, query);
+        return QueryCursor(move(ids), plan);
+    }
+
+    bool indexable(const Predicate& p) const {
+        switch (p.kind) {
+        case ARTIST_IS: case GENRE_IS: case YEAR_BETWEEN: return true;
+        case KEYWORD: case NAME_CONTAINS: case ARTIST_CONTAINS: return p.text.size() >= 3;
+        case ALL_OF:
+            for (const auto& c : p.children) if (indexable(c)) return true;
+            return false;
+        case ANY_OF:
+            for (const auto& c : p.children) if (!indexable(c)) return false;
+            return !p.children.empty();
+        default: return false;
+        }
+    }
+
+    size_t estimate(const Predicate& p) const {
+        if (!indexable(p)) return catalog.size();
+        switch (p.kind) {
+        case ARTIST_IS: return attributeIndex.artist(p.text).size();
+        case GENRE_IS: return attributeIndex.genre(p.text).size();
+        case YEAR_BETWEEN: return attributeIndex.yearRangeCount(p.fromYear, p.toYear);
+        case KEYWORD: case NAME_CONTAINS: case ARTIST_CONTAINS: return searchIndex.estimate(p.text);
+        case ALL_OF: {
+            size_t best = catalog.size();
+            for (const auto& c : p.children) best = min(best, estimate(c));
+            return best;
+        }
+        case ANY_OF: {
+            size_t total = 0;
+            for (const auto& c : p.children) total += estimate(c);
+            return min(total, catalog.size());
+        }
+        default: return catalog.size();
+        }
+    }
+
+    // Returns the matching ids in catalog order.
+    vector<SongId> candidates(const Predicate& p) {
+        if (!indexable(p)) return scan(catalogIds(), p);
+        switch (p.kind) {
+        case ARTIST_IS: note("artist index"); return attributeIndex.artist(p.text).toVector();
+        case GENRE_IS: note("genre index"); return attributeIndex.genre(p.text).toVector();
+        case YEAR_BETWEEN: note("year index"); return attributeIndex.yearRange(p.fromYear, p.toYear);
+        case KEYWORD: case NAME_CONTAINS: case ARTIST_CONTAINS: {
+            note("trigram index");
+            vector<SongId> ids;
+            searchIndex.candidates(p.text, ids);
+            return scan(ids, p);
+        }
+        case ANY_OF: {
+            note("union");
+            vector<SongId> ids;
+            for (const auto& c : p.children) {
+                vector<SongId> part = candidates(c), merged;
+                set_union(ids.begin(), ids.end(), part.begin(), part.end(), back_inserter(merged));
+                ids.swap(merged);
+            }
+            return ids;
+        }
+        default:
+            return conjunction(p);
+        }
+    }
+
+    vector<SongId> conjunction(const Predicate& p) {
+        vector<pair<size_t, const Predicate*>> ranked;
+        for (const auto& c : p.children) ranked.push_back(make_pair(estimate(c), &c));
+        stable_sort(ranked.begin(), ranked.end(),
+            [](const pair<size_t, const Predicate*>& a, const pair<size_t, const Predicate*>& b) {
+                return a.first < b.first;
+            });
+        size_t driver = 0;
+        while (!indexable(*ranked[driver].second)) ++driver;
+        vector<SongId> ids = candidates(*ranked[driver].second);
+        for (size_t i = 0; i < ranked.size() && !ids.empty(); ++i) {
+            if (i == driver) continue;
+            const Predicate& c = *ranked[i].second;
+            bool exact = c.kind == ARTIST_IS || c.kind == GENRE_IS || c.kind == YEAR_BETWEEN;
+            if (exact && ranked[i].first <= 8 * ids.size()) {
+                vector<SongId> other = candidates(c);
+                note("intersect");
+                intersectSorted(ids, other);
+            }
+            else {
+                ids = scan(ids, c);
+            }
+        }
+        return ids;
+    }
+
+    vector<SongId> scan(const vector<SongId>& ids, const Predicate& p) {
+        note(ids.size() == catalog.size() ? "full scan" : "filter");
+        // Exact attribute tests read the catalog columns instead of building views.
+        if (p.kind == YEAR_BETWEEN) return catalog.scanYears(p.fromYear, p.toYear, &ids);
+        if (p.kind == GENRE_IS) return catalog.scanGenre(p.text, &ids);
+        if (p.kind == ARTIST_IS) return catalog.scanArtist(p.text, &ids);
+        if (p.kind == KEYWORD || p.kind == NAME_CONTAINS || p.kind == ARTIST_CONTAINS)
+            return catalog.scanText(p.text, p.kind != ARTIST_CONTAINS, p.kind != NAME_CONTAINS,
+                ids.size() == catalog.size() ? nullptr : &ids);
+        vector<SongId> kept;
+        for (SongId id : ids)
+            if (p.matches(catalog[id])) kept.push_back(id);
+        return kept;
+    }
+
+    static bool matchesEverything(const Predicate& p) {
+        return p.kind == MATCH_ALL || (p.kind == ALL_OF && p.children.empty());
+    }
+
+    vector<SongId> readView(const SongQuery& query) {
+        const OrderedView& view = sortedViews.view(query.orderBy);
+        size_t n = (query.limit == 0 || query.limit > view.size()) ? view.size() : query.limit;
+        note("sorted view");
+        if (!query.descending) return view.page(0, n, sortedViews.keys);
+        vector<SongId> ids = view.page(view.size() - n, n, sortedViews.keys);
+        reverse(ids.begin(), ids.end());
+        return ids;
+    }
+
+    vector<SongId> catalogIds() const {
+        vector<SongId> ids(catalog.size());
+        for (SongId id = 0; id < (SongId)ids.size(); ++id) ids[id] = id;
+        return ids;
+    }
+
+    void order(vector<SongId>& ids, const SongQuery& query) {
+        size_t keep = (query.limit == 0 || query.limit > ids.size()) ? ids.size() : query.limit;
+        if (query.orderBy == SORT_CATALOG) {
+            if (query.descending) reverse(ids.begin(), ids.end());
+            ids.resize(keep);
+            return;
+        }
+        const CollationKeys& keys = sortedViews.keys;
+        SortField field = query.orderBy;
+        bool desc = query.descending;
+        auto less = [&keys, field, desc](SongId a, SongId b) {
+            return desc ? keys.less(field, b, a) : keys.less(field, a, b);
+            };
+        note(keep < ids.size() ? "top-k sort" : "sort");
+        partial_sort(ids.begin(), ids.begin() + keep, ids.end(), less);
+        ids.resize(keep);
+    }
+
+    void note(const string& step) {
+        if (!plan.empty()) plan += " -> ";
+        plan += step;
+    }
+};
+
+enum JournalRecordKind {
+    J_ADD_SONG = 1, J_ADD_USER, J_CREATE_PLAYLIST, J_PLAYLIST_ADD_SONG, J_PLAYLIST_REMOVE_SONG,
+    J_USER_ADD_PLAYLIST, J_USER_DELETE_PLAYLIST, J_SAVE_SONG, J_UNSAVE_SONG, J_FAVORITE_SONG,
+    J_UNFAVORITE_SONG, J_EDIT_ARTIST, J_ARTIST_ADD_SONG, J_PLAYLIST_REMOVE_AT, J_PLAYLIST_MOVE,
+    J_SAVE_SONGS, J_UNSAVE_SONGS, J_FAVORITE_SONGS, J_UNFAVORITE_SONGS,
+    J_FOLLOW_PLAYLIST, J_UNFOLLOW_PLAYLIST, J_FORK_PLAYLIST
+};
+
+// On-disk form: [u32 payload length][u32 checksum][payload], where the payload
+// starts with the record kind and the checksum is the low half of its FNV-1a.
+class JournalRecord {
+public:
+    string data;
+
+    JournalRecord(JournalRecordKind kind) {
+        data.resize(8);
+        data += (char)kind;
+    }
+
+    JournalRecord& u32(uint32_t v) {
+        data.append((const char*)&v, sizeof(v));
+        return *this;
+    }
+
+    JournalRecord& i32(int32_t v) {
+        data.append((const char*)&v, sizeof(v));
+        return *this;
+    }
+
+    JournalRecord& str(string_view s) {
+        u32((uint32_t)s.size());
+        data.append(s.data(), s.size());
+        return *this;
+    }
+
+    JournalRecord& ids(const vector<SongId>& list) {
+        u32((uint32_t)list.size());
+        data.append((const char*)list.data(), list.size() * sizeof(SongId));
+        return *this;
+    }
+
+    const string& seal() {
+        uint32_t length = (uint32_t)(data.size() - 8);
+        uint32_t checksum = (uint32_t)fnv1a(data.data() + 8, length);
+        memcpy(&data[0], &length, 4);
+        memcpy(&data[4], &checksum, 4);
+        return data;
+    }
+};
+
+class JournalReader {
+public:
+    const char* p;
+    const char* end;
+    bool ok;
+
+    JournalReader(const char* b, const char* e) : p(b), end(e), ok(true) {}
+
+    uint32_t u32() {
+        uint32_t v = 0;
+        if (end - p < 4) {
+            ok = false;
+            return v;
+        }
+        memcpy(&v, p, 4);
+        p += 4;
+        return v;
+    }
+
+    int32_t i32() {
+        return (int32_t)u32();
+    }
+
+    string str() {
+        uint32_t n = u32();
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return "";
+        }
+        string s(p, n);
+        p += n;
+        return s;
+    }
+
+    vector<SongId> ids() {
+        uint32_t n = u32();
+        if (!ok || (size_t)(end - p) / sizeof(SongId) < n) {
+            ok = false;
+            return vector<SongId>();
+        }
+        vector<SongId> list(n);
+        memcpy(list.data(), p, n * sizeof(SongId));
+        p += n * sizeof(SongId);
+        return list;
+    }
+};
+
+const char JOURNAL_MAGIC[8] = { 'R', 'K', 'L', 'M', 'J', 'R', 'N', 'L' };
+const uint32_t JOURNAL_VERSION = 1;
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t baseChecksum;
+};
+
+// Append-only write-ahead log. Sessions append sealed records and wait on
+// their sequence number; a single writer thread drains whatever has queued
+// up since its last write and makes the whole batch durable with one fsync.
+class Journal {
+public:
+    string path;
+    uint64_t baseChecksum;
+    FILE* file;
+    // Read without the locks to report size and schedule compaction.
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> records;
+    atomic<uint64_t> batches;
+    mutex lock;
+    mutex fileLock;
+    condition_variable wake;
+    condition_variable flushed;
+    string pending;
+    uint64_t appendedSeq;
+    // Last record the writer is done with, whether its write succeeded or not.
+    uint64_t writtenSeq;
+    uint64_t durableSeq;
+    bool failed;
+    bool stopping;
+    thread writer;
+
+    Journal()
+        : baseChecksum(0), file(nullptr), bytes(0), records(0), batches(0),
+        appendedSeq(0), writtenSeq(0), durableSeq(0), failed(false), stopping(false) {}
+
+    ~Journal() {
+        close();
+    }
+
+    // Calls apply for every intact record, truncates a torn or corrupt tail
+    // and starts the writer. An intact record that does not apply means the
+    // log disagrees with what was acknowledged, so open fails rather than
+    // carry on from a different state. A journal written against a different snapshot
+    // is already contained in the current one and is discarded; with no
+    // snapshot loaded (checksum 0) there is nothing that could contain it,
+    // so such a journal is left alone and open fails.
+    template <class Apply>
+    bool open(const string& journalPath, uint64_t snapshotChecksum, Apply apply, string& report, string& error) {
+        path = journalPath;
+        baseChecksum = snapshotChecksum;
+        MappedFile existing;
+        size_t good = 0, replayed = 0;
+        bool stale = false;
+        if (existing.open(path)) {
+            JournalHeader header;
+            // Shorter than a header: torn while being created.
+            if (existing.size < sizeof(header)) stale = true;
+            else {
+                memcpy(&header, existing.data, sizeof(header));
+                if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header.version != JOURNAL_VERSION) {
+                    error = path + " is not a journal this version can read";
+                    return false;
+                }
+                stale = header.baseChecksum != baseChecksum;
+                if (stale && baseChecksum == 0) {
+                    error = path + " was written against a snapshot that is not loaded";
+                    return false;
+                }
+            }
+            if (!stale) {
+                good = sizeof(header);
+                while (existing.size - good >= 8) {
+                    uint32_t length, checksum;
+                    memcpy(&length, existing.data + good, 4);
+                    memcpy(&checksum, existing.data + good + 4, 4);
+                    const char* payload = existing.data + good + 8;
+                    if (length == 0 || length > existing.size - good - 8
+                        || (uint32_t)fnv1a(payload, length) != checksum)
+                        break;
+                    JournalReader in(payload + 1, payload + length);
+                    if (!apply((JournalRecordKind)(unsigned char)payload[0], in) || !in.ok) {
+                        error = path + ": record " + to_string(replayed + 1) + " at offset " + to_string(good) + " does not apply";
+                        return false;
+                    }
+                    ++replayed;
+                    good += 8 + length;
+                }
+                if (replayed || good < existing.size)
+                    report = "replayed " + to_string(replayed) + " journal records";
+                if (good < existing.size) report += ", discarded " + to_string(existing.size - good) + " trailing bytes";
+            }
+            else {
+                report = "discarded stale journal";
+            }
+        }
+        existing.close();
+        if (good == 0) {
+            if (!rewrite(error)) return false;
+        }
+        else {
+            file = fopen(path.c_str(), "r+b");
+            if (!file || fseek(file, (long)good, SEEK_SET) != 0) {
+                error = "cannot reopen " + path;
+                return false;
+            }
+            if (good < fileSize()) truncateAt(good);
+            bytes = good;
+        }
+        records = replayed;
+        writer = thread(&Journal::writerLoop, this);
+        return true;
+    }
+
+    uint64_t append(const string& sealed) {
+        lock_guard<mutex> guard(lock);
+        pending += sealed;
+        ++records;
+        uint64_t seq = ++appendedSeq;
+        wake.notify_one();
+        return seq;
+    }
+
+    bool waitDurable(uint64_t seq) {
+        unique_lock<mutex> guard(lock);
+        flushed.wait(guard, [&] { return durableSeq >= seq || failed; });
+        return !failed;
+    }
+
+    bool commit(const string& sealed) {
+        return waitDurable(append(sealed));
+    }
+
+    // Starts an empty journal on top of a freshly written snapshot. The
+    // snapshot holds every record appended so far, including any whose
+    // write failed, so once the new journal exists they count as durable
+    // and an earlier failure is forgotten.
+    bool reset(uint64_t snapshotChecksum, string& error) {
+        {
+            unique_lock<mutex> guard(lock);
+            flushed.wait(guard, [&] { return writtenSeq >= appendedSeq; });
+        }
+        {
+            lock_guard<mutex> io(fileLock);
+            if (file) fclose(file);
+            file = nullptr;
+            baseChecksum = snapshotChecksum;
+            if (!rewrite(error)) return false;
+        }
+        lock_guard<mutex> guard(lock);
+        durableSeq = appendedSeq;
+        failed = false;
+        flushed.notify_all();
+        return true;
+    }
+
+    void close() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            wake.notify_one();
+        }
+        if (writer.joinable()) writer.join();
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+private:
+    void writerLoop() {
+        string batch;
+        while (true) {
+            uint64_t seq;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return !pending.empty() || stopping; });
+                if (pending.empty()) return;
+                batch.swap(pending);
+                seq = appendedSeq;
+            }
+            bool ok;
+            {
+                lock_guard<mutex> io(fileLock);
+                ok = file && fwrite(batch.data(), 1, batch.size(), file) == batch.size() && syncFile(file);
+                if (ok) bytes += batch.size();
+            }
+            batch.clear();
+            lock_guard<mutex> guard(lock);
+            writtenSeq = seq;
+            if (ok) {
+                durableSeq = seq;
+                ++batches;
+            }
+            else {
+                failed = true;
+            }
+            flushed.notify_all();
+        }
+    }
+
+    bool rewrite(string& error) {
+        JournalHeader header = {};
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        header.version = JOURNAL_VERSION;
+        header.baseChecksum = baseChecksum;
+        string tmp = path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "wb");
+        bool ok = out && fwrite(&header, sizeof(header), 1, out) == 1 && syncFile(out);
+        if (out) ok = fclose(out) == 0 && ok;
+        if (!ok || !replaceFile(tmp, path)) {
+            error = "cannot create " + path;
+            return false;
+        }
+        file = fopen(path.c_str(), "ab");
+        if (!file) {
+            error = "cannot open " + path;
+            return false;
+        }
+        bytes = sizeof(header);
+        return true;
+    }
+
+    uint64_t fileSize() {
+        long here = ftell(file);
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, here, SEEK_SET);
+        return (uint64_t)size;
+    }
+
+    void truncateAt(size_t size) {
+        fflush(file);
+#ifdef _WIN32
+        _chsize_s(_fileno(file), (long long)size);
+#else
+        if (ftruncate(fileno(file), (off_t)size) != 0) return;
+#endif
+        fseek(file, (long)size, SEEK_SET);
+    }
+};
+
+// Shuffle order over playlist positions, drawn one step at a time from a
+// lazy Fisher-Yates permutation. Only swapped slots are stored, so memory
+// grows with the songs played in the current cycle, not with the playlist.
+// Every position plays once per cycle; previous walks back through the
+// positions already drawn.
+class ShuffleOrder {
+public:
+    uint64_t state;
+    size_t count;
+    vector<uint32_t> played;
+    size_t cursor;
+    unordered_map<uint32_t, uint32_t> slots;
+
+    ShuffleOrder() : state(0), count(0), cursor(0) {}
+
+    bool active() const {
+        return !played.empty();
+    }
+
+    void seed(uint64_t s) {
+        state = s;
+    }
+
+    // SplitMix64.
+    uint64_t nextRandom() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t below(uint32_t n) {
+        return (uint32_t)(((nextRandom() >> 32) * n) >> 32);
+    }
+
+    uint32_t at(uint32_t index) const {
+        auto it = slots.find(index);
+        return it == slots.end() ? index : it->second;
+    }
+
+    // Moves the value at index j to the front of the undrawn range and draws it.
+    void take(uint32_t j) {
+        uint32_t k = (uint32_t)played.size();
+        uint32_t value = at(j);
+        if (j != k) slots[j] = at(k);
+        slots.erase(k);
+        played.push_back(value);
+        cursor = played.size() - 1;
+    }
+
+    // Starts a cycle over n positions with first as the current song.
+    void start(size_t n, size_t first) {
+        count = n;
+        played.clear();
+        slots.clear();
+        cursor = 0;
+        if (n > 0) take((uint32_t)(first < n ? first : 0));
+    }
+
+    void stop() {
+        count = 0;
+        played.clear();
+        slots.clear();
+        cursor = 0;
+    }
+
+    size_t current() const {
+        return played[cursor];
+    }
+
+    size_t next() {
+        if (cursor + 1 < played.size()) return played[++cursor];
+        if (played.size() == count) {
+            uint32_t last = played[cursor];
+            played.clear();
+            slots.clear();
+            // Avoid replaying the last song of a cycle as the first of the next.
+            uint32_t j = below((uint32_t)count);
+            if (count > 1 && j == last) j = (j + 1 + below((uint32_t)count - 1)) % count;
+            take(j);
+            return played[cursor];
+        }
+        take((uint32_t)played.size() + below((uint32_t)(count - played.size())));
+        return played[cursor];
+    }
+
+    size_t previous() {
+        if (cursor > 0) --cursor;
+        return played[cursor];
+    }
+
+    // Appended positions join the undrawn part of the current cycle.
+    void grow(size_t n) {
+        count = n;
+    }
+
+    // The edits below renumber the drawn history and rebuild the undrawn
+    // range from it, which costs O(songs played this cycle).
+
+    // A position was inserted at p; it joins the undrawn range.
+    void insert(size_t p) {
+        for (auto& v : played)
+            if (v >= p) ++v;
+        ++count;
+        rebuild();
+    }
+
+    // Position p was erased and later positions shifted down by one. If the
+    // current song was removed, the cursor falls back to the song played
+    // before it.
+    void remove(size_t p) {
+        size_t kept = 0, newCursor = 0;
+        for (size_t t = 0; t < played.size(); ++t) {
+            if (played[t] == p) continue;
+            if (t <= cursor) newCursor = kept;
+            played[kept++] = played[t] > p ? played[t] - 1 : played[t];
+        }
+        played.resize(kept);
+        cursor = newCursor;
+        --count;
+        rebuild();
+        if (played.empty() && count > 0) take(below((uint32_t)count));
+    }
+
+    // The song at from moved to to; whether it was played is unchanged.
+    void move(size_t from, size_t to) {
+        for (auto& v : played) {
+            if (v == from) v = (uint32_t)to;
+            else if (from < to && v > from && v <= to) --v;
+            else if (to < from && v >= to && v < from) ++v;
+        }
+        rebuild();
+    }
+
+    void rebuild() {
+        slots.clear();
+        unordered_map<uint32_t, uint32_t> where;
+        for (uint32_t t = 0; t < played.size(); ++t) {
+            uint32_t value = played[t];
+            auto w = where.find(value);
+            uint32_t i = w == where.end() ? value : w->second;
+            uint32_t displaced = at(t);
+            if (i != t) {
+                slots[i] = displaced;
+                where[displaced] = i;
+            }
+        }
+        for (uint32_t t = 0; t < played.size(); ++t) slots.erase(t);
+    }
+};
+
+// Sequence of playlist entries kept as an implicit treap over node arrays.
+// Inserting, erasing and moving by position, reading the entry at a
+// position and the position of an entry are all O(log n) expected.
+class PlaylistOrder {
+public:
+    static const uint32_t NIL = (uint32_t)-1;
+    vector<uint32_t> left, right, parent, weight, priority;
+    uint32_t root;
+    uint32_t seed;
+
+    PlaylistOrder() : root(NIL), seed(2463534242u) {}
+
+    size_t size() const {
+        return root == NIL ? 0 : weight[root];
+    }
+
+    uint32_t weightOf(uint32_t n) const {
+        return n == NIL ? 0 : weight[n];
+    }
+
+    void pull(uint32_t n) {
+        weight[n] = 1 + weightOf(left[n]) + weightOf(right[n]);
+        if (left[n] != NIL) parent[left[n]] = n;
+        if (right[n] != NIL) parent[right[n]] = n;
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (a == NIL) return b;
+        if (b == NIL) return a;
+        if (priority[a] > priority[b]) {
+            right[a] = merge(right[a], b);
+            pull(a);
+            return a;
+        }
+        left[b] = merge(a, left[b]);
+        pull(b);
+        return b;
+    }
+
+    // The first k entries of t go to a, the rest to b.
+    void split(uint32_t t, size_t k, uint32_t& a, uint32_t& b) {
+        if (t == NIL) {
+            a = b = NIL;
+            return;
+        }
+        if (weightOf(left[t]) < k) {
+            split(right[t], k - weightOf(left[t]) - 1, right[t], b);
+            a = t;
+        }
+        else {
+            split(left[t], k, a, left[t]);
+            b = t;
+        }
+        pull(t);
+    }
+
+    void setRoot(uint32_t n) {
+        root = n;
+        if (n != NIL) parent[n] = NIL;
+    }
+
+    void insert(size_t position, uint32_t node) {
+        if (node >= weight.size()) {
+            size_t n = node + 1;
+            left.resize(n);
+            right.resize(n);
+            parent.resize(n);
+            weight.resize(n);
+            priority.resize(n);
+        }
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        left[node] = right[node] = parent[node] = NIL;
+        weight[node] = 1;
+        priority[node] = seed;
+        uint32_t a, b;
+        split(root, position, a, b);
+        setRoot(merge(merge(a, node), b));
+    }
+
+    void erase(size_t position) {
+        uint32_t a, b, mid;
+        split(root, position, a, b);
+        split(b, 1, mid, b);
+        setRoot(merge(a, b));
+    }
+
+    uint32_t at(size_t position) const {
+        uint32_t n = root;
+        while (true) {
+            size_t l = weightOf(left[n]);
+            if (position < l) n = left[n];
+            else if (position == l) return n;
+            else {
+                position -= l + 1;
+                n = right[n];
+            }
+        }
+    }
+
+    size_t positionOf(uint32_t n) const {
+        size_t position = weightOf(left[n]);
+        while (parent[n] != NIL) {
+            uint32_t p = parent[n];
+            if (right[p] == n) position += weightOf(left[p]) + 1;
+            n = p;
+        }
+        return position;
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        vector<uint32_t> stack;
+        uint32_t n = root;
+        while (n != NIL || !stack.empty()) {
+            while (n != NIL) {
+                stack.push_back(n);
+                n = left[n];
+            }
+            n = stack.back();
+            stack.pop_back();
+            f(n);
+            n = right[n];
+        }
+    }
+
+    void clear() {
+        left.clear();
+        right.clear();
+        parent.clear();
+        weight.clear();
+        priority.clear();
+        root = NIL;
+    }
+};
+
+// Collects output and hands it to the stream in large writes instead of
+// flushing line by line.
+class OutputBuffer {
+public:
+    ostream& out;
+    string text;
+
+    OutputBuffer(ostream& o = cout) : out(o) {}
+
+    ~OutputBuffer() {
+        flush();
+    }
+
+    OutputBuffer& operator<<(string_view s) {
+        text.append(s.data(), s.size());
+        if (text.size() >= (1 << 16)) flush();
+        return *this;
+    }
+
+    OutputBuffer& operator<<(const char* s) {
+        return *this << string_view(s);
+    }
+
+    OutputBuffer& operator<<(char c) {
+        text += c;
+        return *this;
+    }
+
+    template <class T>
+    typename enable_if<is_integral<T>::value, OutputBuffer&>::type operator<<(T value) {
+        return *this << string_view(to_string(value));
+    }
+
+    OutputBuffer& operator<<(double value) {
+        char digits[32];
+        snprintf(digits, sizeof digits, "%g", value);
+        return *this << digits;
+    }
+
+    void flush() {
+        out.write(text.data(), (streamsize)text.size());
+        text.clear();
+    }
+};
+
+// Position in a paged list: page size, current page, and moves between
+// pages. Pages count from 0 here and are shown from 1.
+class PageCursor {
+public:
+    static const size_t PAGE_SIZE = 20;
+    size_t total;
+    size_t pageSize;
+    size_t page;
+
+    PageCursor(size_t n = 0, size_t size = PAGE_SIZE) : total(n), pageSize(max<size_t>(size, 1)), page(0) {}
+
+    size_t pages() const {
+        return total == 0 ? 1 : (total + pageSize - 1) / pageSize;
+    }
+
+    size_t first() const {
+        return page * pageSize;
+    }
+
+    size_t last() const {
+        return min(total, first() + pageSize);
+    }
+
+    bool jump(size_t p) {
+        if (p >= pages()) return false;
+        page = p;
+        return true;
+    }
+
+    bool next() {
+        return jump(page + 1);
+    }
+
+    bool previous() {
+        return page > 0 && jump(page - 1);
+    }
+
+    // For lists that other sessions may change between pages.
+    void resize(size_t n) {
+        total = n;
+        page = min(page, pages() - 1);
+    }
+};
+
+void renderPageFooter(OutputBuffer& out, const PageCursor& cursor, const char* noun) {
+    if (cursor.pages() > 1)
+        out << "Page " << cursor.page + 1 << " of " << cursor.pages() << " (" << cursor.total << ' ' << noun << ")\n";
+}
+
+// A song list read a page at a time: its length and a function returning
+// the ids in [offset, offset + count). Backed by an index, a sorted view or
+// the catalog itself, so rendering a page never walks the whole list.
+struct SongPages {
+    size_t total;
+    function<vector<SongId>(size_t, size_t)> fetch;
+
+    SongPages(size_t n, function<vector<SongId>(size_t, size_t)> f) : total(n), fetch(move(f)) {}
+
+    static SongPages of(vector<SongId> ids) {
+        auto shared = make_shared<vector<SongId>>(move(ids));
+        return SongPages(shared->size(), [shared](size_t offset, size_t count) {
+            return vector<SongId>(shared->begin() + offset, shared->begin() + offset + count);
+        });
+    }
+
+    static SongPages of(const PostingList& list) {
+        return SongPages(list.size(), [list](size_t offset, size_t count) { return list.slice(offset, count); });
+    }
+};
+
+// A playlist is a sequence of entries; the same song may appear more than
+// once and every edit addresses a single entry. Entry ids are stable, the
+// order lives in a PlaylistOrder and a hash index maps each song to its
+// entries, so membership is O(1) and positional edits O(log n). The current
+// entry is tracked by id and stays put while the rest of the list changes.
+// In AUTOPLAY mode, playback that runs past the last entry goes on with
+// songs suggested by MusicSystem; those are kept apart from the entries.
+class Playlist {
+public:
+    static const uint32_t NO_ENTRY = PlaylistOrder::NIL;
+    static const size_t AUTOPLAY_HISTORY = 50;
+    string name;
+    PlaybackMode playbackMode;
+    PlaylistOrder order;
+    vector<SongId> entrySong;
+    vector<uint32_t> entrySlot;
+    vector<uint32_t> freeEntries;
+    unordered_map<SongId, vector<uint32_t>> entriesOf;
+    uint32_t currentEntry;
+    ShuffleOrder shuffle;
+    // Suggested songs played since the end of the list, the current one
+    // last; currentEntry stays on the last entry meanwhile.
+    vector<SongId> autoplayed;
+
+    Playlist(string n = "")
+        : name(n), playbackMode(SEQUENTIAL), currentEntry(NO_ENTRY) {}
+
+    size_t size() const {
+        return order.size();
+    }
+
+    int getNumberOfSongs() const {
+        return (int)order.size();
+    }
+
+    bool contains(SongId song) const {
+        return entriesOf.count(song) > 0;
+    }
+
+    SongId songAt(size_t position) const {
+        return entrySong[order.at(position)];
+    }
+
+    vector<SongId> songList() const {
+        vector<SongId> list;
+        list.reserve(size());
+        order.forEach([&](uint32_t entry) { list.push_back(entrySong[entry]); });
+        return list;
+    }
+
+    // Each song once, in no particular order.
+    vector<SongId> distinctSongs() const {
+        vector<SongId> list;
+        list.reserve(entriesOf.size());
+        for (const auto& kv : entriesOf) list.push_back(kv.first);
+        return list;
+    }
+
+    void assign(const vector<SongId>& list) {
+        order.clear();
+        entrySong.clear();
+        entrySlot.clear();
+        freeEntries.clear();
+        entriesOf.clear();
+        shuffle.stop();
+        currentEntry = NO_ENTRY;
+        autoplayed.clear();
+        for (SongId song : list) addSong(song);
+    }
+
+    void insertSong(size_t position, SongId song) {
+        METRIC_SCOPE(OP_PLAYLIST_ADD);
+        if (position > size()) position = size();
+        uint32_t entry;
+        if (!freeEntries.empty()) {
+            entry = freeEntries.back();
+            freeEntries.pop_back();
+            entrySong[entry] = song;
+        }
+        else {
+            entry = (uint32_t)entrySong.size();
+            entrySong.push_back(song);
+            entrySlot.push_back(0);
+        }
+        vector<uint32_t>& entries = entriesOf[song];
+        entrySlot[entry] = (uint32_t)entries.size();
+        entries.push_back(entry);
+        order.insert(position, entry);
+        if (currentEntry == NO_ENTRY) currentEntry = entry;
+        if (!shuffle.active()) return;
+        if (position + 1 == size()) shuffle.grow(size());
+        else shuffle.insert(position);
+    }
+
+    void addSong(SongId song) {
+        insertSong(size(), song);
+    }
+
+    bool removeAt(size_t position) {
+        METRIC_SCOPE(OP_PLAYLIST_REMOVE);
+        if (position >= size()) return false;
+        uint32_t entry = order.at(position);
+        order.erase(position);
+        vector<uint32_t>& entries = entriesOf[entrySong[entry]];
+        uint32_t last = entries.back();
+        entries[entrySlot[entry]] = last;
+        entrySlot[last] = entrySlot[entry];
+        entries.pop_back();
+        if (entries.empty()) entriesOf.erase(entrySong[entry]);
+        freeEntries.push_back(entry);
+        if (shuffle.active()) shuffle.remove(position);
+        if (size() == 0) autoplayed.clear();
+        if (entry == currentEntry) {
+            if (size() == 0) currentEntry = NO_ENTRY;
+            else if (shuffle.active()) currentEntry = order.at(shuffle.current());
+            else currentEntry = order.at(position < size() ? position : 0);
+        }
+        return true;
+    }
+
+    // Removes every entry of song.
+    void removeSong(SongId song) {
+        auto it = entriesOf.find(song);
+        if (it == entriesOf.end()) return;
+        vector<size_t> positions;
+        for (uint32_t entry : it->second) positions.push_back(order.positionOf(entry));
+        sort(positions.rbegin(), positions.rend());
+        for (size_t position : positions) removeAt(position);
+    }
+
+    bool moveSong(size_t from, size_t to) {
+        if (from >= size() || to >= size()) return false;
+        if (from == to) return true;
+        uint32_t entry = order.at(from);
+        order.erase(from);
+        order.insert(to, entry);
+        if (shuffle.active()) shuffle.move(from, to);
+        return true;
+    }
+
+    size_t currentPosition() const {
+        return currentEntry == NO_ENTRY ? 0 : order.positionOf(currentEntry);
+    }
+
+    void setCurrentPosition(size_t position) {
+        if (position >= size()) return;
+        currentEntry = order.at(position);
+        autoplayed.clear();
+        if (shuffle.active()) shuffle.start(size(), position);
+    }
+
+    // Reproducible shuffles: the same seed gives the same order.
+    void seedShuffle(uint64_t seed) {
+        shuffle.seed(seed);
+        if (playbackMode == SHUFFLE && size() > 0) shuffle.start(size(), currentPosition());
+    }
+
+    void startShuffle() {
+        if (shuffle.state == 0) shuffle.seed(((uint64_t)rand() << 32) ^ (uint64_t)rand());
+        shuffle.start(size(), currentPosition());
+    }
+
+    bool autoplaying() const {
+        return !autoplayed.empty();
+    }
+
+    // True when the next step would run past the last entry.
+    bool atEnd() const {
+        return size() > 0 && (autoplaying() || currentPosition() + 1 == size());
+    }
+
+    void autoplay(SongId song) {
+        autoplayed.push_back(song);
+        if (autoplayed.size() > AUTOPLAY_HISTORY) autoplayed.erase(autoplayed.begin());
+    }
+
+    void nextSong() {
+        METRIC_SCOPE(OP_PLAY_NEXT);
+        if (size() == 0) return;
+        size_t position;
+        if (autoplaying()) {
+            autoplayed.clear();
+            position = 0;
+        }
+        else if (playbackMode == SHUFFLE) {
+            if (!shuffle.active()) startShuffle();
+            position = shuffle.next();
+        }
+        else {
+            position = (currentPosition() + 1) % size();
+        }
+        currentEntry = order.at(position);
+    }
+
+    void previousSong() {
+        METRIC_SCOPE(OP_PLAY_PREVIOUS);
+        if (autoplaying()) {
+            autoplayed.pop_back();
+            return;
+        }
+        if (size() == 0) return;
+        size_t position;
+        if (playbackMode == SHUFFLE) {
+            if (!shuffle.active()) startShuffle();
+            position = shuffle.previous();
+        }
+        else {
+            position = currentPosition();
+            position = position > 0 ? position - 1 : size() - 1;
+        }
+        currentEntry = order.at(position);
+    }
+
+    SongId currentSong() const {
+        if (autoplaying())
+            return autoplayed.back();
+        if (currentEntry == NO_ENTRY)
+            return NO_SONG;
+        return entrySong[currentEntry];
+    }
+
+    void setPlaybackMode(PlaybackMode mode) {
+        playbackMode = mode;
+        if (mode != AUTOPLAY) autoplayed.clear();
+        if (mode != SHUFFLE) shuffle.stop();
+        else if (size() > 0) startShuffle();
+    }
+
+    void displaySongs(const SongCatalog& catalog, const PageCursor& cursor) const {
+        OutputBuffer out;
+        out << "Playlist: " << name << " (" << getNumberOfSongs() << " songs)\n";
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            SongView s = catalog[songAt(i)];
+            out << i + 1 << ". " << s.name
+                << " by " << s.artistName
+                << " (" << s.releaseYear << ", " << s.genre << ")\n";
+        }
+        renderPageFooter(out, cursor, "songs");
+    }
+};
+
+// Name-keyed collection with O(1) lookup. Elements are heap-allocated and
+// reference-counted, so pointers handed out by find and add stay valid
+// while other elements are added or erased, and share() lets other owners
+// (e.g. followers of a playlist) keep an element alive. Names are unique;
+// an element's name must not change while it is stored.
+template <class T, string T::*Key>
+class NamedList {
+public:
+    typedef list<shared_ptr<T>> Items;
+
+    // Iterates the elements themselves rather than their shared pointers.
+    template <class It, class V>
+    class Iterator {
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        It it;
+
+        Iterator(It i) : it(i) {}
+        V& operator*() const { return **it; }
+        V* operator->() const { return it->get(); }
+        Iterator& operator++() { ++it; return *this; }
+        bool operator==(const Iterator& other) const { return it == other.it; }
+        bool operator!=(const Iterator& other) const { return it != other.it; }
+    };
+
+    typedef Iterator<typename Items::iterator, T> iterator;
+    typedef Iterator<typename Items::const_iterator, const T> const_iterator;
+
+    Items items;
+    unordered_map<string, typename Items::iterator> index;
+
+    T* find(const string& name) {
+        auto it = index.find(name);
+        return it == index.end() ? nullptr : it->second->get();
+    }
+
+    const T* find(const string& name) const {
+        auto it = index.find(name);
+        return it == index.end() ? nullptr : it->second->get();
+    }
+
+    shared_ptr<T> share(const string& name) const {
+        auto it = index.find(name);
+        return it == index.end() ? nullptr : *it->second;
+    }
+
+    // Returns nullptr if the name is already taken.
+    T* add(T item) {
+        if (index.count(item.*Key)) return nullptr;
+        items.push_back(make_shared<T>(move(item)));
+        auto it = prev(items.end());
+        index.emplace((**it).*Key, it);
+        return it->get();
+    }
+
+    bool erase(const string& name) {
+        auto it = index.find(name);
+        if (it == index.end()) return false;
+        items.erase(it->second);
+        index.erase(it);
+        return true;
+    }
+
+    void clear() {
+        items.clear();
+        index.clear();
+    }
+
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    T& back() { return *items.back(); }
+    iterator begin() { return iterator(items.begin()); }
+    iterator end() { return iterator(items.end()); }
+    const_iterator begin() const { return const_iterator(items.begin()); }
+    const_iterator end() const { return const_iterator(items.end()); }
+};
+
+typedef NamedList<Playlist, &Playlist::name> PlaylistList;
+
+// A playlist's name and length, copied out under its lock for display.
+struct PlaylistSummary {
+    string name;
+    size_t songs;
+};
+
+// A followed playlist: the owner's own copy, shared with every follower.
+typedef shared_ptr<const Playlist> SharedPlaylist;
+
+class Artist {
+public:
+    string name;
+    int numberOfAlbums;
+    int numberOfReleasedSongs;
+    vector<SongId> releasedSongs;
+
+    Artist(string n = "", int albums = 0)
+        : name(n), numberOfAlbums(albums), numberOfReleasedSongs(0) {}
+
+    void addSong(SongId song) {
+        releasedSongs.push_back(song);
+        numberOfReleasedSongs = (int)releasedSongs.size();
+    }
+
+    void editArtist(int albums) {
+        numberOfAlbums = albums;
+    }
+
+    void displayInfo(const SongCatalog& catalog, const PageCursor& cursor) const {
+        OutputBuffer out;
+        out << "Artist: " << name << "\nAlbums: " << numberOfAlbums
+            << "\nReleased Songs: " << numberOfReleasedSongs << '\n';
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            out << "- " << catalog[releasedSongs[i]].name << "\n";
+        }
+        renderPageFooter(out, cursor, "songs");
+    }
+};
+
+// Insertion-ordered set of songs. Removal leaves a hole that iteration
+// skips; holes are squeezed out once they make up half the slots, so
+// contains is O(1) and add and remove O(log n) amortized. A Fenwick tree
+// counts the songs left in each run of slots, so positional access skips
+// holes in O(log n) instead of compacting.
+class SongSet {
+public:
+    vector<SongId> slots;
+    unordered_map<SongId, uint32_t> index;
+    // 1-based over slots; fenwick[0] is unused.
+    vector<uint32_t> fenwick;
+
+    size_t size() const {
+        return index.size();
+    }
+
+    bool empty() const {
+        return index.empty();
+    }
+
+    bool contains(SongId song) const {
+        return index.count(song) > 0;
+    }
+
+    bool add(SongId song) {
+        if (!index.emplace(song, (uint32_t)slots.size()).second) return false;
+        slots.push_back(song);
+        // The new node covers (i - lowbit(i), i]: its children plus itself.
+        if (fenwick.empty()) fenwick.push_back(0);
+        size_t i = slots.size();
+        uint32_t covered = 1;
+        for (size_t j = i - 1; j > i - (i & (0 - i)); j -= j & (0 - j)) covered += fenwick[j];
+        fenwick.push_back(covered);
+        return true;
+    }
+
+    bool remove(SongId song) {
+        auto it = index.find(song);
+        if (it == index.end()) return false;
+        slots[it->second] = NO_SONG;
+        for (size_t i = it->second + 1; i < fenwick.size(); i += i & (0 - i)) --fenwick[i];
+        index.erase(it);
+        if (index.size() * 2 < slots.size()) compact();
+        return true;
+    }
+
+    // Both return how many songs changed and, given changed, list them.
+    size_t addAll(const vector<SongId>& songs, vector<SongId>* changed = nullptr) {
+        size_t added = 0;
+        index.reserve(index.size() + songs.size());
+        for (SongId song : songs)
+            if (add(song)) {
+                ++added;
+                if (changed) changed->push_back(song);
+            }
+        return added;
+    }
+
+    size_t removeAll(const vector<SongId>& songs, vector<SongId>* changed = nullptr) {
+        size_t removed = 0;
+        for (SongId song : songs)
+            if (remove(song)) {
+                ++removed;
+                if (changed) changed->push_back(song);
+            }
+        return removed;
+    }
+
+    template <class It>
+    void assign(It first, It last) {
+        slots.clear();
+        index.clear();
+        fenwick.clear();
+        for (; first != last; ++first) add(*first);
+    }
+
+    void compact() {
+        size_t kept = 0;
+        for (SongId song : slots) {
+            if (song == NO_SONG) continue;
+            index[song] = (uint32_t)kept;
+            slots[kept++] = song;
+        }
+        slots.resize(kept);
+        fenwick.assign(kept + 1, 0);
+        for (size_t i = 1; i < fenwick.size(); ++i) {
+            fenwick[i] += 1;
+            size_t parent = i + (i & (0 - i));
+            if (parent < fenwick.size()) fenwick[parent] += fenwick[i];
+        }
+    }
+
+    // Song at position i in insertion order, holes not counted.
+    SongId at(size_t i) const {
+        size_t pos = 0, step = 1;
+        while (step * 2 < fenwick.size()) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (pos + step < fenwick.size() && fenwick[pos + step] <= i) {
+                pos += step;
+                i -= fenwick[pos];
+            }
+        }
+        return slots[pos];
+    }
+
+    vector<SongId> toVector() const {
+        vector<SongId> list;
+        list.reserve(size());
+        for (SongId song : slots)
+            if (song != NO_SONG) list.push_back(song);
+        return list;
+    }
+};
+
+class User {
+public:
+    string username;
+    string password;
+    SongSet savedSongs;
+    SongSet favoriteSongs;
+    vector<SharedPlaylist> favoritePlaylists;
+    PlaylistList personalPlaylists;
+
+    User(string u = "", string p = "") : username(u), password(p) {}
+
+    bool checkPassword(const string& p) {
+        return password == p;
+    }
+
+    bool addToSavedSongs(SongId song) {
+        return savedSongs.add(song);
+    }
+
+    bool removeFromSavedSongs(SongId song) {
+        return savedSongs.remove(song);
+    }
+
+    bool addToFavoriteSongs(SongId song) {
+        return favoriteSongs.add(song);
+    }
+
+    bool removeFromFavoriteSongs(SongId song) {
+        return favoriteSongs.remove(song);
+    }
+
+    bool addPlaylist(const Playlist& playlist) {
+        return personalPlaylists.add(playlist) != nullptr;
+    }
+
+    void deletePlaylist(const string& playlistName) {
+        personalPlaylists.erase(playlistName);
+    }
+
+    Playlist* findPlaylist(const string& playlistName) {
+        return personalPlaylists.find(playlistName);
+    }
+
+    bool follows(const Playlist* playlist) const {
+        for (const auto& p : favoritePlaylists)
+            if (p.get() == playlist) return true;
+        return false;
+    }
+
+    void displaySavedSongs(const SongCatalog& catalog, const PageCursor& cursor) {
+        OutputBuffer out;
+        out << "Saved Songs:\n";
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            SongView s = catalog[savedSongs.at(i)];
+            out << i + 1 << ". " << s.name << " by " << s.artistName << '\n';
+        }
+        renderPageFooter(out, cursor, "songs");
+    }
+
+    void displayFavoriteSongs(const SongCatalog& catalog, const PageCursor& cursor) {
+        OutputBuffer out;
+        out << "Favorite Songs:\n";
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            SongView s = catalog[favoriteSongs.at(i)];
+            out << i + 1 << ". " << s.name << " by " << s.artistName << '\n';
+        }
+        renderPageFooter(out, cursor, "songs");
+    }
+
+    // Both take summaries from MusicSystem, which reads them under the
+    // playlists' locks.
+    void displayFavoritePlaylists(const vector<PlaylistSummary>& list, const PageCursor& cursor) {
+        OutputBuffer out;
+        out << "Favorite Playlists:\n";
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            out << i + 1 << ". " << list[i].name << " (" << list[i].songs << " songs)\n";
+        }
+        renderPageFooter(out, cursor, "playlists");
+    }
+
+    void displayPersonalPlaylists(const vector<PlaylistSummary>& list, const PageCursor& cursor) {
+        OutputBuffer out;
+        out << "Personal Playlists:\n";
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            out << i + 1 << ". " << list[i].name << " (" << list[i].songs << " songs)\n";
+        }
+        renderPageFooter(out, cursor, "playlists");
+    }
+};
+
+class Admin {
+public:
+    string username;
+    string password;
+
+    Admin(string u = "admin", string p = "password") : username(u), password(p) {}
+
+    bool login(const string& u, const string& p) {
+        return (username == u && password == p);
+    }
+};
+
+typedef NamedList<User, &User::username> UserList;
+
+// Exact per-song counts kept in count order. Songs with the same count
+// share a bucket and buckets run from the highest count down, so a +1 or -1
+// moves a song to a neighbouring bucket in O(1) and the top k are the first
+// k songs of the walk. Among equal counts, the song that got there first
+// leads.
+class CountChart {
+public:
+    struct Bucket {
+        uint64_t count;
+        list<SongId> songs;
+    };
+
+    struct Entry {
+        list<Bucket>::iterator bucket;
+        list<SongId>::iterator position;
+    };
+
+    list<Bucket> buckets;
+    unordered_map<SongId, Entry> entries;
+
+    uint64_t countOf(SongId song) const {
+        auto it = entries.find(song);
+        return it == entries.end() ? 0 : it->second.bucket->count;
+    }
+
+    void increment(SongId song) {
+        auto it = entries.find(song);
+        if (it == entries.end()) {
+            if (buckets.empty() || buckets.back().count != 1) buckets.push_back(Bucket{ 1, {} });
+            auto bucket = prev(buckets.end());
+            bucket->songs.push_back(song);
+            entries.emplace(song, Entry{ bucket, prev(bucket->songs.end()) });
+            return;
+        }
+        Entry& e = it->second;
+        auto from = e.bucket;
+        auto to = from == buckets.begin() || prev(from)->count != from->count + 1
+            ? buckets.insert(from, Bucket{ from->count + 1, {} }) : prev(from);
+        to->songs.splice(to->songs.end(), from->songs, e.position);
+        e.bucket = to;
+        if (from->songs.empty()) buckets.erase(from);
+    }
+
+    void decrement(SongId song) {
+        auto it = entries.find(song);
+        if (it == entries.end()) return;
+        Entry& e = it->second;
+        auto from = e.bucket;
+        if (from->count == 1) {
+            from->songs.erase(e.position);
+            entries.erase(it);
+        }
+        else {
+            auto below = next(from);
+            auto to = below == buckets.end() || below->count != from->count - 1
+                ? buckets.insert(below, Bucket{ from->count - 1, {} }) : below;
+            to->songs.splice(to->songs.begin(), from->songs, e.position);
+            e.bucket = to;
+        }
+        if (from->songs.empty()) buckets.erase(from);
+    }
+
+    // Appends up to k (song, count) pairs, highest first.
+    void top(size_t k, vector<pair<SongId, double>>& out) const {
+        for (const Bucket& bucket : buckets)
+            for (SongId song : bucket.songs) {
+                if (k-- == 0) return;
+                out.push_back({ song, (double)bucket.count });
+            }
+    }
+
+    void clear() {
+        buckets.clear();
+        entries.clear();
+    }
+};
+
+// Exponentially decayed activity with a half-life. An event at time t adds
+// 2^((t - epoch) / halfLife), so every score is scaled alike as time passes
+// and their order never has to be revisited; before the weights get large
+// the epoch moves up, scores are rescaled and those that decayed to
+// nothing are dropped. Scores only grow in between, so the leaders are
+// exactly the top capacity songs: a song outside them can only get in
+// through an event of its own.
+class TrendingChart {
+public:
+    static constexpr double RESCALE_AFTER = 20;
+    static constexpr double FORGET_BELOW = 1e-6;
+    double halfLife;
+    size_t capacity;
+    double epoch;
+    unordered_map<SongId, double> scores;
+    set<pair<double, SongId>> leaders;
+
+    TrendingChart(double h = 3600, size_t c = 100) : halfLife(h), capacity(c), epoch(0) {}
+
+    void record(SongId song, double now) {
+        if (scores.empty()) epoch = now;
+        else if (now - epoch > RESCALE_AFTER * halfLife) rescale(now);
+        double& score = scores[song];
+        leaders.erase({ score, song });
+        score += exp2((now - epoch) / halfLife);
+        leaders.insert({ score, song });
+        if (leaders.size() > capacity) leaders.erase(leaders.begin());
+    }
+
+    void rescale(double now) {
+        double factor = exp2(-(now - epoch) / halfLife);
+        epoch = now;
+        for (auto it = scores.begin(); it != scores.end();) {
+            it->second *= factor;
+            if (it->second < FORGET_BELOW) it = scores.erase(it);
+            else ++it;
+        }
+        set<pair<double, SongId>> kept;
+        for (const auto& leader : leaders) {
+            auto it = scores.find(leader.second);
+            if (it != scores.end()) kept.insert({ it->second, it->first });
+        }
+        leaders.swap(kept);
+    }
+
+    // Appends up to k (song, score) pairs, highest first; a score is the
+    // number of events it would take right now to match it.
+    void top(size_t k, double now, vector<pair<SongId, double>>& out) const {
+        double factor = exp2(-(now - epoch) / halfLife);
+        for (auto it = leaders.rbegin(); it != leaders.rend() && k > 0; ++it, --k)
+            out.push_back({ it->second, it->first * factor });
+    }
+
+    void clear() {
+        scores.clear();
+        leaders.clear();
+    }
+};
+
+enum ChartKind { CHART_SAVED, CHART_FAVORITE, CHART_KIND_COUNT };
+
+// Most saved and most favorited songs, overall and per genre, with decayed
+// trending versions of each. MusicSystem feeds it every change to a user's
+// saved or favorite songs; trending only sees changes made while running.
+class SongCharts {
+public:
+    struct Charts {
+        CountChart counts;
+        TrendingChart trending;
+
+        Charts(double halfLife, size_t capacity) : trending(halfLife, capacity) {}
+    };
+
+    double halfLife;
+    size_t capacity;
+    vector<Charts> overall;
+    map<string, Charts, less<>> genres[CHART_KIND_COUNT];
+
+    SongCharts(double h = 3600, size_t c = 100) : halfLife(h), capacity(c), overall(CHART_KIND_COUNT, Charts(h, c)) {}
+
+    Charts& of(ChartKind kind, string_view genre) {
+        auto it = genres[kind].find(genre);
+        if (it == genres[kind].end()) it = genres[kind].emplace(string(genre), Charts(halfLife, capacity)).first;
+        return it->second;
+    }
+
+    void added(ChartKind kind, SongId song, string_view genre, bool trending, double now) {
+        Charts& g = of(kind, genre);
+        overall[kind].counts.increment(song);
+        g.counts.increment(song);
+        if (!trending) return;
+        overall[kind].trending.record(song, now);
+        g.trending.record(song, now);
+    }
+
+    void removed(ChartKind kind, SongId song, string_view genre) {
+        overall[kind].counts.decrement(song);
+        auto it = genres[kind].find(genre);
+        if (it != genres[kind].end()) it->second.counts.decrement(song);
+    }
+
+    // An empty genre means the overall chart. Trending charts hold at most
+    // capacity songs.
+    vector<pair<SongId, double>> top(ChartKind kind, string_view genre, bool trending, size_t k, double now) const {
+        vector<pair<SongId, double>> result;
+        const Charts* charts = &overall[kind];
+        if (!genre.empty()) {
+            auto it = genres[kind].find(genre);
+            if (it == genres[kind].end()) return result;
+            charts = &it->second;
+        }
+        if (trending) charts->trending.top(k, now, result);
+        else charts->counts.top(k, result);
+        return result;
+    }
+
+    void setHalfLife(double h) {
+        halfLife = h;
+        clear();
+    }
+
+    void clear() {
+        for (size_t kind = 0; kind < CHART_KIND_COUNT; ++kind) genres[kind].clear();
+        overall.assign(CHART_KIND_COUNT, Charts(halfLife, capacity));
+    }
+};
+
+// Songs that users keep together, for suggesting what to play next. Each
+// personal playlist and each user's favorite songs is a basket, and two
+// songs are linked by the number of baskets holding both; MusicSystem
+// reports every song that joins or leaves a basket, so links are counted
+// as they change. A basket of more than MAX_BASKET songs says little about
+// any one pair and would cost quadratic time, so it counts only while it
+// is no larger than that. A song keeps its strongest links only: once its
+// row reaches twice NEIGHBOURS links the weakest are dropped, which bounds
+// memory by the number of linked songs and keeps each lookup to one short
+// row. A dropped link that comes back starts again from 1.
+class RelatedSongs {
+public:
+    static const size_t NEIGHBOURS = 32;
+    static const size_t MAX_BASKET = 200;
+
+    struct Edge {
+        SongId song;
+        uint32_t weight;
+    };
+
+    unordered_map<SongId, vector<Edge>> rows;
+    size_t edges;
+
+    RelatedSongs() : edges(0) {}
+
+    static bool stronger(const Edge& a, const Edge& b) {
+        return a.weight != b.weight ? a.weight > b.weight : a.song < b.song;
+    }
+
+    void strengthen(SongId from, SongId to) {
+        vector<Edge>& row = rows[from];
+        for (Edge& e : row)
+            if (e.song == to) {
+                ++e.weight;
+                return;
+            }
+        row.push_back(Edge{ to, 1 });
+        ++edges;
+        if (row.size() < 2 * NEIGHBOURS) return;
+        nth_element(row.begin(), row.begin() + NEIGHBOURS, row.end(), stronger);
+        edges -= row.size() - NEIGHBOURS;
+        row.resize(NEIGHBOURS);
+    }
+
+    void weaken(SongId from, SongId to) {
+        auto it = rows.find(from);
+        if (it == rows.end()) return;
+        vector<Edge>& row = it->second;
+        for (Edge& e : row)
+            if (e.song == to) {
+                if (--e.weight > 0) return;
+                e = row.back();
+                row.pop_back();
+                --edges;
+                if (row.empty()) rows.erase(it);
+                return;
+            }
+    }
+
+    void connect(SongId a, SongId b, bool add) {
+        if (a == b) return;
+        if (add) {
+            strengthen(a, b);
+            strengthen(b, a);
+        }
+        else {
+            weaken(a, b);
+            weaken(b, a);
+        }
+    }
+
+    // A whole basket of distinct songs appearing (add) or going away.
+    void basket(const vector<SongId>& members, bool add) {
+        if (members.size() > MAX_BASKET) return;
+        for (size_t i = 0; i < members.size(); ++i)
+            for (size_t j = i + 1; j < members.size(); ++j) connect(members[i], members[j], add);
+    }
+
+    // song joined a basket that now holds size distinct songs; members()
+    // lists them, and is only called when the links change.
+    template <class Members>
+    void joined(SongId song, size_t size, Members members) {
+        if (size <= MAX_BASKET) {
+            for (SongId other : members()) connect(song, other, true);
+        }
+        else if (size == MAX_BASKET + 1) {
+            vector<SongId> before = members();
+            before.erase(find(before.begin(), before.end(), song));
+            basket(before, false);
+        }
+    }
+
+    // song left a basket that now holds size distinct songs.
+    template <class Members>
+    void left(SongId song, size_t size, Members members) {
+        if (size < MAX_BASKET) {
+            for (SongId other : members()) connect(song, other, false);
+        }
+        else if (size == MAX_BASKET) {
+            basket(members(), true);
+        }
+    }
+
+    // Up to k (song, weight) pairs, strongest first.
+    vector<pair<SongId, uint32_t>> neighbours(SongId song, size_t k) const {
+        vector<pair<SongId, uint32_t>> result;
+        auto it = rows.find(song);
+        if (it == rows.end()) return result;
+        vector<Edge> row = it->second;
+        k = min(k, row.size());
+        partial_sort(row.begin(), row.begin() + k, row.end(), stronger);
+        for (size_t i = 0; i < k; ++i) result.push_back({ row[i].song, row[i].weight });
+        return result;
+    }
+
+    size_t memoryUsage() const {
+        size_t bytes = rows.bucket_count() * sizeof(void*)
+            + rows.size() * (sizeof(pair<const SongId, vector<Edge>>) + sizeof(void*));
+        for (const auto& row : rows) bytes += row.second.capacity() * sizeof(Edge);
+        return bytes;
+    }
+
+    void clear() {
+        rows.clear();
+        edges = 0;
+    }
+};
+
+// The song catalog with its indexes and the artist pages: everything that
+// catalog reads touch. MusicSystem keeps two and publishes one.
+class CatalogVersion {
+public:
+    SongCatalog songs;
+    TrigramIndex searchIndex;
+    AttributeIndex attributeIndex;
+    SortedViews sortedViews;
+    map<string, Artist> artists;
+
+    const Artist* findArtist(const string& artistName) const {
+        auto it = artists.find(artistName);
+        return it == artists.end() ? nullptr : &it->second;
+    }
+
+    void attach(const SnapshotImage& image) {
+        songs.attach(image);
+        searchIndex.attach(image);
+        attributeIndex.attach(image);
+        sortedViews.attach(image);
+    }
+
+    // Sets id either way; returns false if the song was already there.
+    bool addSong(const Song& song, SongId& id) {
+        size_t before = songs.size();
+        id = songs.intern(song);
+        if (songs.size() == before) return false;
+        searchIndex.addSong(id, songs[id]);
+        attributeIndex.addSong(id, songs[id]);
+        sortedViews.addSong(id, songs[id]);
+        artists.try_emplace(song.artistName, song.artistName, 0).first->second.addSong(id);
+        return true;
+    }
+
+    // Indexes the whole batch at once. Returns the positions in batch that
+    // were rejected as duplicates.
+    vector<size_t> addSongs(const vector<Song>& batch) {
+        vector<size_t> duplicates;
+        SongId first = (SongId)songs.size();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            size_t before = songs.size();
+            SongId id = songs.intern(batch[i]);
+            if (songs.size() == before) {
+                duplicates.push_back(i);
+                continue;
+            }
+            artists.try_emplace(batch[i].artistName, batch[i].artistName, 0).first->second.addSong(id);
+        }
+        SongId last = (SongId)songs.size();
+        for (SongId id = first; id < last; ++id) {
+            SongView s = songs[id];
+            searchIndex.addSong(id, s);
+            attributeIndex.addSong(id, s);
+        }
+        sortedViews.addSongs(first, last, songs);
+        return duplicates;
+    }
+
+    void editArtist(const string& artistName, int albums) {
+        auto it = artists.find(artistName);
+        if (it != artists.end()) it->second.editArtist(albums);
+        else artists[artistName] = Artist(artistName, albums);
+    }
+};
+
+class MusicSystem;
+bool writeSnapshot(const MusicSystem& system, const string& path, string& error, uint64_t* checksum = nullptr);
+
+// Safe to share between sessions on different threads. Catalog reads run
+// lock-free against the published CatalogVersion (see updateCatalog). The
+// user and playlist name indexes sit behind one reader-writer lock; each
+// user's songs and lists, and each playlist's entries and playback state,
+// behind a lock of their own. Users are never removed, so User pointers
+// stay valid; playlists can be, so sessions hold them by shared_ptr.
+class MusicSystem {
+public:
+    UserList users;
+    Admin admin;
+    PlaylistList playlists;
+    CatalogVersion catalogs[2];
+    atomic<CatalogVersion*> published;
+    mutex catalogWriter;
+    shared_mutex directory;
+    // Every mutation holds this shared; compaction holds it exclusively.
+    shared_mutex quiesce;
+    mutable LockStripes userLocks;
+    mutable LockStripes playlistLocks;
+    atomic<bool> compactDue;
+    unique_ptr<SnapshotImage> snapshot;
+    string snapshotPath;
+    unique_ptr<Journal> journal;
+    bool replaying;
+    // With deferSync set, log() queues records without waiting for them;
+    // sync() then waits for everything queued so far in one go. Both are
+    // per thread, so each session chooses for itself.
+    static thread_local bool deferSync;
+    static thread_local uint64_t unsyncedSeq;
+    uint64_t compactThreshold;
+    size_t workerThreads;
+    unique_ptr<WorkerPool> workers;
+    // Counted from every user's saved and favorite songs; see updateCharts.
+    SongCharts charts;
+    mutable mutex chartLock;
+    // Co-occurrence in users' baskets; see relatedChanged.
+    RelatedSongs related;
+    mutable mutex relatedLock;
+
+    MusicSystem()
+        : published(&catalogs[0]), compactDue(false), snapshotPath("music.snap"), replaying(false),
+        compactThreshold(64 << 20), workerThreads(0) {
+        srand((unsigned int)time(NULL));
+    }
+
+    // Held by every mutation: keeps compaction out and locks the user and
+    // the playlist being changed, if any. A compaction that log() asked for
+    // runs once the locks are released.
+    class WriteScope {
+    public:
+        MusicSystem& system;
+        shared_lock<shared_mutex> shared;
+        unique_lock<mutex> userLock;
+        unique_lock<mutex> playlistLock;
+
+        WriteScope(MusicSystem& s, const User* user = nullptr, const Playlist* playlist = nullptr)
+            : system(s), shared(s.quiesce) {
+            if (user) userLock = unique_lock<mutex>(s.userLocks.of(user));
+            if (playlist) playlistLock = unique_lock<mutex>(s.playlistLocks.of(playlist));
+        }
+
+        ~WriteScope() {
+            if (playlistLock.owns_lock()) playlistLock.unlock();
+            if (userLock.owns_lock()) userLock.unlock();
+            shared.unlock();
+            system.compactIfDue();
+        }
+    };
+
+    // The published catalog. Only valid inside a ReadSection, or while no
+    // other thread can be updating the catalog (startup, tools).
+    const CatalogVersion& catalog() const {
+        return *published.load();
+    }
+
+    // Runs fn(catalog) inside a read section; takes no locks.
+    template <class Fn>
+    auto read(Fn fn) const {
+        ReadSection section;
+        return fn(catalog());
+    }
+
+    // Left-right update: fn is applied to the copy readers cannot see,
+    // that copy is published, and once every reader of the other has left
+    // (an epoch grace period) fn is applied to it as well. Readers never
+    // wait and never see half a change; the price is two copies of the
+    // catalog and doing each write twice, so fn must be deterministic.
+    // Writers are serialized; none may run inside a read section.
+    template <class Fn>
+    void updateCatalog(Fn fn) {
+        lock_guard<mutex> guard(catalogWriter);
+        CatalogVersion* live = published.load();
+        CatalogVersion* spare = live == &catalogs[0] ? &catalogs[1] : &catalogs[0];
+        fn(*spare);
+        published.store(spare);
+        EpochDomain::instance().synchronize();
+        fn(*live);
+    }
+
+    // For updates that log a record: the record is only queued under
+    // catalogWriter and waited for once it is released, so catalog
+    // writers never queue up behind an fsync.
+    template <class Fn>
+    void updateCatalogLogged(Fn fn) {
+        bool deferred = deferSync;
+        deferSync = true;
+        updateCatalog(fn);
+        deferSync = deferred;
+        if (!deferred && !sync()) cerr << "Warning: journal write failed, recent changes are not durable.\n";
+    }
+
+    // Runs fn(catalog) holding the user's lock, for reading state that
+    // other sessions of the same user may change.
+    template <class Fn>
+    auto readUser(const User* user, Fn fn) {
+        lock_guard<mutex> guard(userLocks.of(user));
+        return read(fn);
+    }
+
+    template <class Fn>
+    auto readPlaylist(const Playlist* playlist, Fn fn) {
+        lock_guard<mutex> guard(playlistLocks.of(playlist));
+        return read(fn);
+    }
+
+    // Starts the scan pool with workerThreads threads (0: one per core).
+    void startWorkers() {
+        workers.reset(new WorkerPool(workerThreads ? workerThreads : max(1u, thread::hardware_concurrency())));
+        updateCatalog([this](CatalogVersion& c) { c.songs.workers = workers.get(); });
+    }
+
+    void setParallelThreshold(size_t songs) {
+        updateCatalog([songs](CatalogVersion& c) { c.songs.parallelThreshold = songs; });
+    }
+
+    size_t songCount() const {
+        return read([](const CatalogVersion& c) { return c.songs.size(); });
+    }
+
+    bool hasSong(SongId id) const {
+        return read([id](const CatalogVersion& c) { return c.songs.contains(id); });
+    }
+
+    User* findUser(const string& username) {
+        METRIC_SCOPE(OP_FIND_USER);
+        shared_lock<shared_mutex> guard(directory);
+        return users.find(username);
+    }
+
+    bool hasArtist(const string& artistName) const {
+        return read([&](const CatalogVersion& c) { return c.findArtist(artistName) != nullptr; });
+    }
+
+    bool addUser(const User& user) {
+        WriteScope scope(*this);
+        unique_lock<shared_mutex> guard(directory);
+        if (!users.add(user)) return false;
+        log(JournalRecord(J_ADD_USER).str(user.username).str(user.password));
+        return true;
+    }
+
+    // The record is logged before the song is published, so no session
+    // can refer to the song in the journal ahead of it.
+    SongId addSong(const Song& song) {
+        WriteScope scope(*this);
+        SongId id = NO_SONG;
+        bool logged = false;
+        updateCatalogLogged([&](CatalogVersion& c) {
+            if (!c.addSong(song, id) || logged) return;
+            log(JournalRecord(J_ADD_SONG).u32(id).str(song.name).str(song.artistName).i32(song.releaseYear).str(song.genre));
+            logged = true;
+        });
+        return id;
+    }
+
+    // Bulk path for the importer: indexes are updated once for the whole
+    // batch and nothing is journaled, so callers compact afterwards.
+    // Returns the positions in batch that were rejected as duplicates.
+    vector<size_t> addSongs(const vector<Song>& batch) {
+        WriteScope scope(*this);
+        vector<size_t> duplicates;
+        updateCatalog([&](CatalogVersion& c) { duplicates = c.addSongs(batch); });
+        return duplicates;
+    }
+
+    bool createPlaylist(const string& name) {
+        WriteScope scope(*this);
+        unique_lock<shared_mutex> guard(directory);
+        if (!playlists.add(Playlist(name))) return false;
+        log(JournalRecord(J_CREATE_PLAYLIST).str(name));
+        return true;
+    }
+
+    // Returns the position the song was added at.
+    size_t addSongToPlaylist(User* owner, Playlist* playlist, SongId song) {
+        WriteScope scope(*this, nullptr, playlist);
+        bool joined = !playlist->contains(song);
+        playlist->addSong(song);
+        if (owner && joined) relatedChanged(song, true, *playlist);
+        log(JournalRecord(J_PLAYLIST_ADD_SONG).str(owner ? owner->username : "").str(playlist->name).u32(song));
+        return playlist->size() - 1;
+    }
+
+    void removeSongFromPlaylist(User* owner, Playlist* playlist, SongId song) {
+        WriteScope scope(*this, nullptr, playlist);
+        bool left = playlist->contains(song);
+        playlist->removeSong(song);
+        if (owner && left) relatedChanged(song, false, *playlist);
+        log(JournalRecord(J_PLAYLIST_REMOVE_SONG).str(owner ? owner->username : "").str(playlist->name).u32(song));
+    }
+
+    bool removePlaylistEntry(User* owner, Playlist* playlist, size_t position) {
+        WriteScope scope(*this, nullptr, playlist);
+        SongId song = position < playlist->size() ? playlist->songAt(position) : NO_SONG;
+        if (!playlist->removeAt(position)) return false;
+        if (owner && !playlist->contains(song)) relatedChanged(song, false, *playlist);
+        log(JournalRecord(J_PLAYLIST_REMOVE_AT).str(owner ? owner->username : "").str(playlist->name).u32((uint32_t)position));
+        return true;
+    }
+
+    bool movePlaylistEntry(User* owner, Playlist* playlist, size_t from, size_t to) {
+        WriteScope scope(*this, nullptr, playlist);
+        if (!playlist->moveSong(from, to)) return false;
+        log(JournalRecord(J_PLAYLIST_MOVE).str(owner ? owner->username : "").str(playlist->name).u32((uint32_t)from).u32((uint32_t)to));
+        return true;
+    }
+
+    void setPlaybackMode(Playlist* playlist, PlaybackMode mode) {
+        WriteScope scope(*this, nullptr, playlist);
+        playlist->setPlaybackMode(mode);
+    }
+
+    // Steps playback forward (direction > 0), back (< 0) or not at all and
+    // returns the song now current, NO_SONG if the playlist is empty. In
+    // AUTOPLAY mode a step past the end plays a related song, and position
+    // is then the playlist's size; with nothing to suggest it wraps.
+    SongId playbackStep(Playlist* playlist, int direction, size_t* position = nullptr) {
+        WriteScope scope(*this, nullptr, playlist);
+        SongId suggested = NO_SONG;
+        if (direction > 0 && playlist->playbackMode == AUTOPLAY && playlist->atEnd())
+            suggested = suggestNext(*playlist);
+        if (suggested != NO_SONG) playlist->autoplay(suggested);
+        else if (direction > 0) playlist->nextSong();
+        else if (direction < 0) playlist->previousSong();
+        if (position) *position = playlist->autoplaying() ? playlist->size() : playlist->currentPosition();
+        return playlist->currentSong();
+    }
+
+    // The most related song that is neither in the playlist nor played by
+    // autoplay lately, going by the last few songs played; NO_SONG if
+    // there is none. Call with the playlist locked.
+    SongId suggestNext(const Playlist& playlist) {
+        vector<SongId> seeds(playlist.autoplayed.rbegin(), playlist.autoplayed.rend());
+        seeds.push_back(playlist.entrySong[playlist.currentEntry]);
+        seeds.resize(min<size_t>(seeds.size(), 4));
+        size_t known = songCount();
+        lock_guard<mutex> guard(relatedLock);
+        for (SongId seed : seeds)
+            for (const auto& next : related.neighbours(seed, RelatedSongs::NEIGHBOURS))
+                if (next.first < known && !playlist.contains(next.first)
+                    && find(playlist.autoplayed.begin(), playlist.autoplayed.end(), next.first) == playlist.autoplayed.end())
+                    return next.first;
+        return NO_SONG;
+    }
+
+    // Up to k (song, weight) pairs: the songs most often kept together
+    // with song, and in how many playlists and favorites.
+    vector<pair<SongId, uint32_t>> relatedSongs(SongId song, size_t k) const {
+        lock_guard<mutex> guard(relatedLock);
+        return related.neighbours(song, k);
+    }
+
+    bool addUserPlaylist(User* user, const string& name) {
+        WriteScope scope(*this, user);
+        if (!user->addPlaylist(Playlist(name))) return false;
+        log(JournalRecord(J_USER_ADD_PLAYLIST).str(user->username).str(name));
+        return true;
+    }
+
+    void deleteUserPlaylist(User* user, const string& name) {
+        WriteScope scope(*this, user);
+        vector<SongId> songs;
+        if (Playlist* playlist = user->findPlaylist(name)) {
+            lock_guard<mutex> guard(playlistLocks.of(playlist));
+            songs = playlist->distinctSongs();
+        }
+        user->deletePlaylist(name);
+        relatedBasket(songs, false);
+        log(JournalRecord(J_USER_DELETE_PLAYLIST).str(user->username).str(name));
+    }
+
+    void saveSong(User* user, SongId song) {
+        WriteScope scope(*this, user);
+        if (user->addToSavedSongs(song)) updateCharts(CHART_SAVED, &song, 1, true);
+        log(JournalRecord(J_SAVE_SONG).str(user->username).u32(song));
+    }
+
+    void unsaveSong(User* user, SongId song) {
+        WriteScope scope(*this, user);
+        if (user->removeFromSavedSongs(song)) updateCharts(CHART_SAVED, &song, 1, false);
+        log(JournalRecord(J_UNSAVE_SONG).str(user->username).u32(song));
+    }
+
+    void favoriteSong(User* user, SongId song) {
+        WriteScope scope(*this, user);
+        if (user->addToFavoriteSongs(song)) {
+            updateCharts(CHART_FAVORITE, &song, 1, true);
+            relatedChanged(song, true, user->favoriteSongs);
+        }
+        log(JournalRecord(J_FAVORITE_SONG).str(user->username).u32(song));
+    }
+
+    void unfavoriteSong(User* user, SongId song) {
+        WriteScope scope(*this, user);
+        if (user->removeFromFavoriteSongs(song)) {
+            updateCharts(CHART_FAVORITE, &song, 1, false);
+            relatedChanged(song, false, user->favoriteSongs);
+        }
+        log(JournalRecord(J_UNFAVORITE_SONG).str(user->username).u32(song));
+    }
+
+    // Bulk forms for syncing a whole library: one journal record per call.
+    // Ids outside the catalog are ignored; the return value is the number
+    // of songs that changed state.
+    size_t updateSongSet(User* user, JournalRecordKind kind, vector<SongId> list) {
+        size_t known = songCount();
+        list.erase(remove_if(list.begin(), list.end(), [known](SongId id) { return id >= known; }), list.end());
+        WriteScope scope(*this, user);
+        bool saved = kind == J_SAVE_SONGS || kind == J_UNSAVE_SONGS;
+        SongSet& set = saved ? user->savedSongs : user->favoriteSongs;
+        bool adding = kind == J_SAVE_SONGS || kind == J_FAVORITE_SONGS;
+        vector<SongId> songs;
+        size_t changed = adding ? set.addAll(list, &songs) : set.removeAll(list, &songs);
+        updateCharts(saved ? CHART_SAVED : CHART_FAVORITE, songs.data(), songs.size(), adding);
+        if (!saved) relatedChangedAll(set, songs, adding);
+        if (changed) log(JournalRecord(kind).str(user->username).ids(list));
+        return changed;
+    }
+
+    size_t saveSongs(User* user, const vector<SongId>& list) {
+        return updateSongSet(user, J_SAVE_SONGS, list);
+    }
+
+    size_t unsaveSongs(User* user, const vector<SongId>& list) {
+        return updateSongSet(user, J_UNSAVE_SONGS, list);
+    }
+
+    size_t favoriteSongs(User* user, const vector<SongId>& list) {
+        return updateSongSet(user, J_FAVORITE_SONGS, list);
+    }
+
+    size_t unfavoriteSongs(User* user, const vector<SongId>& list) {
+        return updateSongSet(user, J_UNFAVORITE_SONGS, list);
+    }
+
+    static double chartClock() {
+        return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Moves songs just added to or removed from a user's saved (or favorite)
+    // set in the charts; called with that user locked. Replayed changes are
+    // counted but not trending: they happened in an earlier run.
+    void updateCharts(ChartKind kind, const SongId* songs, size_t count, bool added) {
+        if (count == 0) return;
+        double now = chartClock();
+        lock_guard<mutex> guard(chartLock);
+        read([&](const CatalogVersion& c) {
+            for (size_t i = 0; i < count; ++i) {
+                if (!c.songs.contains(songs[i])) continue;
+                string_view genre = c.songs[songs[i]].genre;
+                if (added) charts.added(kind, songs[i], genre, !replaying, now);
+                else charts.removed(kind, songs[i], genre);
+            }
+        });
+    }
+
+    // Recounts the charts from every user's songs; trending starts over.
+    // Call before any session starts.
+    void rebuildCharts() {
+        lock_guard<mutex> guard(chartLock);
+        charts.clear();
+        read([&](const CatalogVersion& c) {
+            for (const User& u : users) {
+                for (SongId song : u.savedSongs.toVector())
+                    if (c.songs.contains(song)) charts.added(CHART_SAVED, song, c.songs[song].genre, false, 0);
+                for (SongId song : u.favoriteSongs.toVector())
+                    if (c.songs.contains(song)) charts.added(CHART_FAVORITE, song, c.songs[song].genre, false, 0);
+            }
+        });
+    }
+
+    // A user's favorites and each of their personal playlists are baskets
+    // for related. These report a song that joined or left one, with the
+    // basket locked and already changed.
+    void relatedChanged(SongId song, bool joined, const Playlist& playlist) {
+        lock_guard<mutex> guard(relatedLock);
+        auto members = [&playlist] { return playlist.distinctSongs(); };
+        if (joined) related.joined(song, playlist.entriesOf.size(), members);
+        else related.left(song, playlist.entriesOf.size(), members);
+    }
+
+    void relatedChanged(SongId song, bool joined, const SongSet& set) {
+        lock_guard<mutex> guard(relatedLock);
+        auto members = [&set] { return set.toVector(); };
+        if (joined) related.joined(song, set.size(), members);
+        else related.left(song, set.size(), members);
+    }
+
+    // A bulk change, fed through one song at a time so that it counts the
+    // same as the single-song forms.
+    void relatedChangedAll(const SongSet& set, const vector<SongId>& songs, bool joined) {
+        if (songs.empty()) return;
+        vector<SongId> members = set.toVector();
+        if (joined) {
+            vector<SongId> sorted = songs;
+            sort(sorted.begin(), sorted.end());
+            members.erase(remove_if(members.begin(), members.end(),
+                [&](SongId s) { return binary_search(sorted.begin(), sorted.end(), s); }), members.end());
+        }
+        else {
+            members.insert(members.end(), songs.begin(), songs.end());
+        }
+        auto current = [&members] { return members; };
+        lock_guard<mutex> guard(relatedLock);
+        for (size_t i = 0; i < songs.size(); ++i) {
+            if (joined) {
+                members.push_back(songs[i]);
+                related.joined(songs[i], members.size(), current);
+            }
+            else {
+                members.pop_back();
+                related.left(songs[songs.size() - 1 - i], members.size(), current);
+            }
+        }
+    }
+
+    void relatedBasket(const vector<SongId>& songs, bool add) {
+        lock_guard<mutex> guard(relatedLock);
+        related.basket(songs, add);
+    }
+
+    // Recounts related from every user's baskets. Call before any session
+    // starts.
+    void rebuildRelated() {
+        lock_guard<mutex> guard(relatedLock);
+        related.clear();
+        for (const User& u : users) {
+            related.basket(u.favoriteSongs.toVector(), true);
+            for (const Playlist& p : u.personalPlaylists) related.basket(p.distinctSongs(), true);
+        }
+    }
+
+    // Up to k (song, score) pairs, best first. Scores are how many users
+    // hold the song, or for trending its decayed rate of new saves (or
+    // favorites). An empty genre means all genres.
+    vector<pair<SongId, double>> topSongs(ChartKind kind, string_view genre, bool trending, size_t k) const {
+        double now = chartClock();
+        lock_guard<mutex> guard(chartLock);
+        return charts.top(kind, genre, trending, k, now);
+    }
+
+    void editArtist(const string& artistName, int albums) {
+        WriteScope scope(*this);
+        bool logged = false;
+        updateCatalogLogged([&](CatalogVersion& c) {
+            c.editArtist(artistName, albums);
+            if (!logged) log(JournalRecord(J_EDIT_ARTIST).str(artistName).i32(albums));
+            logged = true;
+        });
+    }
+
+    bool addSongToArtist(const string& artistName, SongId song) {
+        WriteScope scope(*this);
+        bool added = false;
+        updateCatalogLogged([&](CatalogVersion& c) {
+            auto it = c.artists.find(artistName);
+            if (it == c.artists.end()) return;
+            it->second.addSong(song);
+            if (!added) log(JournalRecord(J_ARTIST_ADD_SONG).str(artistName).u32(song));
+            added = true;
+        });
+        return added;
+    }
+
+    // owner may be nullptr for a system playlist.
+    shared_ptr<Playlist> sharePlaylist(const User* owner, const string& name) {
+        if (!owner) {
+            shared_lock<shared_mutex> guard(directory);
+            return playlists.share(name);
+        }
+        lock_guard<mutex> guard(userLocks.of(owner));
+        return owner->personalPlaylists.share(name);
+    }
+
+    shared_ptr<Playlist> sharePlaylistOf(const string& owner, const string& name) {
+        if (owner.empty()) return sharePlaylist(nullptr, name);
+        User* user = findUser(owner);
+        return user ? sharePlaylist(user, name) : nullptr;
+    }
+
+    // Following shares the owner's playlist instead of copying it, so owner
+    // edits show up for every follower and memory grows with the number of
+    // distinct playlists. A follower gets a copy only by forking.
+    // A user's playlist is looked up and the follow logged under the
+    // owner's lock as well, so the owner cannot delete or replace it in
+    // between and replay resolves (owner, name) to the same playlist.
+    // System playlists are never deleted.
+    bool followPlaylist(User* user, const string& owner, const string& name) {
+        User* ownerUser = owner.empty() ? nullptr : findUser(owner);
+        if (!owner.empty() && !ownerUser) return false;
+        WriteScope scope(*this);
+        shared_ptr<Playlist> playlist;
+        unique_lock<mutex> first, second;
+        if (ownerUser) {
+            // Both user stripes, in address order; they may be the same one.
+            mutex* a = &userLocks.of(user);
+            mutex* b = &userLocks.of(ownerUser);
+            if (b < a) swap(a, b);
+            first = unique_lock<mutex>(*a);
+            if (b != a) second = unique_lock<mutex>(*b);
+            playlist = ownerUser->personalPlaylists.share(name);
+        }
+        else {
+            playlist = sharePlaylist(nullptr, name);
+            first = unique_lock<mutex>(userLocks.of(user));
+        }
+        if (!playlist || user->follows(playlist.get())) return false;
+        user->favoritePlaylists.push_back(playlist);
+        log(JournalRecord(J_FOLLOW_PLAYLIST).str(user->username).str(owner).str(name));
+        return true;
+    }
+
+    bool unfollowPlaylist(User* user, size_t index) {
+        WriteScope scope(*this, user);
+        if (index >= user->favoritePlaylists.size()) return false;
+        user->favoritePlaylists.erase(user->favoritePlaylists.begin() + index);
+        log(JournalRecord(J_UNFOLLOW_PLAYLIST).str(user->username).u32((uint32_t)index));
+        return true;
+    }
+
+    bool forkPlaylist(User* user, size_t index, const string& name) {
+        WriteScope scope(*this, user);
+        if (index >= user->favoritePlaylists.size()) return false;
+        Playlist copy;
+        {
+            lock_guard<mutex> source(playlistLocks.of(user->favoritePlaylists[index].get()));
+            copy = *user->favoritePlaylists[index];
+        }
+        copy.name = name;
+        if (!user->addPlaylist(copy)) return false;
+        relatedBasket(copy.distinctSongs(), true);
+        log(JournalRecord(J_FORK_PLAYLIST).str(user->username).u32((uint32_t)index).str(name));
+        return true;
+    }
+
+    // Names and sizes of a user's personal playlists, or of the system
+    // playlists when user is nullptr, read under the right locks.
+    vector<PlaylistSummary> playlistSummaries(const User* user) {
+        vector<PlaylistSummary> list;
+        auto add = [&](const Playlist& p) {
+            lock_guard<mutex> guard(playlistLocks.of(&p));
+            list.push_back(PlaylistSummary{ p.name, p.size() });
+        };
+        if (!user) {
+            shared_lock<shared_mutex> guard(directory);
+            for (const auto& p : playlists) add(p);
+        }
+        else {
+            lock_guard<mutex> guard(userLocks.of(user));
+            for (const auto& p : user->personalPlaylists) add(p);
+        }
+        return list;
+    }
+
+    vector<PlaylistSummary> favoriteSummaries(const User* user) {
+        vector<PlaylistSummary> list;
+        lock_guard<mutex> guard(userLocks.of(user));
+        for (const auto& p : user->favoritePlaylists) {
+            lock_guard<mutex> entries(playlistLocks.of(p.get()));
+            list.push_back(PlaylistSummary{ p->name, p->size() });
+        }
+        return list;
+    }
+
+    // The page is formatted inside the read section and written after it.
+    void displaySongs(const SongPages& list, const PageCursor& cursor) {
+        OutputBuffer out;
+        vector<SongId> page = list.fetch(cursor.first(), cursor.last() - cursor.first());
+        read([&](const CatalogVersion& c) {
+            for (size_t i = 0; i < page.size(); ++i) {
+                SongView s = c.songs[page[i]];
+                out << cursor.first() + i + 1 << ". Song: " << s.name << ", Artist: " << s.artistName << ", Year: " << s.releaseYear << ", Genre: " << s.genre << '\n';
+            }
+        });
+        if (list.total == 0) {
+            out << "No songs to display.\n";
+        }
+        renderPageFooter(out, cursor, "songs");
+    }
+
+    string describeSong(SongId id) const {
+        return read([id](const CatalogVersion& c) {
+            if (!c.songs.contains(id)) return string();
+            SongView s = c.songs[id];
+            return string(s.name) + " by " + string(s.artistName);
+        });
+    }
+
+    SongPages allSongs() const {
+        return SongPages(songCount(), [](size_t offset, size_t count) {
+            vector<SongId> ids(count);
+            for (size_t i = 0; i < count; ++i) ids[i] = (SongId)(offset + i);
+            return ids;
+        });
+    }
+
+    void displayPlaylists(const vector<PlaylistSummary>& list, const PageCursor& cursor) {
+        OutputBuffer out;
+        for (size_t i = cursor.first(); i < cursor.last(); ++i) {
+            out << i + 1 << ". Playlist: " << list[i].name << " (" << list[i].songs << " songs)\n";
+        }
+        if (list.empty()) {
+            out << "No playlists to display.\n";
+        }
+        renderPageFooter(out, cursor, "playlists");
+    }
+
+    vector<SongId> searchSongs(const string& keyword) const {
+        METRIC_SCOPE(OP_SEARCH);
+        string folded = foldString(keyword);
+        return read([&](const CatalogVersion& c) {
+            vector<SongId> candidates, results;
+            if (c.searchIndex.candidates(folded, candidates)) {
+                for (SongId id : candidates) {
+                    SongView s = c.songs[id];
+                    if (containsFolded(s.name, folded) || containsFolded(s.artistName, folded))
+                        results.push_back(id);
+                }
+                return results;
+            }
+            return c.songs.scanText(folded, true, true);
+        });
+    }
+
+    // Top k songs for keyword, best first. Short keywords have no typo
+    // tolerance, so their candidates can come from the trigram index.
+    vector<SearchHit> rankedSearch(const string& keyword, size_t k) const {
+        METRIC_SCOPE(OP_RANKED_SEARCH);
+        KeywordScorer scorer(keyword);
+        return read([&](const CatalogVersion& c) {
+            vector<SongId> candidates;
+            if (scorer.maxEdits == 0 && c.searchIndex.candidates(scorer.keyword, candidates))
+                return c.songs.topMatches(scorer, k, &candidates);
+            return c.songs.topMatches(scorer, k);
+        });
+    }
+
+    void displaySearchHits(const vector<SearchHit>& hits) const {
+        OutputBuffer out;
+        read([&](const CatalogVersion& c) {
+            for (size_t i = 0; i < hits.size(); ++i) {
+                SongView s = c.songs[hits[i].id];
+                out << i + 1 << ". Song: " << s.name << ", Artist: " << s.artistName << ", Year: " << s.releaseYear
+                    << ", Genre: " << s.genre << " (score " << hits[i].score << ")\n";
+            }
+        });
+        if (hits.empty()) {
+            out << "No songs to display.\n";
+        }
+    }
+
+    vector<SongId> searchSongsLinear(const string& keyword) const {
+        ReadSection section;
+        const SongCatalog& songs = catalog().songs;
+        vector<SongId> results;
+        for (SongId id = 0; id < (SongId)songs.size(); ++id) {
+            SongView s = songs[id];
+            string lowerName(s.name), lowerArtist(s.artistName);
+            transform(lowerName.begin(), lowerName.end(), lowerName.begin(), ::tolower);
+            transform(lowerArtist.begin(), lowerArtist.end(), lowerArtist.begin(), ::tolower);
+            string lowerKeyword = keyword;
+            transform(lowerKeyword.begin(), lowerKeyword.end(), lowerKeyword.begin(), ::tolower);
+            if (lowerName.find(lowerKeyword) != string::npos || lowerArtist.find(lowerKeyword) != string::npos) {
+                results.push_back(id);
+            }
+        }
+        return results;
+    }
+
+    QueryCursor query(const SongQuery& q) const {
+        return read([&](const CatalogVersion& c) {
+            QueryPlanner planner(c.songs, c.searchIndex, c.attributeIndex, c.sortedViews);
+            return planner.run(q);
+        });
+    }
+
+    // Pages of a posting list. Lists only grow, so each fetch can look the
+    // list up again in whichever version is published by then.
+    SongPages postingPages(function<PostingList(const CatalogVersion&)> select) const {
+        size_t total = read([&](const CatalogVersion& c) { return select(c).size(); });
+        return SongPages(total, [this, select](size_t offset, size_t count) {
+            return read([&](const CatalogVersion& c) { return select(c).slice(offset, count); });
+        });
+    }
+
+    SongPages filterSongsByArtist(const string& artistName) const {
+        METRIC_SCOPE(OP_FILTER_ARTIST);
+        return postingPages([artistName](const CatalogVersion& c) { return c.attributeIndex.artist(artistName); });
+    }
+
+    SongPages filterSongsByYear(int year) const {
+        METRIC_SCOPE(OP_FILTER_YEAR);
+        return postingPages([year](const CatalogVersion& c) { return c.attributeIndex.year(year); });
+    }
+
+    SongPages filterSongsByYearRange(int fromYear, int toYear) const {
+        METRIC_SCOPE(OP_FILTER_YEAR_RANGE);
+        return SongPages::of(read([&](const CatalogVersion& c) { return c.attributeIndex.yearRange(fromYear, toYear); }));
+    }
+
+    SongPages filterSongsByGenre(const string& genre) const {
+        METRIC_SCOPE(OP_FILTER_GENRE);
+        return postingPages([genre](const CatalogVersion& c) { return c.attributeIndex.genre(genre); });
+    }
+
+    vector<SongId> songsPage(SortField field, size_t offset, size_t count) const {
+        return read([&](const CatalogVersion& c) { return c.sortedViews.page(field, offset, count); });
+    }
+
+    SongPages sortSongsAlphabetically() const {
+        METRIC_SCOPE(OP_SORT);
+        return SongPages(songCount(), [this](size_t offset, size_t count) { return songsPage(SORT_NAME, offset, count); });
+    }
+
+    size_t countSongReferences() {
+        size_t refs = read([](const CatalogVersion& c) {
+            size_t n = 0;
+            for (const auto& kv : c.artists) n += kv.second.releasedSongs.size();
+            return n;
+        });
+        for (const auto& p : playlistSummaries(nullptr)) refs += p.songs;
+        shared_lock<shared_mutex> guard(directory);
+        for (const auto& u : users) {
+            for (const auto& p : playlistSummaries(&u)) refs += p.songs;
+            lock_guard<mutex> user(userLocks.of(&u));
+            refs += u.savedSongs.size() + u.favoriteSongs.size();
+            for (const auto& p : u.favoritePlaylists) {
+                lock_guard<mutex> entries(playlistLocks.of(p.get()));
+                if (p.use_count() == 1) refs += p->size();
+            }
+        }
+        return refs;
+    }
+
+    void displayMemoryUsage() {
+        size_t refs = countSongReferences();
+        read([&](const CatalogVersion& c) {
+            size_t catalogBytes = c.songs.memoryUsage();
+            size_t perSong = c.songs.empty() ? sizeof(Song) : (catalogBytes / c.songs.size());
+            cout << "Catalog: " << c.songs.size() << " songs, " << catalogBytes << " bytes (held twice, see updateCatalog)\n"
+                << "Search index: " << c.searchIndex.postings.size() << " trigrams, " << c.searchIndex.memoryUsage() << " bytes\n"
+                << "Song references: " << refs << "\n"
+                << "References as SongId: " << refs * sizeof(SongId) << " bytes\n"
+                << "References as Song copies: " << refs * perSong << " bytes (estimated)\n";
+            if (snapshot)
+                cout << "Mapped snapshot: " << snapshot->file.size << " bytes (" << c.songs.baseCount << " songs)\n";
+        });
+        {
+            lock_guard<mutex> guard(relatedLock);
+            cout << "Related songs: " << related.rows.size() << " songs, " << related.edges << " links, "
+                << related.memoryUsage() << " bytes\n";
+        }
+        if (journal)
+            cout << "Journal: " << journal->bytes << " bytes, " << journal->records << " records, "
+                << journal->batches << " group commits\n";
+    }
+
+    // Maps a snapshot written by writeSnapshot. Catalog strings and indexes are
+    // read in place, trusting the offsets in them, so every section checksum
+    // is verified first; only artists, users and playlists are copied into
+    // memory. Call before any session starts.
+    bool openSnapshot(const string& path, string& error) {
+        if (songCount() != 0 || !users.empty() || !playlists.empty() || !catalog().artists.empty()) {
+            error = "a snapshot can only be opened into an empty system";
+            return false;
+        }
+        unique_ptr<SnapshotImage> image(new SnapshotImage());
+        if (!image->open(path, error) || !image->verify(error)) return false;
+        size_t artistCount = 0, userCount = 0, playlistCount = 0;
+        const SnapshotArtist* storedArtists = image->table<SnapshotArtist>(SEC_ARTISTS, artistCount);
+        const SnapshotUser* storedUsers = image->table<SnapshotUser>(SEC_USERS, userCount);
+        const SnapshotPlaylist* storedPlaylists = image->table<SnapshotPlaylist>(SEC_PLAYLISTS, playlistCount);
+        auto loadPlaylist = [&](const SnapshotPlaylist& sp, Playlist& p) {
+            if (!image->validSongs(sp.songs) || sp.playbackMode < SEQUENTIAL || sp.playbackMode > AUTOPLAY) return false;
+            p.name = string(image->str(sp.name));
+            p.assign(vector<SongId>(image->ids(sp.songs), image->ids(sp.songs) + sp.songs.count));
+            p.playbackMode = (PlaybackMode)sp.playbackMode;
+            p.setCurrentPosition((size_t)sp.currentSongIndex);
+            return true;
+        };
+        // Owned playlists by record, so that followers can share them.
+        vector<shared_ptr<Playlist>> records(playlistCount);
+        // store returns false to reject a playlist, e.g. a duplicate name.
+        auto loadPlaylists = [&](const SnapshotIdRange& range, auto store) {
+            if (range.offset > playlistCount || range.count > playlistCount - range.offset) return false;
+            for (size_t i = 0; i < range.count; ++i) {
+                Playlist p;
+                if (!loadPlaylist(storedPlaylists[range.offset + i], p) || !store(range.offset + i, move(p))) return false;
+            }
+            return true;
+        };
+        auto into = [&records](PlaylistList& list) {
+            return [&list, &records](size_t record, Playlist&& p) {
+                Playlist* added = list.add(move(p));
+                if (!added) return false;
+                records[record] = list.share(added->name);
+                return true;
+            };
+        };
+        auto loadFavorites = [&](const SnapshotUser& su, User* user) {
+            if (image->header->version == 1) {
+                return loadPlaylists(su.favoritePlaylists, [user](size_t, Playlist&& p) {
+                    user->favoritePlaylists.push_back(make_shared<Playlist>(move(p)));
+                    return true;
+                });
+            }
+            if (!image->validIds(su.favoritePlaylists)) return false;
+            const uint32_t* refs = image->ids(su.favoritePlaylists);
+            for (size_t i = 0; i < su.favoritePlaylists.count; ++i) {
+                uint32_t record = refs[i];
+                if (record >= playlistCount) return false;
+                if (!records[record]) {
+                    Playlist p;
+                    if (!loadPlaylist(storedPlaylists[record], p)) return false;
+                    records[record] = make_shared<Playlist>(move(p));
+                }
+                user->favoritePlaylists.push_back(records[record]);
+            }
+            return true;
+        };
+        if (image->meta->systemPlaylistCount > playlistCount) {
+            error = "bad playlist table";
+            return false;
+        }
+        bool ok = loadPlaylists(SnapshotIdRange{ 0, image->meta->systemPlaylistCount }, into(playlists));
+        map<string, Artist> artists;
+        for (size_t i = 0; ok && i < artistCount; ++i) {
+            const SnapshotArtist& sa = storedArtists[i];
+            if (!image->validSongs(sa.songs)) ok = false;
+            else {
+                Artist artist(string(image->str(sa.name)), sa.albums);
+                artist.releasedSongs.assign(image->ids(sa.songs), image->ids(sa.songs) + sa.songs.count);
+                artist.numberOfReleasedSongs = (int)artist.releasedSongs.size();
+                artists[artist.name] = artist;
+            }
+        }
+        for (size_t i = 0; ok && i < userCount; ++i) {
+            const SnapshotUser& su = storedUsers[i];
+            User* user = users.add(User(string(image->str(su.username)), string(image->str(su.password))));
+            ok = user && image->validSongs(su.savedSongs) && image->validSongs(su.favoriteSongs)
+                && loadPlaylists(su.personalPlaylists, into(user->personalPlaylists));
+            if (ok) {
+                user->savedSongs.assign(image->ids(su.savedSongs), image->ids(su.savedSongs) + su.savedSongs.count);
+                user->favoriteSongs.assign(image->ids(su.favoriteSongs), image->ids(su.favoriteSongs) + su.favoriteSongs.count);
+            }
+        }
+        // Favorites may follow a playlist of a later user, so they load last.
+        auto user = users.begin();
+        for (size_t i = 0; ok && i < userCount; ++i, ++user)
+            ok = loadFavorites(storedUsers[i], &*user);
+        if (!ok) {
+            error = "corrupt artist, user or playlist record";
+            users.clear();
+            playlists.clear();
+            return false;
+        }
+        // The catalog is attached only once everything else loaded.
+        updateCatalog([&](CatalogVersion& c) {
+            c.attach(*image);
+            c.artists = artists;
+        });
+        snapshot = move(image);
+        snapshotPath = path;
+        rebuildCharts();
+        rebuildRelated();
+        return true;
+    }
+
+    // Replays the journal on top of whatever snapshot is loaded, then keeps
+    // it open so that every later mutation is logged before it is reported.
+    bool openJournal(const string& path, string& report, string& error) {
+        unique_ptr<Journal> opened(new Journal());
+        uint64_t base = snapshot ? snapshot->header->checksum : 0;
+        replaying = true;
+        bool ok = opened->open(path, base,
+            [this](JournalRecordKind kind, JournalReader& in) { return replay(kind, in); }, report, error);
+        replaying = false;
+        if (ok) journal = move(opened);
+        return ok;
+    }
+
+    // Folds the journal into a new snapshot and starts an empty journal.
+    // Waits for mutations in flight and holds off new ones meanwhile; reads
+    // carry on.
+    bool compact(string& error) {
+        unique_lock<shared_mutex> exclusive(quiesce);
+        uint64_t checksum = 0;
+        if (!writeSnapshot(*this, snapshotPath, error, &checksum)) return false;
+        return !journal || journal->reset(checksum, error);
+    }
+
+    void compactIfDue() {
+        if (!compactDue.exchange(false)) return;
+        string error;
+        if (!compact(error)) cerr << "Journal compaction failed: " << error << '\n';
+    }
+
+    // Called with the changed object's lock held, so records for one user
+    // or playlist reach the journal in the order the changes were made.
+    // Warnings here and in compactIfDue go to cerr: in command mode stdout
+    // carries protocol responses.
+    void log(JournalRecord record) {
+        if (!journal || replaying) return;
+        if (deferSync) unsyncedSeq = journal->append(record.seal());
+        else if (!journal->commit(record.seal()))
+            cerr << "Warning: journal write failed, recent changes are not durable.\n";
+        if (journal->bytes >= compactThreshold) compactDue = true;
+    }
+
+    bool sync() {
+        return !journal || journal->waitDurable(unsyncedSeq);
+    }
+
+    bool replay(JournalRecordKind kind, JournalReader& in) {
+        switch (kind) {
+        case J_ADD_SONG: {
+            SongId id = in.u32();
+            string name = in.str(), artistName = in.str();
+            int year = in.i32();
+            string genre = in.str();
+            return in.ok && addSong(Song(name, artistName, year, genre)) == id;
+        }
+        case J_ADD_USER: {
+            string username = in.str(), password = in.str();
+            if (!in.ok) return false;
+            return addUser(User(username, password));
+        }
+        case J_CREATE_PLAYLIST: {
+            string name = in.str();
+            if (!in.ok) return false;
+            return createPlaylist(name);
+        }
+        case J_PLAYLIST_ADD_SONG:
+        case J_PLAYLIST_REMOVE_SONG: {
+            string owner = in.str(), name = in.str();
+            SongId song = in.u32();
+            shared_ptr<Playlist> playlist = sharePlaylistOf(owner, name);
+            if (!in.ok || !playlist || !hasSong(song)) return false;
+            User* user = owner.empty() ? nullptr : findUser(owner);
+            if (kind == J_PLAYLIST_ADD_SONG) addSongToPlaylist(user, playlist.get(), song);
+            else removeSongFromPlaylist(user, playlist.get(), song);
+            return true;
+        }
+        case J_PLAYLIST_REMOVE_AT:
+        case J_PLAYLIST_MOVE: {
+            string owner = in.str(), name = in.str();
+            uint32_t from = in.u32();
+            uint32_t to = kind == J_PLAYLIST_MOVE ? in.u32() : 0;
+            shared_ptr<Playlist> playlist = sharePlaylistOf(owner, name);
+            if (!in.ok || !playlist) return false;
+            User* user = owner.empty() ? nullptr : findUser(owner);
+            if (kind == J_PLAYLIST_REMOVE_AT) return removePlaylistEntry(user, playlist.get(), from);
+            return movePlaylistEntry(user, playlist.get(), from, to);
+        }
+        case J_USER_ADD_PLAYLIST:
+        case J_USER_DELETE_PLAYLIST: {
+            string username = in.str(), name = in.str();
+            User* user = findUser(username);
+            if (!in.ok || !user) return false;
+            if (kind == J_USER_ADD_PLAYLIST) return addUserPlaylist(user, name);
+            deleteUserPlaylist(user, name);
+            return true;
+        }
+        case J_SAVE_SONG:
+        case J_UNSAVE_SONG:
+        case J_FAVORITE_SONG:
+        case J_UNFAVORITE_SONG: {
+            string username = in.str();
+            SongId song = in.u32();
+            User* user = findUser(username);
+            if (!in.ok || !user || !hasSong(song)) return false;
+            if (kind == J_SAVE_SONG) saveSong(user, song);
+            else if (kind == J_UNSAVE_SONG) unsaveSong(user, song);
+            else if (kind == J_FAVORITE_SONG) favoriteSong(user, song);
+            else unfavoriteSong(user, song);
+            return true;
+        }
+        case J_SAVE_SONGS:
+        case J_UNSAVE_SONGS:
+        case J_FAVORITE_SONGS:
+        case J_UNFAVORITE_SONGS: {
+            string username = in.str();
+            vector<SongId> list = in.ids();
+            User* user = findUser(username);
+            if (!in.ok || !user) return false;
+            updateSongSet(user, (JournalRecordKind)kind, list);
+            return true;
+        }
+        case J_FOLLOW_PLAYLIST: {
+            string username = in.str(), owner = in.str(), name = in.str();
+            User* user = findUser(username);
+            return in.ok && user && followPlaylist(user, owner, name);
+        }
+        case J_UNFOLLOW_PLAYLIST:
+        case J_FORK_PLAYLIST: {
+            string username = in.str();
+            uint32_t index = in.u32();
+            string name = kind == J_FORK_PLAYLIST ? in.str() : "";
+            User* user = findUser(username);
+            if (!in.ok || !user) return false;
+            if (kind == J_UNFOLLOW_PLAYLIST) return unfollowPlaylist(user, index);
+            return forkPlaylist(user, index, name);
+        }
+        case J_EDIT_ARTIST: {
+            string name = in.str();
+            int albums = in.i32();
+            if (!in.ok) return false;
+            editArtist(name, albums);
+            return true;
+        }
+        case J_ARTIST_ADD_SONG: {
+            string name = in.str();
+            SongId song = in.u32();
+            if (!in.ok || !hasSong(song)) return false;
+            return addSongToArtist(name, song);
+        }
+        }
+        return false;
+    }
+};
+
+thread_local bool MusicSystem::deferSync = false;
+thread_local uint64_t MusicSystem::unsyncedSeq = 0;
+
+class SnapshotBuilder {
+public:
+    vector<char> sections[SEC_COUNT];
+    unordered_map<string, SnapshotString> shared;
+
+    template <class T>
+    void put(uint32_t kind, const T& record) {
+        const char* p = (const char*)&record;
+        sections[kind].insert(sections[kind].end(), p, p + sizeof(T));
+    }
+
+    void putIds(uint32_t kind, const vector<SongId>& ids) {
+        const char* p = (const char*)ids.data();
+        sections[kind].insert(sections[kind].end(), p, p + ids.size() * sizeof(SongId));
+    }
+
+    // Pass dedupe for strings that repeat across records (artists, genres).
+    SnapshotString str(string_view s, bool dedupe = false) {
+        if (dedupe) {
+            auto it = shared.find(string(s));
+            if (it != shared.end()) return it->second;
+        }
+        SnapshotString ref = {};
+        ref.offset = sections[SEC_STRINGS].size();
+        ref.length = (uint32_t)s.size();
+        sections[SEC_STRINGS].insert(sections[SEC_STRINGS].end(), s.begin(), s.end());
+        if (dedupe) shared.emplace(string(s), ref);
+        return ref;
+    }
+
+    SnapshotIdRange ids(const vector<SongId>& list) {
+        SnapshotIdRange range;
+        range.offset = sections[SEC_IDS].size() / sizeof(SongId);
+        range.count = list.size();
+        putIds(SEC_IDS, list);
+        return range;
+    }
+
+    SnapshotPlaylist playlist(const Playlist& p) {
+        SnapshotPlaylist rec = {};
+        rec.name = str(p.name);
+        rec.playbackMode = (int32_t)p.playbackMode;
+        rec.currentSongIndex = (int32_t)p.currentPosition();
+        rec.songs = ids(p.songList());
+        return rec;
+    }
+
+    // Writes to a temporary file and renames it over path, so a mapped copy
+    // of the previous snapshot stays valid while the new one is written.
+    bool write(const string& path, string& error, uint64_t* checksum = nullptr) {
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.sectionCount = SEC_COUNT;
+        SnapshotSection directory[SEC_COUNT];
+        uint64_t offset = sizeof(SnapshotHeader) + sizeof(directory);
+        for (uint32_t i = 0; i < SEC_COUNT; ++i) {
+            offset = (offset + 7) & ~(uint64_t)7;
+            directory[i].kind = i;
+            directory[i].reserved = 0;
+            directory[i].offset = offset;
+            directory[i].size = sections[i].size();
+            directory[i].checksum = fnv1a(sections[i].data(), sections[i].size());
+            offset += sections[i].size();
+        }
+        header.fileSize = offset;
+        header.checksum = SnapshotImage::headerChecksum(header, directory);
+        string tmp = path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "wb");
+        if (!out) {
+            error = "cannot create " + tmp;
+            return false;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+            && fwrite(directory, sizeof(directory), 1, out) == 1;
+        uint64_t written = sizeof(header) + sizeof(directory);
+        const char padding[8] = {};
+        for (uint32_t i = 0; ok && i < SEC_COUNT; ++i) {
+            size_t pad = (size_t)(directory[i].offset - written);
+            ok = fwrite(padding, 1, pad, out) == pad
+                && fwrite(sections[i].data(), 1, sections[i].size(), out) == sections[i].size();
+            written = directory[i].offset + sections[i].size();
+        }
+        ok = syncFile(out) && ok;
+        ok = fclose(out) == 0 && ok;
+        if (!ok) {
+            error = "write to " + tmp + " failed";
+            return false;
+        }
+        if (!replaceFile(tmp, path)) {
+            error = "cannot replace " + path;
+            return false;
+        }
+        if (checksum) *checksum = header.checksum;
+        return true;
+    }
+};
+
+bool writeSnapshot(const MusicSystem& system, const string& path, string& error, uint64_t* checksum) {
+    // Writers are held off by the caller (see compact), so one read section
+    // gives a catalog that agrees with the users and playlists.
+    ReadSection section;
+    const CatalogVersion& catalog = system.catalog();
+    SnapshotBuilder out;
+    const SongCatalog& songs = catalog.songs;
+    const CollationKeys& keys = catalog.sortedViews.keys;
+    SnapshotMeta meta = {};
+    meta.songCount = songs.size();
+    meta.systemPlaylistCount = system.playlists.size();
+    meta.collationLocale = out.str(keys.collator.localeName);
+    for (SongId id = 0; id < (SongId)songs.size(); ++id) {
+        SongView s = songs[id];
+        SnapshotSong rec = {};
+        rec.name = out.str(s.name);
+        rec.artistName = out.str(s.artistName, true);
+        rec.genre = out.str(s.genre, true);
+        rec.releaseYear = s.releaseYear;
+        out.put(SEC_SONGS, rec);
+        SnapshotCollation collation = {};
+        collation.nameKey = out.str(keys.nameKey(id));
+        collation.artistKey = out.str(keys.artistKey(id), true);
+        out.put(SEC_COLLATION, collation);
+    }
+
+    size_t slotCount = 0;
+    if (!songs.empty()) {
+        slotCount = 1;
+        while (slotCount < 2 * songs.size()) slotCount *= 2;
+    }
+    vector<SongId> slots(slotCount, NO_SONG);
+    for (SongId id = 0; id < (SongId)songs.size(); ++id) {
+        SongView s = songs[id];
+        size_t slot = songKeyHash(s.name, s.artistName) & (slotCount - 1);
+        while (slots[slot] != NO_SONG) slot = (slot + 1) & (slotCount - 1);
+        slots[slot] = id;
+    }
+    out.putIds(SEC_SONG_KEYS, slots);
+    meta.keySlotCount = slotCount;
+
+    for (unsigned int trigram : catalog.searchIndex.trigrams()) {
+        SnapshotTrigram rec = {};
+        rec.trigram = trigram;
+        rec.ids = out.ids(catalog.searchIndex.lookup(trigram).toVector());
+        out.put(SEC_TRIGRAMS, rec);
+    }
+    for (const string& artist : catalog.attributeIndex.artistNames()) {
+        SnapshotKeyPostings rec = {};
+        rec.key = out.str(artist, true);
+        rec.ids = out.ids(catalog.attributeIndex.artist(artist).toVector());
+        out.put(SEC_ARTIST_POSTINGS, rec);
+    }
+    for (const string& genre : catalog.attributeIndex.genreNames()) {
+        SnapshotKeyPostings rec = {};
+        rec.key = out.str(genre, true);
+        rec.ids = out.ids(catalog.attributeIndex.genre(genre).toVector());
+        out.put(SEC_GENRE_POSTINGS, rec);
+    }
+    for (int year : catalog.attributeIndex.years()) {
+        SnapshotYearPostings rec = {};
+        rec.year = year;
+        rec.ids = out.ids(catalog.attributeIndex.year(year).toVector());
+        out.put(SEC_YEAR_POSTINGS, rec);
+    }
+    out.putIds(SEC_ORDER_NAME, catalog.sortedViews.page(SORT_NAME, 0, songs.size()));
+    out.putIds(SEC_ORDER_ARTIST, catalog.sortedViews.page(SORT_ARTIST, 0, songs.size()));
+    out.putIds(SEC_ORDER_YEAR, catalog.sortedViews.page(SORT_YEAR, 0, songs.size()));
+
+    for (const auto& kv : catalog.artists) {
+        SnapshotArtist rec = {};
+        rec.name = out.str(kv.second.name, true);
+        rec.albums = kv.second.numberOfAlbums;
+        rec.songs = out.ids(kv.second.releasedSongs);
+        out.put(SEC_ARTISTS, rec);
+    }
+    // Owned playlists are written first; favorites refer to them by record
+    // number. A favorite whose owner deleted it gets one record of its own,
+    // shared by all of its remaining followers.
+    unordered_map<const Playlist*, uint32_t> records;
+    auto record = [&](const Playlist& p) {
+        uint32_t n = (uint32_t)records.size();
+        records.emplace(&p, n);
+        out.put(SEC_PLAYLISTS, out.playlist(p));
+        return n;
+    };
+    for (const auto& p : system.playlists) record(p);
+    vector<SnapshotUser> userRecords;
+    for (const auto& u : system.users) {
+        // Sessions reading a user may tidy its song sets.
+        lock_guard<mutex> guard(system.userLocks.of(&u));
+        SnapshotUser rec = {};
+        rec.username = out.str(u.username);
+        rec.password = out.str(u.password);
+        rec.savedSongs = out.ids(u.savedSongs.toVector());
+        rec.favoriteSongs = out.ids(u.favoriteSongs.toVector());
+        rec.personalPlaylists.offset = records.size();
+        rec.personalPlaylists.count = u.personalPlaylists.size();
+        for (const auto& p : u.personalPlaylists) record(p);
+        userRecords.push_back(rec);
+    }
+    auto rec = userRecords.begin();
+    for (const auto& u : system.users) {
+        vector<uint32_t> refs;
+        for (const auto& p : u.favoritePlaylists) {
+            auto it = records.find(p.get());
+            refs.push_back(it != records.end() ? it->second : record(*p));
+        }
+        rec->favoritePlaylists = out.ids(refs);
+        out.put(SEC_USERS, *rec++);
+    }
+    out.put(SEC_META, meta);
+    return out.write(path, error, checksum);
+}
+
+string escapeField(string_view s) {
+    string out;
+    for (char c : s) {
+        if (c == '\\') out += "\\\\";
+        else if (c == '\t') out += "\\t";
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else out += c;
+    }
+    return out;
+}
+
+string unescapeField(const string& s) {
+    string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            out += s[i];
+            continue;
+        }
+        char c = s[++i];
+        out += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+    }
+    return out;
+}
+
+vector<string> splitFields(const string& line) {
+    vector<string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(unescapeField(line.substr(start, tab == string::npos ? string::npos : tab - start)));
+        if (tab == string::npos) return fields;
+        start = tab + 1;
+    }
+}
+
+string joinIds(const vector<SongId>& ids) {
+    string out;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (i) out += ' ';
+        out += to_string(ids[i]);
+    }
+    return out;
+}
+
+// Fails on an id of limit or more, i.e. one naming a song that does not exist.
+bool parseIds(const string& field, size_t limit, vector<SongId>& ids) {
+    const char* p = field.c_str();
+    char* end = nullptr;
+    for (unsigned long v = strtoul(p, &end, 10); end != p; v = strtoul(p, &end, 10)) {
+        if (v >= limit) return false;
+        ids.push_back((SongId)v);
+        p = end;
+    }
+    return true;
+}
+
+string playlistFields(const Playlist& p) {
+    return escapeField(p.name) + '\t' + to_string((int)p.playbackMode) + '\t'
+        + to_string(p.currentPosition()) + '\t' + joinIds(p.songList());
+}
+
+// Tab-separated text form of the whole system, one record per line.
+// Songs are listed in id order so that ids in later records stay valid.
+bool exportText(const MusicSystem& system, const string& path, string& error) {
+    ofstream out(path);
+    if (!out) {
+        error = "cannot create " + path;
+        return false;
+    }
+    ReadSection section;
+    const CatalogVersion& catalog = system.catalog();
+    for (SongId id = 0; id < (SongId)catalog.songs.size(); ++id) {
+        SongView s = catalog.songs[id];
+        out << "song\t" << escapeField(s.name) << '\t' << escapeField(s.artistName) << '\t'
+            << s.releaseYear << '\t' << escapeField(s.genre) << '\n';
+    }
+    for (const auto& kv : catalog.artists)
+        out << "artist\t" << escapeField(kv.first) << '\t' << kv.second.numberOfAlbums << '\t' << joinIds(kv.second.releasedSongs) << '\n';
+    for (const auto& p : system.playlists)
+        out << "playlist\t" << playlistFields(p) << '\n';
+    unordered_map<const Playlist*, string> owners;
+    for (const auto& u : system.users)
+        for (const auto& p : u.personalPlaylists) owners[&p] = u.username;
+    for (const auto& p : system.playlists) owners[&p] = "";
+    for (const auto& u : system.users) {
+        out << "user\t" << escapeField(u.username) << '\t' << escapeField(u.password) << '\n'
+            << "saved\t" << joinIds(u.savedSongs.toVector()) << '\n'
+            << "favorite\t" << joinIds(u.favoriteSongs.toVector()) << '\n';
+        for (const auto& p : u.personalPlaylists)
+            out << "personal\t" << playlistFields(p) << '\n';
+        for (const auto& p : u.favoritePlaylists) {
+            auto owner = owners.find(p.get());
+            if (owner != owners.end())
+                out << "follow\t" << escapeField(owner->second) << '\t' << escapeField(p->name) << '\n';
+            else
+                out << "favorite-playlist\t" << playlistFields(*p) << '\n';
+        }
+    }
+    out.close();
+    if (!out) {
+        error = "write to " + path + " failed";
+        return false;
+    }
+    return true;
+}
+
+bool importText(MusicSystem& system, const string& path, string& error) {
+    ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    string line;
+    size_t lineNumber = 0;
+    auto fail = [&](const string& why) {
+        error = path + ":" + to_string(lineNumber) + ": " + why;
+        return false;
+    };
+    struct PendingFollow {
+        User* user;
+        size_t slot;
+        string owner;
+        string name;
+        size_t line;
+    };
+    vector<PendingFollow> follows;
+    auto readIds = [&](const string& field, vector<SongId>& ids) {
+        return parseIds(field, system.songCount(), ids) || fail("unknown song id");
+    };
+    auto readPlaylist = [&](const vector<string>& f, Playlist& p) {
+        int mode = atoi(f[2].c_str());
+        if (mode < SEQUENTIAL || mode > AUTOPLAY) return fail("bad playback mode");
+        vector<SongId> ids;
+        if (!readIds(f[4], ids)) return false;
+        p.name = f[1];
+        p.playbackMode = (PlaybackMode)mode;
+        p.assign(ids);
+        p.setCurrentPosition((size_t)atoi(f[3].c_str()));
+        return true;
+    };
+    while (getline(in, line)) {
+        ++lineNumber;
+        if (line.empty()) continue;
+        vector<string> f = splitFields(line);
+        const string& kind = f[0];
+        if (kind == "song" && f.size() == 5) {
+            size_t expected = system.songCount();
+            if (system.addSong(Song(f[1], f[2], atoi(f[3].c_str()), f[4])) != expected)
+                return fail("duplicate song");
+        }
+        else if (kind == "artist" && f.size() == 4) {
+            Artist artist(f[1], atoi(f[2].c_str()));
+            if (!readIds(f[3], artist.releasedSongs)) return false;
+            artist.numberOfReleasedSongs = (int)artist.releasedSongs.size();
+            system.updateCatalog([&](CatalogVersion& c) { c.artists[f[1]] = artist; });
+        }
+        else if (kind == "playlist" && f.size() == 5) {
+            Playlist p;
+            if (!readPlaylist(f, p)) return false;
+            if (!system.playlists.add(move(p))) return fail("duplicate playlist");
+        }
+        else if (kind == "user" && f.size() == 3) {
+            if (!system.users.add(User(f[1], f[2]))) return fail("duplicate user");
+        }
+        else if (system.users.empty()) {
+            return fail("unknown record");
+        }
+        else if (kind == "saved" && f.size() == 2) {
+            vector<SongId> ids;
+            if (!readIds(f[1], ids)) return false;
+            system.users.back().savedSongs.assign(ids.begin(), ids.end());
+        }
+        else if (kind == "favorite" && f.size() == 2) {
+            vector<SongId> ids;
+            if (!readIds(f[1], ids)) return false;
+            system.users.back().favoriteSongs.assign(ids.begin(), ids.end());
+        }
+        else if (kind == "personal" && f.size() == 5) {
+            Playlist p;
+            if (!readPlaylist(f, p)) return false;
+            if (!system.users.back().personalPlaylists.add(move(p))) return fail("duplicate playlist");
+        }
+        else if (kind == "favorite-playlist" && f.size() == 5) {
+            Playlist p;
+            if (!readPlaylist(f, p)) return false;
+            system.users.back().favoritePlaylists.push_back(make_shared<Playlist>(move(p)));
+        }
+        else if (kind == "follow" && f.size() == 3) {
+            User& user = system.users.back();
+            follows.push_back(PendingFollow{ &user, user.favoritePlaylists.size(), f[1], f[2], lineNumber });
+            user.favoritePlaylists.push_back(nullptr);
+        }
+        else {
+            return fail("unknown record");
+        }
+    }
+    // Followed playlists may belong to users listed later in the file.
+    for (const auto& follow : follows) {
+        lineNumber = follow.line;
+        shared_ptr<Playlist> playlist = system.sharePlaylistOf(follow.owner, follow.name);
+        if (!playlist) return fail("followed playlist not found");
+        follow.user->favoritePlaylists[follow.slot] = playlist;
+    }
+    system.rebuildCharts();
+    system.rebuildRelated();
+    return true;
+}
+
+class ImportReport {
+public:
+    size_t rows;
+    size_t inserted;
+    size_t duplicates;
+    size_t malformed;
+    double seconds;
+    vector<pair<size_t, string>> problems;
+
+    ImportReport() : rows(0), inserted(0), duplicates(0), malformed(0), seconds(0) {}
+
+    void print(ostream& out, size_t maxProblems = 20) const {
+        for (size_t i = 0; i < problems.size() && i < maxProblems; ++i)
+            out << "line " << problems[i].first << ": " << problems[i].second << '\n';
+        if (problems.size() > maxProblems)
+            out << "... " << problems.size() - maxProblems << " more problems\n";
+        out << rows << " rows: " << inserted << " inserted, " << duplicates << " duplicates, "
+            << malformed << " malformed in " << seconds << "s ("
+            << (size_t)(seconds > 0 ? rows / seconds : 0) << " rows/sec)\n";
+    }
+};
+
+// Streams a CSV or TSV file of name, artist, year, genre rows. The reader
+// cuts the file into newline-aligned chunks, a pool of threads parses them,
+// and the calling thread inserts parsed chunks in file order, one batch per
+// chunk. Quoted CSV fields may contain delimiters but not line breaks.
+class BulkImporter {
+public:
+    MusicSystem& system;
+    size_t threads;
+    size_t chunkBytes;
+
+    BulkImporter(MusicSystem& s, size_t t = 0, size_t chunk = 4 << 20)
+        : system(s), threads(t ? t : max(1u, thread::hardware_concurrency())), chunkBytes(chunk) {}
+
+    struct Chunk {
+        size_t index;
+        string text;
+    };
+
+    struct ParsedChunk {
+        vector<Song> songs;
+        vector<size_t> songLines;
+        vector<pair<size_t, string>> errors;
+        size_t lines;
+        bool headerSkipped;
+    };
+
+    static bool splitRow(const char* p, const char* end, char delim, vector<string>& fields) {
+        fields.clear();
+        string field;
+        while (true) {
+            field.clear();
+            if (p < end && *p == '"' && delim == ',') {
+                ++p;
+                while (true) {
+                    if (p == end) return false;
+                    if (*p == '"') {
+                        if (p + 1 < end && p[1] == '"') {
+                            field += '"';
+                            p += 2;
+                            continue;
+                        }
+                        ++p;
+                        break;
+                    }
+                    field += *p++;
+                }
+                if (p < end && *p != delim) return false;
+            }
+            else {
+                const char* start = p;
+                while (p < end && *p != delim) ++p;
+                field.assign(start, p);
+            }
+            fields.push_back(field);
+            if (p == end) return true;
+            ++p;
+        }
+    }
+
+    static bool parseYear(const string& field, int& year) {
+        const char* s = field.c_str();
+        while (*s == ' ') ++s;
+        char* end = nullptr;
+        long v = strtol(s, &end, 10);
+        if (end == s) return false;
+        while (*end == ' ') ++end;
+        if (*end != '\0' || v < INT_MIN || v > INT_MAX) return false;
+        year = (int)v;
+        return true;
+    }
+
+    static void parseChunk(const Chunk& chunk, char delim, ParsedChunk& out) {
+        out.lines = 0;
+        out.headerSkipped = false;
+        vector<string> fields;
+        const char* p = chunk.text.data();
+        const char* end = p + chunk.text.size();
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            const char* lineEnd = nl ? nl : end;
+            size_t line = ++out.lines;
+            const char* rowEnd = (lineEnd > p && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+            if (rowEnd > p) {
+                int year = 0;
+                if (!splitRow(p, rowEnd, delim, fields))
+                    out.errors.push_back(make_pair(line, string("malformed: unterminated quote")));
+                else if (fields.size() != 4)
+                    out.errors.push_back(make_pair(line, "malformed: expected 4 fields, found " + to_string(fields.size())));
+                else if (!parseYear(fields[2], year)) {
+                    if (chunk.index == 0 && line == 1 && foldString(fields[2]) == "year")
+                        out.headerSkipped = true;
+                    else
+                        out.errors.push_back(make_pair(line, "malformed: bad year '" + fields[2] + "'"));
+                }
+                else if (fields[0].empty() || fields[1].empty())
+                    out.errors.push_back(make_pair(line, string("malformed: empty name or artist")));
+                else {
+                    out.songs.push_back(Song(fields[0], fields[1], year, fields[3]));
+                    out.songLines.push_back(line);
+                }
+            }
+            p = nl ? nl + 1 : end;
+        }
+    }
+
+    ImportReport run(const string& path, string& error) {
+        ImportReport report;
+        ifstream in(path, ios::binary);
+        if (!in) {
+            error = "cannot open " + path;
+            return report;
+        }
+        auto started = chrono::steady_clock::now();
+        mutex lock;
+        condition_variable jobReady, resultReady;
+        vector<Chunk> jobs;
+        map<size_t, ParsedChunk> results;
+        bool done = false;
+        char delim = 0;
+        vector<thread> pool;
+        for (size_t t = 0; t < threads; ++t) {
+            pool.push_back(thread([&] {
+                while (true) {
+                    Chunk chunk;
+                    {
+                        unique_lock<mutex> guard(lock);
+                        jobReady.wait(guard, [&] { return !jobs.empty() || done; });
+                        if (jobs.empty()) return;
+                        chunk = move(jobs.back());
+                        jobs.pop_back();
+                    }
+                    ParsedChunk parsed;
+                    parseChunk(chunk, delim, parsed);
+                    lock_guard<mutex> guard(lock);
+                    results[chunk.index] = move(parsed);
+                    resultReady.notify_all();
+                }
+            }));
+        }
+
+        string carry;
+        vector<char> buffer(chunkBytes);
+        size_t nextRead = 0, nextInsert = 0, lineBase = 0;
+        bool eof = false;
+        const size_t maxInFlight = 2 * threads;
+        while (true) {
+            while (!eof && nextRead - nextInsert < maxInFlight) {
+                in.read(buffer.data(), (streamsize)buffer.size());
+                size_t got = (size_t)in.gcount();
+                eof = got < buffer.size();
+                Chunk chunk;
+                chunk.index = nextRead;
+                chunk.text.swap(carry);
+                chunk.text.append(buffer.data(), got);
+                size_t cut = eof ? chunk.text.size() : chunk.text.rfind('\n');
+                if (cut == string::npos) {
+                    carry.swap(chunk.text);
+                    continue;
+                }
+                if (!eof) {
+                    carry.assign(chunk.text, cut + 1, string::npos);
+                    chunk.text.resize(cut + 1);
+                }
+                if (delim == 0) {
+                    size_t firstLine = chunk.text.find('\n');
+                    delim = chunk.text.substr(0, firstLine).find('\t') != string::npos ? '\t' : ',';
+                }
+                lock_guard<mutex> guard(lock);
+                jobs.insert(jobs.begin(), move(chunk));
+                ++nextRead;
+                jobReady.notify_one();
+            }
+            if (nextInsert == nextRead) break;
+            ParsedChunk parsed;
+            {
+                unique_lock<mutex> guard(lock);
+                resultReady.wait(guard, [&] { return results.count(nextInsert) > 0; });
+                parsed = move(results[nextInsert]);
+                results.erase(nextInsert);
+            }
+            ++nextInsert;
+            vector<size_t> duplicates = system.addSongs(parsed.songs);
+            size_t d = 0;
+            vector<pair<size_t, string>> problems;
+            for (const auto& e : parsed.errors) problems.push_back(make_pair(lineBase + e.first, e.second));
+            for (; d < duplicates.size(); ++d)
+                problems.push_back(make_pair(lineBase + parsed.songLines[duplicates[d]], string("duplicate song")));
+            sort(problems.begin(), problems.end());
+            report.problems.insert(report.problems.end(), problems.begin(), problems.end());
+            report.rows += parsed.songs.size() + parsed.errors.size();
+            report.inserted += parsed.songs.size() - duplicates.size();
+            report.duplicates += duplicates.size();
+            report.malformed += parsed.errors.size();
+            lineBase += parsed.lines;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            done = true;
+            jobReady.notify_all();
+        }
+        for (auto& t : pool) t.join();
+        if (in.bad()) error = "read error in " + path;
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        return report;
+    }
+};
+
+bool importSongs(MusicSystem& system, const string& path, ImportReport& report, string& error) {
+    BulkImporter importer(system, system.workerThreads);
+    error.clear();
+    report = importer.run(path, error);
+    // Imported songs are not journaled, so they are compacted in even when
+    // the import stopped partway; otherwise later journal records would
+    // refer to ids that replay cannot reproduce.
+    string compactError;
+    if (report.inserted > 0 && system.journal && !system.compact(compactError))
+        error = error.empty() ? compactError : error + "; " + compactError;
+    return error.empty();
+}
+
+// Line protocol for driving the system from scripts: one command per line,
+// fields separated by tabs, one response per command. A response is
+// "ok", "ok<TAB>value", or for listings "ok<TAB>n" followed by n rows of
+// tab-separated fields; failures are "err<TAB>message". Blank lines and
+// lines starting with # get no response. Song ids and playlist positions
+// count from 0. Responses to a batch of input are written once the journal
+// records it produced are durable.
+class CommandSession {
+public:
+    MusicSystem& system;
+    OutputBuffer& out;
+    User* user;
+    bool isAdmin;
+    bool failed;
+    vector<string> fields;
+
+    CommandSession(MusicSystem& s, OutputBuffer& o) : system(s), out(o), user(nullptr), isAdmin(false), failed(false) {}
+
+    // Runs one protocol line; blank lines and # comments are skipped.
+    // Returns false after quit.
+    bool executeLine(string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty() || line[0] == '#') return true;
+        split(line, fields);
+        return execute(fields);
+    }
+
+    static void split(string_view line, vector<string>& fields) {
+        fields.clear();
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(string(line.substr(start, tab == string_view::npos ? string_view::npos : tab - start)));
+            if (tab == string_view::npos) return;
+            start = tab + 1;
+        }
+    }
+
+    static bool number(const string& text, long long& value) {
+        if (text.empty()) return false;
+        char* end = nullptr;
+        value = strtoll(text.c_str(), &end, 10);
+        return *end == 0;
+    }
+
+    bool error(const string& message) {
+        out << "err\t" << message << '\n';
+        return true;
+    }
+
+    bool ok() {
+        out << "ok\n";
+        return true;
+    }
+
+    template <class T>
+    bool ok(const T& value) {
+        out << "ok\t" << value << '\n';
+        return true;
+    }
+
+    // Call inside a read section.
+    void songRow(const CatalogVersion& catalog, SongId id) {
+        SongView s = catalog.songs[id];
+        out << id << '\t' << s.name << '\t' << s.artistName << '\t' << s.releaseYear << '\t' << s.genre << '\n';
+    }
+
+    // Optional OFFSET and COUNT at args[first], args[first + 1]; COUNT
+    // defaults to one page.
+    bool listSongs(const SongPages& list, const vector<string>& args, size_t first) {
+        long long offset = 0, count = PageCursor::PAGE_SIZE;
+        if ((args.size() > first && !number(args[first], offset)) || (args.size() > first + 1 && !number(args[first + 1], count))
+            || offset < 0 || count < 0)
+            return error("bad offset or count");
+        size_t begin = min((size_t)offset, list.total);
+        vector<SongId> ids = list.fetch(begin, min((size_t)count, list.total - begin));
+        out << "ok\t" << ids.size() << '\n';
+        system.read([&](const CatalogVersion& c) {
+            for (SongId id : ids) songRow(c, id);
+        });
+        return true;
+    }
+
+    bool songArg(const string& text, SongId& id) {
+        long long value;
+        if (!number(text, value) || value < 0 || !system.hasSong((SongId)value)) return false;
+        id = (SongId)value;
+        return true;
+    }
+
+    shared_ptr<Playlist> playlistArg(const string& name) {
+        return system.sharePlaylist(user, name);
+    }
+
+    // Runs one command; false once the session should stop.
+    bool execute(const vector<string>& args) {
+        const string& cmd = args[0];
+        size_t n = args.size();
+        if (cmd == "quit") return false;
+        if (cmd == "register") {
+            if (n != 3) return error("usage: register USER PASSWORD");
+            if (!system.addUser(User(args[1], args[2]))) return error("username already exists");
+            return ok();
+        }
+        if (cmd == "login" || cmd == "admin") {
+            if (n != 3) return error("usage: " + cmd + " USER PASSWORD");
+            User* found = cmd == "login" ? system.findUser(args[1]) : nullptr;
+            if (cmd == "login" ? !(found && found->checkPassword(args[2])) : !system.admin.login(args[1], args[2]))
+                return error("invalid credentials");
+            user = found;
+            isAdmin = cmd == "admin";
+            return ok();
+        }
+        if (cmd == "logout") {
+            user = nullptr;
+            isAdmin = false;
+            return ok();
+        }
+        if (cmd == "song") {
+            SongId id;
+            if (n != 2 || !songArg(args[1], id)) return error("usage: song ID");
+            out << "ok\t1\n";
+            system.read([&](const CatalogVersion& c) { songRow(c, id); });
+            return true;
+        }
+        if (cmd == "songs") return listSongs(system.allSongs(), args, 1);
+        if (cmd == "sorted") {
+            if (n < 2) return error("usage: sorted name|artist|year [OFFSET [COUNT]]");
+            SortField field = args[1] == "name" ? SORT_NAME : args[1] == "artist" ? SORT_ARTIST : args[1] == "year" ? SORT_YEAR : SORT_CATALOG;
+            if (field == SORT_CATALOG) return error("unknown sort field");
+            MusicSystem& s = system;
+            return listSongs(SongPages(s.songCount(), [&s, field](size_t offset, size_t count) {
+                return s.songsPage(field, offset, count);
+            }), args, 2);
+        }
+        if (cmd == "search") {
+            long long k = PageCursor::PAGE_SIZE;
+            if (n < 2 || n > 3 || (n == 3 && (!number(args[2], k) || k < 0))) return error("usage: search KEYWORD [K]");
+            vector<SearchHit> hits = system.rankedSearch(args[1], (size_t)k);
+            out << "ok\t" << hits.size() << '\n';
+            system.read([&](const CatalogVersion& c) {
+                for (const auto& hit : hits) {
+                    out << hit.score << '\t';
+                    songRow(c, hit.id);
+                }
+            });
+            return true;
+        }
+        if (cmd == "find") {
+            if (n < 2) return error("usage: find KEYWORD [OFFSET [COUNT]]");
+            return listSongs(SongPages::of(system.searchSongs(args[1])), args, 2);
+        }
+        if (cmd == "filter-artist" || cmd == "filter-genre") {
+            if (n < 2) return error("usage: " + cmd + " NAME [OFFSET [COUNT]]");
+            return listSongs(cmd == "filter-artist" ? system.filterSongsByArtist(args[1]) : system.filterSongsByGenre(args[1]), args, 2);
+        }
+        if (cmd == "filter-year") {
+            long long from, to;
+            if (n < 3 || !number(args[1], from) || !number(args[2], to)) return error("usage: filter-year FROM TO [OFFSET [COUNT]]");
+            return listSongs(system.filterSongsByYearRange((int)from, (int)to), args, 3);
+        }
+        if (cmd == "related") {
+            SongId id;
+            long long k = PageCursor::PAGE_SIZE;
+            if (n < 2 || n > 3 || !songArg(args[1], id) || (n == 3 && (!number(args[2], k) || k < 0)))
+                return error("usage: related ID [K]");
+            vector<pair<SongId, uint32_t>> related = system.relatedSongs(id, (size_t)k);
+            out << "ok\t" << related.size() << '\n';
+            system.read([&](const CatalogVersion& c) {
+                for (const auto& entry : related) {
+                    out << entry.second << '\t';
+                    songRow(c, entry.first);
+                }
+            });
+            return true;
+        }
+        if (cmd == "top") {
+            static const char* charts[] = { "saved", "favorites", "trending-saved", "trending-favorites" };
+            size_t chart = find(charts, charts + 4, n > 1 ? args[1] : "") - charts;
+            long long k = PageCursor::PAGE_SIZE;
+            if (chart == 4 || n > 4 || (n == 4 && (!number(args[3], k) || k < 0)))
+                return error("usage: top saved|favorites|trending-saved|trending-favorites [GENRE [K]]");
+            vector<pair<SongId, double>> top = system.topSongs(chart % 2 ? CHART_FAVORITE : CHART_SAVED,
+                n > 2 ? args[2] : "", chart >= 2, (size_t)k);
+            out << "ok\t" << top.size() << '\n';
+            system.read([&](const CatalogVersion& c) {
+                for (const auto& entry : top) {
+                    out << entry.second << '\t';
+                    songRow(c, entry.first);
+                }
+            });
+            return true;
+        }
+        if (!user && !isAdmin) return error("not logged in");
+        if (cmd == "add-song") {
+            long long year;
+            if (!isAdmin) return error("admin only");
+            if (n != 5 || !number(args[3], year)) return error("usage: add-song NAME ARTIST YEAR GENRE");
+            return ok(system.addSong(Song(args[1], args[2], (int)year, args[4])));
+        }
+        if (cmd == "metrics") {
+            if (!isAdmin) return error("admin only");
+            if (n > 2) return error("usage: metrics [FILE]");
+            if (n == 2) {
+                ofstream file(args[1]);
+                Metrics::instance().writeJson(file);
+                return file ? ok() : error("cannot write " + args[1]);
+            }
+            out << "ok\t" << (Metrics::enabled ? METRIC_OP_COUNT : 0) << '\n';
+            for (size_t op = 0; op < METRIC_OP_COUNT && Metrics::enabled; ++op) {
+                MetricSummary s = Metrics::instance().summarize((MetricOp)op);
+                out << METRIC_OP_NAMES[op] << '\t' << s.count << '\t' << s.totalNs << '\t' << s.p50 << '\t' << s.p90
+                    << '\t' << s.p99 << '\t' << s.p999 << '\t' << s.maxNs << '\n';
+            }
+            return true;
+        }
+        if (cmd == "snapshot") {
+            string message;
+            if (!isAdmin) return error("admin only");
+            if (!system.compact(message)) return error(message);
+            return ok();
+        }
+        if (cmd == "playlists") {
+            vector<PlaylistSummary> list = system.playlistSummaries(user);
+            out << "ok\t" << list.size() << '\n';
+            for (const auto& p : list) out << p.name << '\t' << p.songs << '\n';
+            return true;
+        }
+        if (cmd == "create-playlist") {
+            if (n != 2) return error("usage: create-playlist NAME");
+            bool created = user ? system.addUserPlaylist(user, args[1]) : system.createPlaylist(args[1]);
+            return created ? ok() : error("playlist already exists");
+        }
+        if (cmd == "delete-playlist") {
+            if (!user) return error("user only");
+            if (n != 2 || !system.sharePlaylist(user, args[1])) return error("playlist not found");
+            system.deleteUserPlaylist(user, args[1]);
+            return ok();
+        }
+        if (cmd.compare(0, 8, "playlist") == 0 || cmd == "play" || cmd == "next" || cmd == "prev" || cmd == "current")
+            return playlistCommand(args);
+        if (!user) return error("user only");
+        if (cmd == "save" || cmd == "unsave" || cmd == "favorite" || cmd == "unfavorite") {
+            SongId id;
+            if (n != 2 || !songArg(args[1], id)) return error("usage: " + cmd + " ID");
+            if (cmd == "save") system.saveSong(user, id);
+            else if (cmd == "unsave") system.unsaveSong(user, id);
+            else if (cmd == "favorite") system.favoriteSong(user, id);
+            else system.unfavoriteSong(user, id);
+            return ok();
+        }
+        if (cmd == "saved" || cmd == "favorites") {
+            SongSet& set = cmd == "saved" ? user->savedSongs : user->favoriteSongs;
+            return system.readUser(user, [&](const CatalogVersion&) {
+                return listSongs(SongPages(set.size(), [&set](size_t offset, size_t count) {
+                    vector<SongId> ids;
+                    for (size_t i = offset; i < offset + count; ++i) ids.push_back(set.at(i));
+                    return ids;
+                }), args, 1);
+            });
+        }
+        if (cmd == "follow") {
+            if (n != 3) return error("usage: follow OWNER NAME");
+            if (!system.sharePlaylistOf(args[1], args[2])) return error("playlist not found");
+            return system.followPlaylist(user, args[1], args[2]) ? ok() : error("already following");
+        }
+        if (cmd == "unfollow") {
+            long long index;
+            if (n != 2 || !number(args[1], index) || index < 0 || !system.unfollowPlaylist(user, (size_t)index))
+                return error("usage: unfollow INDEX");
+            return ok();
+        }
+        return error("unknown command " + cmd);
+    }
+
+    bool playlistCommand(const vector<string>& args) {
+        const string& cmd = args[0];
+        size_t n = args.size();
+        shared_ptr<Playlist> held = n >= 2 ? playlistArg(args[1]) : nullptr;
+        Playlist* playlist = held.get();
+        if (!playlist) return error(n >= 2 ? "playlist not found" : "usage: " + cmd + " NAME ...");
+        long long a = 0, b = 0;
+        if (cmd == "playlist") {
+            const Playlist& p = *playlist;
+            return system.readPlaylist(playlist, [&](const CatalogVersion&) {
+                return listSongs(SongPages(p.size(), [&p](size_t offset, size_t count) {
+                    vector<SongId> ids;
+                    for (size_t i = offset; i < offset + count; ++i) ids.push_back(p.songAt(i));
+                    return ids;
+                }), args, 2);
+            });
+        }
+        if (cmd == "playlist-add") {
+            SongId id;
+            if (n != 3 || !songArg(args[2], id)) return error("usage: playlist-add NAME ID");
+            return ok(system.addSongToPlaylist(user, playlist, id));
+        }
+        if (cmd == "playlist-remove") {
+            if (n != 3 || !number(args[2], a) || a < 0 || !system.removePlaylistEntry(user, playlist, (size_t)a))
+                return error("usage: playlist-remove NAME POSITION");
+            return ok();
+        }
+        if (cmd == "playlist-move") {
+            if (n != 4 || !number(args[2], a) || !number(args[3], b) || a < 0 || b < 0
+                || !system.movePlaylistEntry(user, playlist, (size_t)a, (size_t)b))
+                return error("usage: playlist-move NAME FROM TO");
+            return ok();
+        }
+        if (cmd == "play") {
+            PlaybackMode mode = SEQUENTIAL;
+            if (n == 3 && args[2] == "shuffle") mode = SHUFFLE;
+            else if (n == 3 && args[2] == "repeat") mode = REPEAT;
+            else if (n == 3 && args[2] == "autoplay") mode = AUTOPLAY;
+            else if (n == 3 && args[2] != "sequential") return error("unknown playback mode");
+            system.setPlaybackMode(playlist, mode);
+        }
+        else if (cmd != "next" && cmd != "prev" && cmd != "current") {
+            return error("unknown command " + cmd);
+        }
+        size_t position = 0;
+        SongId song = system.playbackStep(playlist, cmd == "next" ? 1 : cmd == "prev" ? -1 : 0, &position);
+        if (song == NO_SONG) return error("playlist is empty");
+        out << "ok\t1\n" << position << '\t';
+        system.read([&](const CatalogVersion& c) { songRow(c, song); });
+        return true;
+    }
+};
+
+// Runs commands from in until quit or end of input. Input is read in large
+// blocks and split into lines here; each block's responses are written in
+// one go once its journal records are durable.
+bool runCommands(MusicSystem& system, istream& in, ostream& os) {
+    // Responses collect here, however long, until their block is durable.
+    ostringstream sink;
+    OutputBuffer out(sink);
+    CommandSession session(system, out);
+    system.deferSync = true;
+    vector<char> buffer(1 << 20);
+    string carry;
+    bool running = true;
+    while (running && in) {
+        in.read(buffer.data(), (streamsize)buffer.size());
+        size_t got = (size_t)in.gcount();
+        bool eof = got < buffer.size();
+        string_view block(buffer.data(), got);
+        size_t start = 0;
+        while (running) {
+            size_t newline = block.find('\n', start);
+            string_view line;
+            if (newline == string_view::npos) {
+                carry.append(block.substr(start));
+                if (!eof || carry.empty()) break;
+                line = carry;
+            }
+            else if (!carry.empty()) {
+                carry.append(block.substr(start, newline - start));
+                line = carry;
+            }
+            else {
+                line = block.substr(start, newline - start);
+            }
+            running = session.executeLine(line);
+            if (newline == string_view::npos) {
+                carry.clear();
+                break;
+            }
+            carry.clear();
+            start = newline + 1;
+        }
+        if (!system.sync()) {
+            out << "err\tjournal write failed\n";
+            session.failed = true;
+        }
+        out.flush();
+        os << sink.str();
+        sink.str("");
+        os.flush();
+    }
+    system.deferSync = false;
+    return !session.failed;
+}
+
+// Fixed threads running posted tasks in order of arrival. Tasks still
+// queued when the pool is destroyed run before the threads exit.
+class TaskPool {
+public:
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake;
+    deque<function<void()>> tasks;
+    bool stopping;
+
+    TaskPool(size_t n) : stopping(false) {
+        for (size_t t = 0; t < max<size_t>(n, 1); ++t) threads.push_back(thread(&TaskPool::run, this));
+    }
+
+    ~TaskPool() {
+        join();
+    }
+
+    // Runs the tasks already posted, then stops the threads.
+    void join() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads)
+            if (t.joinable()) t.join();
+    }
+
+    void post(function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(move(task));
+        }
+        wake.notify_one();
+    }
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+#ifdef __linux__
+// Socket address from the command line: anything containing a '/' is a
+// Unix socket path, otherwise [HOST:]PORT over TCP on 127.0.0.1 by default.
+class Endpoint {
+public:
+    string text;
+    sockaddr_storage address;
+    socklen_t length;
+    bool unixSocket;
+
+    bool parse(const string& spec, string& error) {
+        text = spec;
+        memset(&address, 0, sizeof(address));
+        unixSocket = spec.find('/') != string::npos;
+        if (unixSocket) {
+            sockaddr_un* un = (sockaddr_un*)&address;
+            if (spec.size() >= sizeof(un->sun_path)) {
+                error = "socket path too long: " + spec;
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            memcpy(un->sun_path, spec.c_str(), spec.size() + 1);
+            length = sizeof(sockaddr_un);
+            return true;
+        }
+        size_t colon = spec.rfind(':');
+        string host = colon == string::npos || colon == 0 ? "127.0.0.1" : spec.substr(0, colon);
+        long long port;
+        sockaddr_in* in = (sockaddr_in*)&address;
+        in->sin_family = AF_INET;
+        if (!CommandSession::number(spec.substr(colon + 1), port) || port <= 0 || port > 65535
+            || inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+            error = "bad address " + spec + " (expected PATH or [HOST:]PORT)";
+            return false;
+        }
+        in->sin_port = htons((uint16_t)port);
+        length = sizeof(sockaddr_in);
+        return true;
+    }
+
+    // A non-blocking listening or connected socket, or -1 with error set.
+    // A stale Unix socket left by an earlier server is replaced.
+    int open(bool listening, string& error) const {
+        int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            error = string("socket: ") + strerror(errno);
+            return -1;
+        }
+        int one = 1;
+        bool ok;
+        if (listening) {
+            struct stat st;
+            if (unixSocket && stat(text.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(text.c_str());
+            if (!unixSocket) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = ::bind(fd, (const sockaddr*)&address, length) == 0 && listen(fd, SOMAXCONN) == 0;
+        }
+        else {
+            ok = connect(fd, (const sockaddr*)&address, length) == 0;
+        }
+        if (!ok) {
+            error = string(listening ? "cannot listen on " : "cannot connect to ") + text + ": " + strerror(errno);
+            ::close(fd);
+            return -1;
+        }
+        if (!unixSocket && !listening) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return fd;
+    }
+};
+
+// Thousands of connections need more descriptors than the usual soft limit.
+inline void raiseDescriptorLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Serves the command-mode protocol to many clients at once. One thread runs
+// an epoll loop and owns every socket; a TaskPool runs the commands. Each
+// connection has at most one batch in flight: every complete line received
+// so far goes to a worker together, and its responses come back as one
+// write, so pipelined requests are answered in order and in bulk. Journal
+// records of a batch are durable before its responses are sent.
+class CommandServer {
+public:
+    static const size_t MAX_BATCH = 1 << 18;
+    static const size_t MAX_BACKLOG = 1 << 20;
+    static const uint64_t LISTENER = 0;
+    static const uint64_t WAKEUP = 1;
+
+    struct Connection {
+        int fd;
+        uint32_t events;
+        string input;
+        string output;
+        size_t sent;
+        ostringstream sink;
+        OutputBuffer buffer;
+        CommandSession session;
+        bool busy;
+        bool closing;
+        bool broken;
+
+        Connection(int f, MusicSystem& system)
+            : fd(f), events(EPOLLIN), sent(0), buffer(sink), session(system, buffer),
+            busy(false), closing(false), broken(false) {}
+    };
+
+    struct Completion {
+        Connection* connection;
+        string response;
+        size_t commands;
+        bool quit;
+    };
+
+    static volatile sig_atomic_t stopRequested;
+    static int signalWakeup;
+
+    MusicSystem& system;
+    TaskPool workers;
+    int listener;
+    int poller;
+    int wakeup;
+    bool acceptPaused;
+    unordered_map<Connection*, unique_ptr<Connection>> connections;
+    vector<Connection*> closed;
+    mutex doneLock;
+    vector<Completion> done;
+    size_t inFlight;
+    uint64_t accepted;
+    uint64_t commands;
+    uint64_t batches;
+
+    CommandServer(MusicSystem& s, size_t threads)
+        : system(s), workers(threads), listener(-1), poller(-1), wakeup(-1), acceptPaused(false),
+        inFlight(0), accepted(0), commands(0), batches(0) {}
+
+    // Batches still queued or running use connections, done and wakeup,
+    // so the pool is drained before any of them goes away.
+    ~CommandServer() {
+        workers.join();
+        for (auto& kv : connections)
+            if (kv.second->fd >= 0) ::close(kv.second->fd);
+        if (listener >= 0) ::close(listener);
+        if (poller >= 0) ::close(poller);
+        if (wakeup >= 0) ::close(wakeup);
+    }
+
+    static void onSignal(int) {
+        uint64_t one = 1;
+        stopRequested = 1;
+        if (write(signalWakeup, &one, sizeof(one)) < 0) {}
+    }
+
+    // Serves until SIGINT or SIGTERM, then finishes the batches in flight.
+    bool run(const Endpoint& endpoint, string& error) {
+        bool failed = false;
+        raiseDescriptorLimit();
+        listener = endpoint.open(true, error);
+        if (listener < 0) return false;
+        poller = epoll_create1(EPOLL_CLOEXEC);
+        wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (poller < 0 || wakeup < 0) {
+            error = string("epoll: ") + strerror(errno);
+            return false;
+        }
+        watch(EPOLL_CTL_ADD, listener, EPOLLIN, LISTENER);
+        watch(EPOLL_CTL_ADD, wakeup, EPOLLIN, WAKEUP);
+        signalWakeup = wakeup;
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        vector<epoll_event> events(1024);
+        while (!stopRequested && !failed) {
+            int n = epoll_wait(poller, events.data(), (int)events.size(), -1);
+            if (n < 0 && errno != EINTR) {
+                error = string("epoll_wait: ") + strerror(errno);
+                failed = true;
+            }
+            for (int i = 0; i < n; ++i) {
+                uint64_t token = events[i].data.u64;
+                if (token == LISTENER) {
+                    acceptAll();
+                    continue;
+                }
+                if (token == WAKEUP) {
+                    finishBatches();
+                    continue;
+                }
+                Connection* c = (Connection*)(uintptr_t)token;
+                if (c->fd < 0) continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) c->broken = true;
+                else {
+                    if (events[i].events & EPOLLIN) readFrom(c);
+                    if (events[i].events & EPOLLOUT) writeTo(c);
+                }
+                settle(c);
+            }
+            bury();
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        while (inFlight > 0) {
+            int n = epoll_wait(poller, events.data(), (int)events.size(), 100);
+            if (n < 0 && errno != EINTR) break;
+            finishBatches();
+        }
+        bury();
+        return !failed;
+    }
+
+    void watch(int op, int fd, uint32_t events, uint64_t token) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u64 = token;
+        epoll_ctl(poller, op, fd, &event);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EMFILE || errno == ENFILE) {
+                    // Out of descriptors: wait for a connection to close.
+                    cerr << "Server: " << strerror(errno) << ", pausing accepts\n";
+                    watch(EPOLL_CTL_MOD, listener, 0, LISTENER);
+                    acceptPaused = true;
+                }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            unique_ptr<Connection> c(new Connection(fd, system));
+            watch(EPOLL_CTL_ADD, fd, EPOLLIN, (uint64_t)(uintptr_t)c.get());
+            connections[c.get()] = move(c);
+            ++accepted;
+        }
+    }
+
+    void readFrom(Connection* c) {
+        char buffer[1 << 16];
+        while (c->input.size() < MAX_BACKLOG) {
+            ssize_t got = recv(c->fd, buffer, sizeof(buffer), 0);
+            if (got > 0) {
+                c->input.append(buffer, (size_t)got);
+                continue;
+            }
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (got == 0) c->closing = true;
+            else c->broken = true;
+            return;
+        }
+    }
+
+    void writeTo(Connection* c) {
+        while (c->sent < c->output.size()) {
+            ssize_t put = send(c->fd, c->output.data() + c->sent, c->output.size() - c->sent, MSG_NOSIGNAL);
+            if (put > 0) {
+                c->sent += (size_t)put;
+                continue;
+            }
+            if (put < 0 && errno == EINTR) continue;
+            if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            c->broken = true;
+            return;
+        }
+        c->output.clear();
+        c->sent = 0;
+    }
+
+    // Hands the complete lines of c's input to a worker. Once the peer has
+    // stopped sending, a last unterminated line counts too.
+    void dispatch(Connection* c) {
+        size_t cut = c->input.size();
+        if (!c->closing) {
+            size_t end = c->input.rfind('\n', MAX_BATCH);
+            if (end == string::npos) end = c->input.find('\n');
+            if (end == string::npos) return;
+            cut = end + 1;
+        }
+        if (cut == 0) return;
+        string batch = c->input.substr(0, cut);
+        c->input.erase(0, cut);
+        c->busy = true;
+        ++inFlight;
+        ++batches;
+        workers.post([this, c, batch = move(batch)] { execute(c, batch); });
+    }
+
+    // Runs on a worker thread.
+    void execute(Connection* c, const string& batch) {
+        MusicSystem::deferSync = true;
+        Completion result = { c, string(), 0, false };
+        string_view text(batch);
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t newline = text.find('\n', start);
+            if (newline == string_view::npos) newline = text.size();
+            ++result.commands;
+            if (!c->session.executeLine(text.substr(start, newline - start))) {
+                result.quit = true;
+                break;
+            }
+            start = newline + 1;
+        }
+        if (!system.sync()) c->buffer << "err\tjournal write failed\n";
+        c->buffer.flush();
+        result.response = c->sink.str();
+        c->sink.str("");
+        {
+            lock_guard<mutex> guard(doneLock);
+            done.push_back(move(result));
+        }
+        uint64_t one = 1;
+        if (write(wakeup, &one, sizeof(one)) < 0) {}
+    }
+
+    void finishBatches() {
+        uint64_t count;
+        if (read(wakeup, &count, sizeof(count)) < 0) {}
+        vector<Completion> finished;
+        {
+            lock_guard<mutex> guard(doneLock);
+            finished.swap(done);
+        }
+        for (auto& f : finished) {
+            Connection* c = f.connection;
+            c->busy = false;
+            --inFlight;
+            commands += f.commands;
+            if (f.quit) {
+                c->closing = true;
+                c->input.clear();
+            }
+            if (!c->broken) {
+                c->output += f.response;
+                writeTo(c);
+            }
+            settle(c);
+        }
+    }
+
+    // Starts c's next batch, updates the events it waits for, and closes it
+    // once nothing is left to run or send.
+    void settle(Connection* c) {
+        if (c->fd < 0) return;
+        if (c->broken) {
+            if (!c->busy) close(c);
+            return;
+        }
+        if (!c->busy && c->output.size() - c->sent < MAX_BACKLOG) dispatch(c);
+        if (c->closing && !c->busy && c->input.empty() && c->sent == c->output.size()) {
+            close(c);
+            return;
+        }
+        uint32_t want = 0;
+        if (!c->closing && c->input.size() < MAX_BACKLOG) want |= EPOLLIN;
+        if (c->sent < c->output.size()) want |= EPOLLOUT;
+        if (want != c->events) {
+            watch(EPOLL_CTL_MOD, c->fd, want, (uint64_t)(uintptr_t)c);
+            c->events = want;
+        }
+    }
+
+    // Connections are freed by bury() after the current round of events,
+    // which may still mention them.
+    void close(Connection* c) {
+        ::close(c->fd);
+        c->fd = -1;
+        closed.push_back(c);
+        if (acceptPaused) {
+            watch(EPOLL_CTL_MOD, listener, EPOLLIN, LISTENER);
+            acceptPaused = false;
+        }
+    }
+
+    void bury() {
+        for (Connection* c : closed) connections.erase(c);
+        closed.clear();
+    }
+};
+
+volatile sig_atomic_t CommandServer::stopRequested = 0;
+int CommandServer::signalWakeup = -1;
+
+bool runServer(MusicSystem& system, const string& address, size_t threads) {
+    Endpoint endpoint;
+    string error;
+    if (!endpoint.parse(address, error)) {
+        cerr << "Server: " << error << '\n';
+        return false;
+    }
+    CommandServer server(system, threads);
+    cerr << "Listening on " << address << " with " << server.workers.threads.size() << " workers\n";
+    if (!server.run(endpoint, error)) {
+        cerr << "Server: " << error << '\n';
+        return false;
+    }
+    cerr << "Served " << server.commands << " commands in " << server.batches << " batches over "
+        << server.accepted << " connections\n";
+    return true;
+}
+
+// Load generator for --serve: each connection keeps pipeline requests in
+// flight for the given time, and the tool reports throughput and latency
+// percentiles. Requests are catalog reads; with writePercent set, that
+// share becomes save/unsave by a user registered per connection.
+int runLoadGenerator(const string& address, size_t clientCount, double seconds, size_t pipeline, unsigned writePercent) {
+    static const char* words[] = { "love", "night", "heart", "summer", "fire", "dream", "road", "blue" };
+    static const char* genres[] = { "Pop", "Rock", "Jazz", "Hip Hop", "Classical", "Electronic" };
+    struct Request {
+        chrono::steady_clock::time_point sent;
+        bool list;
+        bool measured;
+    };
+    struct Client {
+        int fd;
+        string input;
+        string output;
+        size_t sent;
+        deque<Request> inflight;
+        size_t rowsLeft;
+        bool waitingOut;
+    };
+    Endpoint endpoint;
+    string error;
+    if (!endpoint.parse(address, error)) {
+        cerr << "Load generator: " << error << '\n';
+        return 1;
+    }
+    raiseDescriptorLimit();
+    pipeline = max<size_t>(pipeline, 1);
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    vector<Client> clients(clientCount);
+    for (size_t i = 0; i < clients.size(); ++i) {
+        Client& c = clients[i];
+        c.fd = endpoint.open(false, error);
+        c.sent = c.rowsLeft = 0;
+        c.waitingOut = false;
+        if (c.fd < 0) {
+            cerr << "Load generator: " << error << " (connection " << i << ")\n";
+            for (size_t k = 0; k < i; ++k) ::close(clients[k].fd);
+            ::close(poller);
+            return 1;
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(poller, EPOLL_CTL_ADD, c.fd, &event);
+        if (writePercent > 0) {
+            string name = "load" + to_string(i);
+            c.output += "register\t" + name + "\tpw\nlogin\t" + name + "\tpw\n";
+            c.inflight.push_back({ chrono::steady_clock::now(), false, false });
+            c.inflight.push_back({ chrono::steady_clock::now(), false, false });
+        }
+    }
+    mt19937_64 rng(7);
+    vector<uint64_t> buckets(LatencyBuckets::COUNT, 0);
+    MetricSummary summary;
+    uint64_t errors = 0;
+    size_t broken = 0;
+    auto started = chrono::steady_clock::now();
+    auto deadline = started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    auto giveUp = deadline + chrono::seconds(10);
+    auto lastResponse = started;
+
+    auto request = [&](Client& c) {
+        unsigned pick = (unsigned)(rng() % 100);
+        bool list = true;
+        string id = to_string(rng() % 1000);
+        if (pick < writePercent) {
+            c.output += (rng() % 2 ? "save\t" : "unsave\t") + id + '\n';
+            list = false;
+        }
+        else {
+            // Read mix: 40% song, 25% sorted page, 20% genre page, 10% find, 5% ranked search.
+            pick = (unsigned)(rng() % 100);
+            if (pick < 40) c.output += "song\t" + id + '\n';
+            else if (pick < 65) c.output += "sorted\tname\t" + id + "\t10\n";
+            else if (pick < 85) c.output += string("filter-genre\t") + genres[rng() % 6] + "\t0\t10\n";
+            else if (pick < 95) c.output += string("find\t") + words[rng() % 8] + "\t0\t10\n";
+            else c.output += string("search\t") + words[rng() % 8] + "\t10\n";
+        }
+        c.inflight.push_back({ chrono::steady_clock::now(), list, true });
+    };
+    auto flush = [&](size_t i) {
+        Client& c = clients[i];
+        if (c.fd < 0) return;
+        while (c.sent < c.output.size()) {
+            ssize_t put = send(c.fd, c.output.data() + c.sent, c.output.size() - c.sent, MSG_NOSIGNAL);
+            if (put > 0) {
+                c.sent += (size_t)put;
+                continue;
+            }
+            if (put < 0 && errno == EINTR) continue;
+            if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            ::close(c.fd);
+            c.fd = -1;
+            ++broken;
+            return;
+        }
+        if (c.sent == c.output.size()) {
+            c.output.clear();
+            c.sent = 0;
+        }
+        bool wantOut = c.sent < c.output.size();
+        if (wantOut != c.waitingOut) {
+            epoll_event event = {};
+            event.events = EPOLLIN | (wantOut ? (uint32_t)EPOLLOUT : 0u);
+            event.data.u64 = i;
+            epoll_ctl(poller, EPOLL_CTL_MOD, c.fd, &event);
+            c.waitingOut = wantOut;
+        }
+    };
+    // Consumes whole responses: a list answer is "ok\tN" and N rows,
+    // anything else is one line.
+    auto consume = [&](Client& c) {
+        size_t start = 0;
+        while (!c.inflight.empty()) {
+            size_t newline = c.input.find('\n', start);
+            if (newline == string::npos) break;
+            string_view line(c.input.data() + start, newline - start);
+            start = newline + 1;
+            if (c.rowsLeft > 0) {
+                if (--c.rowsLeft > 0) continue;
+            }
+            else if (c.inflight.front().list && line.compare(0, 3, "ok\t") == 0) {
+                c.rowsLeft = (size_t)strtoull(string(line.substr(3)).c_str(), nullptr, 10);
+                if (c.rowsLeft > 0) continue;
+            }
+            else if (line.compare(0, 3, "err") == 0 && c.inflight.front().measured) {
+                ++errors;
+            }
+            auto now = chrono::steady_clock::now();
+            const Request& r = c.inflight.front();
+            if (r.measured && r.sent < deadline) {
+                uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(now - r.sent).count();
+                ++buckets[LatencyBuckets::of(ns)];
+                ++summary.count;
+                summary.totalNs += ns;
+                summary.maxNs = max(summary.maxNs, ns);
+                lastResponse = now;
+            }
+            c.inflight.pop_front();
+        }
+        c.input.erase(0, start);
+    };
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+        while (clients[i].inflight.size() < pipeline) request(clients[i]);
+        flush(i);
+    }
+    vector<epoll_event> events(1024);
+    char buffer[1 << 16];
+    while (true) {
+        auto now = chrono::steady_clock::now();
+        bool sending = now < deadline;
+        size_t pending = 0;
+        for (const Client& c : clients) pending += c.fd >= 0 ? c.inflight.size() : 0;
+        if ((!sending && pending == 0) || now >= giveUp) break;
+        int n = epoll_wait(poller, events.data(), (int)events.size(), 100);
+        for (int e = 0; e < n; ++e) {
+            size_t i = (size_t)events[e].data.u64;
+            Client& c = clients[i];
+            if (c.fd < 0) continue;
+            if (events[e].events & EPOLLOUT) flush(i);
+            if (!(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+            bool closedByPeer = false;
+            while (true) {
+                ssize_t got = recv(c.fd, buffer, sizeof(buffer), 0);
+                if (got > 0) {
+                    c.input.append(buffer, (size_t)got);
+                    continue;
+                }
+                if (got < 0 && errno == EINTR) continue;
+                closedByPeer = got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            consume(c);
+            if (closedByPeer) {
+                ::close(c.fd);
+                c.fd = -1;
+                ++broken;
+                continue;
+            }
+            if (chrono::steady_clock::now() < deadline)
+                while (c.inflight.size() < pipeline) request(c);
+            flush(i);
+        }
+    }
+    for (Client& c : clients)
+        if (c.fd >= 0) ::close(c.fd);
+    ::close(poller);
+
+    double elapsed = chrono::duration<double>(max(lastResponse, min(deadline, chrono::steady_clock::now())) - started).count();
+    summary.quantilesFrom(buckets);
+    cout << clientCount << " connections, pipeline " << pipeline << ", " << writePercent << "% writes: "
+        << summary.count << " requests in " << fixed << setprecision(2) << elapsed << " s, "
+        << setprecision(0) << summary.count / max(elapsed, 1e-9) << " requests/s, " << errors << " errors";
+    if (broken) cout << ", " << broken << " connections lost";
+    cout << "\nlatency us: mean " << setprecision(1) << summary.meanNs() / 1000 << "  p50 " << summary.p50 / 1000.0
+        << "  p90 " << summary.p90 / 1000.0 << "  p99 " << summary.p99 / 1000.0 << "  p99.9 " << summary.p999 / 1000.0
+        << "  max " << summary.maxNs / 1000.0 << '\n';
+    return broken ? 1 : 0;
+}
+#else
+bool runServer(MusicSystem&, const string&, size_t) {
+    cerr << "Server mode needs Linux (epoll).\n";
+    return false;
+}
+
+int runLoadGenerator(const string&, size_t, double, size_t, unsigned) {
+    cerr << "The load generator needs Linux (epoll).\n";
+    return 1;
+}
+#endif
+
+// Deterministic made-up songs for the report and benchmark tools: about
+// twenty songs per artist, years 1950-2024, twelve genres.
+class SyntheticSongs {
+public:
+    size_t count;
+    size_t artistCount;
+    uint64_t state;
+
+    SyntheticSongs(size_t n) : count(0), artistCount(n / 20 + 1), state(1) {}
+
+    Song next() {
+        static const char* words[] = { "Love", "Night", "Heart", "Summer", "Fire", "Dream", "Road", "Blue" };
+        static const char* genreNames[] = { "Pop", "Rock", "Jazz", "Hip Hop", "Classical", "Electronic",
+            "Country", "Folk", "Metal", "Blues", "Reggae", "Soul" };
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t r = state;
+        return Song(string(words[r % 8]) + ' ' + words[(r >> 3) % 8] + ' ' + to_string(count++),
+            "Artist " + to_string((r >> 8) % artistCount), 1950 + (int)((r >> 40) % 75), genreNames[(r >> 48) % 12]);
+    }
+};
+
+// Builds a synthetic catalog of n songs and compares the columnar layout
+// with the earlier vector<Song> plus string-keyed map, estimated song by
+// song from the same data.
+int runLayoutReport(size_t n) {
+    SongCatalog catalog;
+    SyntheticSongs generator(n);
+    size_t oldBytes = n * sizeof(Song);
+    for (size_t i = 0; i < n; ++i) {
+        Song song = generator.next();
+        oldBytes += songFootprint(song) - sizeof(Song);
+        oldBytes += stringFootprint(song.name + '\x1f' + song.artistName) + sizeof(SongId) + 3 * sizeof(void*);
+        catalog.intern(song);
+    }
+    size_t newBytes = catalog.memoryUsage();
+    auto started = chrono::steady_clock::now();
+    size_t hits = catalog.scanYears(1990, 1999).size();
+    double columnSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    size_t viewHits = 0;
+    for (SongId id = 0; id < (SongId)catalog.size(); ++id) {
+        int year = catalog[id].releaseYear;
+        viewHits += year >= 1990 && year <= 1999;
+    }
+    double viewSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << n << " songs, " << catalog.artists.values.size() << " artists, " << catalog.genres.values.size() << " genres\n"
+        << "vector<Song> + string keys: " << oldBytes << " bytes (" << oldBytes / max<size_t>(n, 1) << " per song)\n"
+        << "columnar catalog:           " << newBytes << " bytes (" << newBytes / max<size_t>(n, 1) << " per song)\n"
+        << "1990s scan: " << hits << " songs, column " << columnSeconds * 1000 << " ms, views "
+        << viewSeconds * 1000 << " ms (" << viewHits << ")\n";
+    return 0;
+}
+
+// Times a full keyword scan over a synthetic catalog of n songs: the old
+// lowercase-copy-and-find loop, every substring kernel this CPU runs applied
+// song by song, and the column scan searchSongs uses. Then times the sharded
+// scans from one thread up to one per core.
+int runSearchBench(size_t n) {
+    MusicSystem system;
+    SyntheticSongs generator(n);
+    vector<Song> batch;
+    for (size_t i = 0; i < n; ++i) batch.push_back(generator.next());
+    system.addSongs(batch);
+    batch.clear();
+    // Nothing else runs, so the catalog can be read without a read section.
+    const SongCatalog& songs = system.catalog().songs;
+    vector<FoldedSearchKernel> kernels = foldedSearchKernels();
+    const char* keywords[] = { "e", "rO", "ART", "Love", "ist 12", "NIGHT he", "heart Summer", "summer dream 123" };
+    cout << n << " songs, kernel in use: " << kernels.back().name << "\n"
+        << "keyword             hits   transform+find";
+    for (const auto& kernel : kernels) cout << setw(10) << kernel.name;
+    cout << "    column   (ms)\n";
+    for (const char* keyword : keywords) {
+        auto started = chrono::steady_clock::now();
+        size_t hits = system.searchSongsLinear(keyword).size();
+        double baseline = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << left << setw(18) << ('"' + string(keyword) + '"') << right << setw(8) << hits
+            << setw(17) << fixed << setprecision(1) << baseline * 1000;
+        string folded = foldString(keyword);
+        for (const auto& kernel : kernels) {
+            started = chrono::steady_clock::now();
+            size_t kernelHits = 0;
+            for (SongId id = 0; id < (SongId)songs.size(); ++id) {
+                SongView s = songs[id];
+                const char* nameEnd = s.name.data() + s.name.size();
+                const char* artistEnd = s.artistName.data() + s.artistName.size();
+                kernelHits += kernel.find(s.name.data(), nameEnd, folded) != nameEnd
+                    || kernel.find(s.artistName.data(), artistEnd, folded) != artistEnd;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            cout << setw(10) << seconds * 1000;
+            if (kernelHits != hits) cout << " (" << kernelHits << " hits!)";
+        }
+        started = chrono::steady_clock::now();
+        size_t columnHits = songs.scanText(folded, true, true).size();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << setw(10) << seconds * 1000;
+        if (columnHits != hits) cout << " (" << columnHits << " hits!)";
+        cout << '\n';
+    }
+    size_t cores = max(1u, thread::hardware_concurrency());
+    cout << "\nthreads  \"love\" scan  1990s scan   (ms, " << cores << " cores)\n";
+    for (size_t threads = 1;; threads = min(threads * 2, cores)) {
+        WorkerPool pool(threads);
+        system.updateCatalog([&](CatalogVersion& c) { c.songs.workers = &pool; });
+        auto started = chrono::steady_clock::now();
+        system.catalog().songs.scanText("love", true, true);
+        double textSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        started = chrono::steady_clock::now();
+        system.catalog().songs.scanYears(1990, 1999);
+        double yearSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << setw(7) << threads << setw(13) << textSeconds * 1000 << setw(12) << yearSeconds * 1000 << '\n';
+        system.updateCatalog([](CatalogVersion& c) { c.songs.workers = nullptr; });
+        if (threads == cores) break;
+    }
+    return 0;
+}
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s.
+class ZipfSampler {
+public:
+    vector<double> cumulative;
+
+    ZipfSampler(size_t n, double s = 1.0) : cumulative(max<size_t>(n, 1)) {
+        double total = 0;
+        for (size_t i = 0; i < cumulative.size(); ++i) cumulative[i] = total += 1.0 / pow((double)(i + 1), s);
+        for (auto& c : cumulative) c /= total;
+    }
+
+    size_t operator()(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return min<size_t>(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin(), cumulative.size() - 1);
+    }
+};
+
+// Latencies of one benchmarked operation.
+struct BenchResult {
+    string op;
+    size_t ops;
+    double seconds;
+    double p50;
+    double p99;
+    double max;
+};
+
+// Times fn() until maxOps calls or budget seconds, whichever comes first.
+template <class Fn>
+BenchResult timeOperation(const string& op, size_t maxOps, double budget, Fn fn) {
+    vector<double> latencies;
+    auto started = chrono::steady_clock::now();
+    double elapsed = 0;
+    while (latencies.size() < maxOps && elapsed < budget) {
+        auto before = chrono::steady_clock::now();
+        fn();
+        auto after = chrono::steady_clock::now();
+        latencies.push_back(chrono::duration<double>(after - before).count());
+        elapsed = chrono::duration<double>(after - started).count();
+    }
+    BenchResult result = { op, latencies.size(), 0, 0, 0, 0 };
+    for (double l : latencies) result.seconds += l;
+    sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        result.p50 = latencies[latencies.size() / 2];
+        result.p99 = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+        result.max = latencies.back();
+    }
+    return result;
+}
+
+// Benchmark workload: songs with Zipf-distributed artists, genres and
+// title words, users with a few saved songs, and playlists whose lengths
+// follow a long tail and whose songs follow Zipf popularity. Times the
+// catalog, user and playlist operations and writes throughput and
+// p50/p99 latency as JSON to outPath.
+int runBenchmark(MusicSystem& system, size_t songCount, size_t userCount, size_t playlistCount,
+    const string& outPath, size_t maxOps) {
+    static const char* words[] = { "Love", "Night", "Heart", "Summer", "Fire", "Dream", "Road", "Blue",
+        "Baby", "Time", "World", "Light", "Rain", "Home", "Girl", "Star", "Sky", "Dance", "Gold", "River",
+        "Moon", "Wild", "Angel", "Shadow", "Ocean", "City", "Forever", "Midnight", "Electric", "Paradise", "Sugar", "Thunder" };
+    static const char* genreNames[] = { "Pop", "Rock", "Hip Hop", "Electronic", "Country", "Jazz",
+        "Classical", "Folk", "Metal", "Blues", "Reggae", "Soul" };
+    const size_t wordCount = sizeof(words) / sizeof(words[0]);
+    mt19937_64 rng(42);
+    auto started = chrono::steady_clock::now();
+    ZipfSampler artistRank(songCount / 20 + 1), genreRank(12), wordRank(wordCount), songRank(songCount), lengthRank(10000, 1.5);
+    vector<Song> batch;
+    for (size_t i = 0; i < songCount; ++i) {
+        string name = string(words[wordRank(rng)]) + ' ' + words[wordRank(rng)];
+        if (rng() % 3 == 0) name += string(" ") + words[wordRank(rng)];
+        batch.push_back(Song(name + " #" + to_string(i), "Artist " + to_string(artistRank(rng)),
+            1950 + (int)(rng() % 75), genreNames[genreRank(rng)]));
+        if (batch.size() == (1 << 20) || i + 1 == songCount) {
+            system.addSongs(batch);
+            batch.clear();
+        }
+    }
+    vector<User*> userList;
+    for (size_t i = 0; i < userCount; ++i) {
+        User user("user" + to_string(i), "pw");
+        for (size_t k = rng() % 8; k > 0; --k) user.addToSavedSongs((SongId)songRank(rng));
+        userList.push_back(system.users.add(move(user)));
+    }
+    vector<Playlist*> lists;
+    size_t entries = 0;
+    for (size_t i = 0; i < playlistCount; ++i) {
+        Playlist* playlist = system.playlists.add(Playlist("playlist" + to_string(i)));
+        for (size_t k = lengthRank(rng) + 1; k > 0; --k) playlist->addSong((SongId)songRank(rng));
+        entries += playlist->size();
+        lists.push_back(playlist);
+    }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Built " << system.songCount() << " songs, " << system.users.size() << " users, " << lists.size()
+        << " playlists (" << entries << " entries) in " << buildSeconds << " s\n";
+
+    // Until the concurrent phase nothing else runs, so catalog() needs no
+    // read section.
+    auto popularSong = [&]() { return system.catalog().songs[(SongId)songRank(rng)]; };
+    auto keyword = [&]() {
+        SongView s = popularSong();
+        string_view text = rng() % 4 == 0 ? s.artistName : s.name;
+        size_t space = text.find(' ');
+        return string(rng() % 2 ? text.substr(0, space) : text);
+    };
+    vector<BenchResult> results;
+    const double budget = 5.0;
+    size_t sink = 0;
+    results.push_back(timeOperation("searchSongs", maxOps, budget, [&] { sink += system.searchSongs(keyword()).size(); }));
+    results.push_back(timeOperation("rankedSearch", maxOps, budget, [&] { sink += system.rankedSearch(keyword(), 20).size(); }));
+    // Filters return lazily paged lists; each timing includes fetching the first page.
+    results.push_back(timeOperation("filterSongsByArtist", maxOps, budget, [&] {
+        SongPages page = system.filterSongsByArtist(string(popularSong().artistName));
+        sink += page.fetch(0, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+    }));
+    results.push_back(timeOperation("filterSongsByYear", maxOps, budget, [&] {
+        SongPages page = system.filterSongsByYear(1950 + (int)(rng() % 75));
+        sink += page.fetch(0, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+    }));
+    results.push_back(timeOperation("filterSongsByYearRange", maxOps, budget, [&] {
+        int from = 1950 + (int)(rng() % 70);
+        SongPages page = system.filterSongsByYearRange(from, from + 4);
+        sink += page.fetch(0, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+    }));
+    results.push_back(timeOperation("filterSongsByGenre", maxOps, budget, [&] {
+        SongPages page = system.filterSongsByGenre(genreNames[genreRank(rng)]);
+        sink += page.fetch(0, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+    }));
+    results.push_back(timeOperation("sortSongsAlphabetically", maxOps, budget, [&] {
+        SongPages page = system.sortSongsAlphabetically();
+        size_t offset = page.total > PageCursor::PAGE_SIZE ? rng() % (page.total - PageCursor::PAGE_SIZE) : 0;
+        sink += page.fetch(offset, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+    }));
+    results.push_back(timeOperation("findUser", maxOps, budget, [&] {
+        sink += system.findUser("user" + to_string(rng() % max<size_t>(userCount, 1))) != nullptr;
+    }));
+    if (!lists.empty()) {
+        results.push_back(timeOperation("Playlist::removeSong", maxOps, budget, [&] {
+            Playlist* playlist = lists[rng() % lists.size()];
+            playlist->removeSong(playlist->songAt(rng() % playlist->size()));
+            if (playlist->size() == 0) playlist->addSong((SongId)songRank(rng));
+        }));
+    }
+    if (userCount > 0) {
+        results.push_back(timeOperation("User::addToSavedSongs", maxOps, budget, [&] {
+            userList[rng() % userCount]->addToSavedSongs((SongId)songRank(rng));
+        }));
+        // The loop above went around the charts; recount them first.
+        system.rebuildCharts();
+        results.push_back(timeOperation("MusicSystem::saveSong", maxOps, budget, [&] {
+            system.saveSong(userList[rng() % userCount], (SongId)songRank(rng));
+        }));
+        results.push_back(timeOperation("topSongs", maxOps, budget, [&] {
+            sink += system.topSongs(CHART_SAVED, rng() % 2 ? "" : genreNames[genreRank(rng)], false, 20).size();
+        }));
+        results.push_back(timeOperation("topSongs trending", maxOps, budget, [&] {
+            sink += system.topSongs(CHART_SAVED, rng() % 2 ? "" : genreNames[genreRank(rng)], true, 20).size();
+        }));
+        // A few favorites per user, popular songs mostly, give related
+        // overlapping baskets to count.
+        for (User* user : userList) {
+            vector<SongId> picks;
+            for (size_t k = rng() % 12 + 2; k > 0; --k) picks.push_back((SongId)songRank(rng));
+            system.favoriteSongs(user, picks);
+        }
+        results.push_back(timeOperation("MusicSystem::favoriteSong", maxOps, budget, [&] {
+            system.favoriteSong(userList[rng() % userCount], (SongId)songRank(rng));
+        }));
+        results.push_back(timeOperation("relatedSongs", maxOps, budget, [&] {
+            sink += system.relatedSongs((SongId)songRank(rng), 10).size();
+        }));
+        User* listener = userList[0];
+        system.addUserPlaylist(listener, "autoplay");
+        shared_ptr<Playlist> radio = system.sharePlaylist(listener, "autoplay");
+        system.addSongToPlaylist(listener, radio.get(), (SongId)songRank(rng));
+        system.setPlaybackMode(radio.get(), AUTOPLAY);
+        results.push_back(timeOperation("autoplay next", maxOps, budget, [&] {
+            sink += system.playbackStep(radio.get(), 1);
+        }));
+    }
+    if (!lists.empty()) {
+        Playlist* longest = *max_element(lists.begin(), lists.end(),
+            [](const Playlist* a, const Playlist* b) { return a->size() < b->size(); });
+        longest->setPlaybackMode(SHUFFLE);
+        results.push_back(timeOperation("shuffle nextSong", maxOps, budget, [&] {
+            longest->nextSong();
+            sink += longest->currentSong();
+        }));
+    }
+
+    // Mixed load from concurrent sessions: 95% reads (searches, filter and
+    // sorted pages, user lookups, song details) and 5% writes (saving songs,
+    // editing system playlists and, rarely, adding a song). Runs at least up
+    // to four threads so lock contention shows even on small machines.
+    struct LoadResult {
+        size_t threads;
+        size_t reads;
+        size_t writes;
+        double seconds;
+    };
+    vector<LoadResult> load;
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t maxThreads = max<size_t>(cores, 4);
+    for (size_t threads = 1;; threads = min(threads * 2, maxThreads)) {
+        atomic<bool> stop(false);
+        vector<size_t> reads(threads), writes(threads), sinks(threads);
+        vector<thread> sessions;
+        auto phaseStarted = chrono::steady_clock::now();
+        for (size_t t = 0; t < threads; ++t) sessions.push_back(thread([&, t] {
+            mt19937_64 local(1000 + t);
+            while (!stop.load(memory_order_relaxed)) {
+                SongId song = (SongId)songRank(local);
+                unsigned pick = local() % 100;
+                if (pick < 30) {
+                    string word = system.read([&](const CatalogVersion& c) {
+                        string_view name = c.songs[song].name;
+                        return string(name.substr(0, name.find(' ')));
+                    });
+                    sinks[t] += system.searchSongs(word).size();
+                }
+                else if (pick < 50) {
+                    SongPages page = system.filterSongsByGenre(genreNames[genreRank(local)]);
+                    sinks[t] += page.fetch(0, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+                }
+                else if (pick < 65) {
+                    SongPages page = system.sortSongsAlphabetically();
+                    size_t offset = page.total > PageCursor::PAGE_SIZE ? local() % (page.total - PageCursor::PAGE_SIZE) : 0;
+                    sinks[t] += page.fetch(offset, min<size_t>(page.total, PageCursor::PAGE_SIZE)).size();
+                }
+                else if (pick < 80) {
+                    User* user = system.findUser("user" + to_string(local() % max<size_t>(userCount, 1)));
+                    if (user) sinks[t] += system.readUser(user, [&](const CatalogVersion&) { return user->savedSongs.size(); });
+                }
+                else if (pick < 95) {
+                    sinks[t] += system.describeSong(song).size();
+                }
+                if (pick < 95) {
+                    ++reads[t];
+                    continue;
+                }
+                if (pick < 98 && userCount > 0) {
+                    system.saveSong(userList[local() % userCount], song);
+                }
+                else if (pick < 99 && !lists.empty()) {
+                    Playlist* playlist = lists[local() % lists.size()];
+                    system.addSongToPlaylist(nullptr, playlist, song);
+                    system.removePlaylistEntry(nullptr, playlist, 0);
+                }
+                else if (local() % 10 == 0) {
+                    system.addSong(Song("Load " + to_string(t) + '-' + to_string(writes[t]), "Artist " + to_string(t),
+                        2000 + (int)(local() % 25), genreNames[genreRank(local)]));
+                }
+                ++writes[t];
+            }
+        }));
+        this_thread::sleep_for(chrono::duration<double>(min(budget, 2.0)));
+        stop = true;
+        for (auto& session : sessions) session.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - phaseStarted).count();
+        LoadResult result = { threads, 0, 0, seconds };
+        for (size_t t = 0; t < threads; ++t) {
+            result.reads += reads[t];
+            result.writes += writes[t];
+            sink += sinks[t];
+        }
+        load.push_back(result);
+        if (threads == maxThreads) break;
+    }
+
+    ofstream json(outPath);
+    json << "{\"songs\": " << system.songCount() << ", \"users\": " << system.users.size()
+        << ", \"playlists\": " << lists.size() << ", \"playlist_entries\": " << entries
+        << ", \"threads\": " << (system.workers ? system.workers->threads : 1)
+        << ", \"metrics\": " << (Metrics::enabled ? "true" : "false")
+        << ", \"kernel\": \"" << foldedSearchKernels().back().name << "\", \"build_seconds\": " << buildSeconds
+        << ",\n \"results\": [\n";
+    cout << left << setw(26) << "operation" << right << setw(9) << "ops" << setw(14) << "ops/s"
+        << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "max us" << '\n';
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& b = results[i];
+        double rate = b.seconds > 0 ? b.ops / b.seconds : 0;
+        json << "  {\"op\": \"" << b.op << "\", \"ops\": " << b.ops << ", \"seconds\": " << b.seconds
+            << ", \"ops_per_sec\": " << rate << ", \"p50_us\": " << b.p50 * 1e6 << ", \"p99_us\": " << b.p99 * 1e6
+            << ", \"max_us\": " << b.max * 1e6 << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+        cout << left << setw(26) << b.op << right << setw(9) << b.ops << fixed << setprecision(0) << setw(14) << rate
+            << setprecision(1) << setw(12) << b.p50 * 1e6 << setw(12) << b.p99 * 1e6 << setw(12) << b.max * 1e6 << '\n';
+    }
+    json << " ],\n \"concurrency\": [\n";
+    cout << "\nmixed load (" << cores << " cores)\n" << setw(7) << "threads" << setw(14) << "reads/s" << setw(14) << "writes/s" << '\n';
+    for (size_t i = 0; i < load.size(); ++i) {
+        const LoadResult& l = load[i];
+        json << "  {\"threads\": " << l.threads << ", \"seconds\": " << l.seconds << ", \"reads_per_sec\": " << l.reads / l.seconds
+            << ", \"writes_per_sec\": " << l.writes / l.seconds << "}" << (i + 1 < load.size() ? ",\n" : "\n");
+        cout << setw(7) << l.threads << setprecision(0) << setw(14) << l.reads / l.seconds << setw(14) << l.writes / l.seconds << '\n';
+    }
+    json << " ]}\n";
+    json.close();
+    if (!json) {
+        cerr << "Cannot write " << outPath << '\n';
+        return 1;
+    }
+    cout << "Results written to " << outPath << " (checksum " << sink % 1000 << ")\n";
+    return 0;
+}
+
+int runSnapshotTool(const string& command, const string& from, const string& to) {
+    MusicSystem system;
+    string error;
+    bool ok = false;
+    if (command == "--export-text")
+        ok = system.openSnapshot(from, error) && exportText(system, to, error);
+    else if (command == "--import-text")
+        ok = importText(system, from, error) && writeSnapshot(system, to, error);
+    else if (command == "--verify-snapshot")
+        ok = system.openSnapshot(from, error);
+    if (!ok) {
+        cerr << command << ": " << error << '\n';
+        return 1;
+    }
+    cout << command << ": " << system.songCount() << " songs, " << system.users.size() << " users, "
+        << system.playlists.size() << " playlists\n";
+    return 0;
+}
+
+void adminMenu(MusicSystem& system);
+void userMenu(MusicSystem& system, User* user);
+
+int main(int argc, char* argv[]) {
+    MusicSystem system;
+    string importPath, commandPath, benchmarkPath, serveAddress, loadAddress;
+    size_t benchmarkSongs = 0, benchmarkUsers = 0, benchmarkPlaylists = 0, benchmarkOps = 2000;
+    size_t serverThreads = max(2u, thread::hardware_concurrency()), loadConnections = 0, loadPipeline = 1;
+    double loadSeconds = 0;
+    unsigned loadWrites = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if ((arg == "--export-text" || arg == "--import-text") && i + 2 < argc)
+            return runSnapshotTool(arg, argv[i + 1], argv[i + 2]);
+        if (arg == "--verify-snapshot" && i + 1 < argc)
+            return runSnapshotTool(arg, argv[i + 1], "");
+        if (arg == "--layout-report" && i + 1 < argc)
+            return runLayoutReport((size_t)strtoull(argv[i + 1], nullptr, 10));
+        if (arg == "--search-bench" && i + 1 < argc)
+            return runSearchBench((size_t)strtoull(argv[i + 1], nullptr, 10));
+        if (arg == "--snapshot" && i + 1 < argc)
+            system.snapshotPath = argv[++i];
+        else if (arg == "--import-songs" && i + 1 < argc)
+            importPath = argv[++i];
+        else if (arg == "--commands" && i + 1 < argc)
+            commandPath = argv[++i];
+        else if (arg == "--benchmark" && i + 4 < argc) {
+            benchmarkSongs = (size_t)strtoull(argv[++i], nullptr, 10);
+            benchmarkUsers = (size_t)strtoull(argv[++i], nullptr, 10);
+            benchmarkPlaylists = (size_t)strtoull(argv[++i], nullptr, 10);
+            benchmarkPath = argv[++i];
+        }
+        else if (arg == "--benchmark-ops" && i + 1 < argc)
+            benchmarkOps = (size_t)strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--serve" && i + 1 < argc)
+            serveAddress = argv[++i];
+        else if (arg == "--server-threads" && i + 1 < argc)
+            serverThreads = (size_t)strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--load-gen" && i + 4 < argc) {
+            loadAddress = argv[++i];
+            loadConnections = (size_t)strtoull(argv[++i], nullptr, 10);
+            loadSeconds = atof(argv[++i]);
+            loadPipeline = (size_t)strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--load-writes" && i + 1 < argc)
+            loadWrites = (unsigned)min(100ul, strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--threads" && i + 1 < argc)
+            system.workerThreads = (size_t)atol(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            srand((unsigned int)strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--parallel-threshold" && i + 1 < argc)
+            system.setParallelThreshold((size_t)strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--trending-half-life" && i + 1 < argc)
+            system.charts.setHalfLife(max(1.0, atof(argv[++i])));
+        else {
+            cerr << "Usage: " << argv[0] << " [--snapshot FILE] [--threads N] [--parallel-threshold SONGS] [--seed N] [--trending-half-life SECONDS]"
+                << " [--import-songs CSV] [--commands FILE|-]"
+                << " | --export-text SNAPSHOT TEXT | --import-text TEXT SNAPSHOT | --verify-snapshot SNAPSHOT | --layout-report SONGS"
+                << " | --search-bench SONGS | [--threads N] [--benchmark-ops N] --benchmark SONGS USERS PLAYLISTS JSON"
+                << " | [--snapshot FILE] [--server-threads N] --serve PATH|[HOST:]PORT"
+                << " | [--load-writes PERCENT] --load-gen PATH|[HOST:]PORT CONNECTIONS SECONDS PIPELINE\n";
+            return 1;
+        }
+    }
+    if (!loadAddress.empty())
+        return runLoadGenerator(loadAddress, loadConnections, loadSeconds, loadPipeline, loadWrites);
+    system.startWorkers();
+    if (!benchmarkPath.empty())
+        return runBenchmark(system, benchmarkSongs, benchmarkUsers, benchmarkPlaylists, benchmarkPath, benchmarkOps);
+    // Command mode keeps stdout for responses.
+    ostream& status = commandPath.empty() && serveAddress.empty() ? cout : cerr;
+    // Starting without a snapshot or journal that is there but unreadable
+    // would let the next compaction overwrite it, so neither is touched.
+    if (ifstream(system.snapshotPath).good()) {
+        string error;
+        if (!system.openSnapshot(system.snapshotPath, error)) {
+            cerr << "Could not load snapshot " << system.snapshotPath << ": " << error << "; not starting\n";
+            return 1;
+        }
+        status << "Loaded snapshot " << system.snapshotPath << " (" << system.songCount() << " songs)\n";
+    }
+    {
+        string journalPath = system.snapshotPath + ".journal", report, error;
+        if (system.openJournal(journalPath, report, error)) {
+            if (!report.empty()) status << "Recovered: " << report << '\n';
+        }
+        else if (ifstream(journalPath).good()) {
+            cerr << "Could not open journal " << journalPath << ": " << error << "; not starting\n";
+            return 1;
+        }
+        else {
+            status << "Journal disabled: " << error << '\n';
+        }
+    }
+    if (!importPath.empty()) {
+        ImportReport report;
+        string error;
+        if (!importSongs(system, importPath, report, error)) {
+            cerr << "Import failed: " << error << '\n';
+            return 1;
+        }
+        report.print(cerr, 100);
+        return 0;
+    }
+    if (!serveAddress.empty())
+        return runServer(system, serveAddress, serverThreads) ? 0 : 1;
+    if (!commandPath.empty()) {
+        if (commandPath == "-") {
+            ios::sync_with_stdio(false);
+            return runCommands(system, cin, cout) ? 0 : 1;
+        }
+        ifstream commands(commandPath, ios::binary);
+        if (!commands) {
+            cerr << "Cannot open " << commandPath << '\n';
+            return 1;
+        }
+        return runCommands(system, commands, cout) ? 0 : 1;
+    }
+
+    cout << "Welcome to Music Player\n";
+    while (true) {
+        cout << "\n1. Admin login\n2. User login\n3. Register new user\n4. Exit\nChoose option: ";
+        int choice;
+        cin >> choice;
+        if (choice == 1) {
+            string u, p;
+            cout << "Admin username: ";
+            cin >> u;
+            cout << "Admin password: ";
+            cin >> p;
+            if (system.admin.login(u, p)) {
+                cout << "Admin logged in successfully.\n";
+                adminMenu(system);
+            }
+            else {
+                cout << "Invalid admin credentials.\n";
+            }
+        }
+        else if (choice == 2) {
+            string u, p;
+            cout << "User username: ";
+            cin >> u;
+            cout << "User password: ";
+            cin >> p;
+            User* user = system.findUser(u);
+            if (user && user->checkPassword(p)) {
+                cout << "User logged in successfully.\n";
+                userMenu(system, user);
+            }
+            else {
+                cout << "Invalid user credentials.\n";
+            }
+        }
+        else if (choice == 3) {
+            string u, p;
+            cout << "Enter new username: ";
+            cin >> u;
+            if (system.findUser(u)) {
+                cout << "Username already exists.\n";
+                continue;
+            }
+            cout << "Enter new password: ";
+            cin >> p;
+            if (system.addUser(User(u, p))) cout << "User registered successfully.\n";
+            else cout << "Username already exists.\n";
+        }
+        else if (choice == 4) {
+            cout << "Exiting...\n";
+            break;
+        }
+        else {
+            cout << "Invalid option.\n";
+        }
+    }
+
+    return 0;
+}
+
+void addSongInteractive(MusicSystem& system) {
+    string name, artistName, genre;
+    int year;
+    cout << "Enter song name: ";
+    cin.ignore();
+    getline(cin, name);
+    cout << "Enter artist name: ";
+    getline(cin, artistName);
+    cout << "Enter release year: ";
+    cin >> year;
+    cout << "Enter genre: ";
+    cin.ignore();
+    getline(cin, genre);
+    Song song(name, artistName, year, genre);
+    system.addSong(song);
+    cout << "Song added successfully.\n";
+}
+
+void createPlaylistInteractive(MusicSystem& system) {
+    string name;
+    cout << "Enter playlist name: ";
+    cin.ignore();
+    getline(cin, name);
+    if (!system.createPlaylist(name)) {
+        cout << "Playlist already exists.\n";
+        return;
+    }
+    cout << "Playlist created successfully.\n";
+}
+
+// Shows a list one page at a time: n and p move, g N jumps to page N, q
+// leaves. With a pick prompt the user may instead type an item number,
+// which is returned (0 when nothing was picked). Lists that fit on one page
+// print as before, followed straight by the pick prompt. show may resize
+// the cursor to the list as it is now.
+long browse(PageCursor& cursor, const function<void(PageCursor&)>& show, const string& pickPrompt = "") {
+    while (true) {
+        show(cursor);
+        if (cursor.pages() == 1) {
+            if (pickPrompt.empty()) return 0;
+            long number = 0;
+            cout << pickPrompt;
+            cin >> number;
+            return number;
+        }
+        cout << "n = next page, p = previous page, g N = go to page N, "
+            << (pickPrompt.empty() ? string("q = done: ") : "q = cancel, or " + pickPrompt);
+        string command;
+        if (!(cin >> command)) return 0;
+        if (command == "n") {
+            if (!cursor.next()) cout << "Already on the last page.\n";
+        }
+        else if (command == "p") {
+            if (!cursor.previous()) cout << "Already on the first page.\n";
+        }
+        else if (command == "g") {
+            size_t page = 0;
+            if (!(cin >> page)) return 0;
+            if (page == 0 || !cursor.jump(page - 1)) cout << "No such page.\n";
+        }
+        else if (command == "q") {
+            return 0;
+        }
+        else if (!pickPrompt.empty() && isdigit((unsigned char)command[0])) {
+            return atol(command.c_str());
+        }
+        else {
+            cout << "Unknown command.\n";
+        }
+    }
+}
+
+long browseSongs(MusicSystem& system, const SongPages& list, const string& pickPrompt = "") {
+    PageCursor cursor(list.total);
+    return browse(cursor, [&](const PageCursor& c) { system.displaySongs(list, c); }, pickPrompt);
+}
+
+long browsePlaylist(MusicSystem& system, const Playlist& playlist, const string& pickPrompt = "") {
+    PageCursor cursor;
+    return browse(cursor, [&](PageCursor& c) {
+        system.readPlaylist(&playlist, [&](const CatalogVersion& catalog) {
+            c.resize(playlist.size());
+            playlist.displaySongs(catalog.songs, c);
+        });
+    }, pickPrompt);
+}
+
+// Browses the user's saved (or favorite) songs; returns the song picked,
+// or NO_SONG.
+SongId browseSongSet(MusicSystem& system, User* user, bool saved, const string& pickPrompt = "") {
+    SongSet& set = saved ? user->savedSongs : user->favoriteSongs;
+    PageCursor cursor;
+    long idx = browse(cursor, [&](PageCursor& c) {
+        system.readUser(user, [&](const CatalogVersion& catalog) {
+            c.resize(set.size());
+            if (saved) user->displaySavedSongs(catalog.songs, c);
+            else user->displayFavoriteSongs(catalog.songs, c);
+        });
+    }, pickPrompt);
+    return system.readUser(user, [&](const CatalogVersion&) {
+        return idx >= 1 && idx <= (long)set.size() ? set.at(idx - 1) : NO_SONG;
+    });
+}
+
+// Shows the user's favorite (or personal) playlists as they are now.
+void showUserPlaylists(MusicSystem& system, User* user, bool favorites, PageCursor& cursor) {
+    vector<PlaylistSummary> list = favorites ? system.favoriteSummaries(user) : system.playlistSummaries(user);
+    cursor.resize(list.size());
+    if (favorites) user->displayFavoritePlaylists(list, cursor);
+    else user->displayPersonalPlaylists(list, cursor);
+}
+
+void addSongToPlaylistInteractive(MusicSystem& system) {
+    string playlistName;
+    cout << "Enter playlist name to add song to: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(nullptr, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    cout << "System Songs:\n";
+    long songIndex = browseSongs(system, system.allSongs(), "Enter song number to add: ");
+    if (songIndex < 1 || songIndex > (long)system.songCount()) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    system.addSongToPlaylist(nullptr, playlist.get(), (SongId)(songIndex - 1));
+    cout << "Song added to playlist.\n";
+}
+
+void removeSongFromPlaylistInteractive(MusicSystem& system) {
+    string playlistName;
+    cout << "Enter playlist name to remove song from: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(nullptr, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    long songIndex = browsePlaylist(system, *playlist, "Enter song number to remove: ");
+    if (songIndex < 1 || !system.removePlaylistEntry(nullptr, playlist.get(), songIndex - 1)) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    cout << "Song removed from playlist.\n";
+}
+
+void createArtistPageInteractive(MusicSystem& system) {
+    string artistName;
+    int albums;
+    cout << "Enter artist name: ";
+    cin.ignore();
+    getline(cin, artistName);
+    cout << "Enter number of albums: ";
+    cin >> albums;
+    bool exists = system.hasArtist(artistName);
+    system.editArtist(artistName, albums);
+    if (exists) {
+        cout << "Artist updated successfully.\n";
+    }
+    else {
+        cout << "Artist created successfully.\n";
+    }
+}
+
+void addSongToArtistInteractive(MusicSystem& system) {
+    string artistName;
+    cout << "Enter artist name to add song to: ";
+    cin.ignore();
+    getline(cin, artistName);
+    if (!system.hasArtist(artistName)) {
+        cout << "Artist not found.\n";
+        return;
+    }
+    cout << "System Songs:\n";
+    long songIndex = browseSongs(system, system.allSongs(), "Enter song number to add: ");
+    if (songIndex < 1 || songIndex > (long)system.songCount()) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    SongId song = (SongId)(songIndex - 1);
+    if (system.read([&](const CatalogVersion& c) { return c.songs[song].artistName != artistName; })) {
+        cout << "Song's artist does not match.\n";
+        return;
+    }
+    system.addSongToArtist(artistName, song);
+    cout << "Song added to artist's page.\n";
+}
+
+void adminMenu(MusicSystem& system) {
+    while (true) {
+        cout << "\nAdmin Menu:\n"
+            << "1. Add Song\n"
+            << "2. Create Playlist\n"
+            << "3. Add Song to Playlist\n"
+            << "4. Remove Song from Playlist\n"
+            << "5. Create/Edit Artist Page\n"
+            << "6. Add Song to Artist Page\n"
+            << "7. Display All Songs\n"
+            << "8. Display All Playlists\n"
+            << "9. Memory Usage Report\n"
+            << "10. Save Snapshot\n"
+            << "11. Bulk Import Songs\n"
+            << "12. Operation Metrics\n"
+            << "13. Logout\n"
+            << "Choose option: ";
+        int opt; cin >> opt;
+        switch (opt) {
+        case 1: addSongInteractive(system); break;
+        case 2: createPlaylistInteractive(system); break;
+        case 3: addSongToPlaylistInteractive(system); break;
+        case 4: removeSongFromPlaylistInteractive(system); break;
+        case 5: createArtistPageInteractive(system); break;
+        case 6: addSongToArtistInteractive(system); break;
+        case 7: browseSongs(system, system.allSongs()); break;
+        case 8: {
+            PageCursor cursor;
+            browse(cursor, [&](PageCursor& c) {
+                vector<PlaylistSummary> list = system.playlistSummaries(nullptr);
+                c.resize(list.size());
+                system.displayPlaylists(list, c);
+            });
+            break;
+        }
+        case 9: system.displayMemoryUsage(); break;
+        case 10: {
+            string error;
+            if (system.compact(error))
+                cout << "Snapshot saved to " << system.snapshotPath << ".\n";
+            else
+                cout << "Snapshot failed: " << error << '\n';
+            break;
+        }
+        case 11: {
+            string path, error;
+            ImportReport report;
+            cout << "Enter CSV/TSV file path: ";
+            cin.ignore();
+            getline(cin, path);
+            if (importSongs(system, path, report, error))
+                report.print(cout);
+            else
+                cout << "Import failed: " << error << '\n';
+            break;
+        }
+        case 12: {
+            string path;
+            Metrics::instance().writeText(cout);
+            cout << "Write JSON snapshot to (empty to skip): ";
+            cin.ignore();
+            getline(cin, path);
+            if (path.empty()) break;
+            ofstream file(path);
+            Metrics::instance().writeJson(file);
+            cout << (file ? "Metrics written to " + path + ".\n" : "Could not write " + path + ".\n");
+            break;
+        }
+        case 13: return;
+        default: cout << "Invalid option.\n";
+        }
+    }
+}
+
+void userAddSongToPlaylist(User* user, MusicSystem& system) {
+    string playlistName;
+    cout << "Enter your playlist name: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(user, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    cout << "System Songs:\n";
+    long songIndex = browseSongs(system, system.allSongs(), "Enter song number to add: ");
+    if (songIndex < 1 || songIndex > (long)system.songCount()) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    system.addSongToPlaylist(user, playlist.get(), (SongId)(songIndex - 1));
+    cout << "Song added to playlist.\n";
+}
+
+void userRemoveSongFromPlaylist(User* user, MusicSystem& system) {
+    string playlistName;
+    cout << "Enter your playlist name: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(user, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    long songIndex = browsePlaylist(system, *playlist, "Enter song number to remove: ");
+    if (songIndex < 1 || !system.removePlaylistEntry(user, playlist.get(), songIndex - 1)) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    cout << "Song removed from playlist.\n";
+}
+
+void userReorderPlaylist(User* user, MusicSystem& system) {
+    string playlistName;
+    cout << "Enter your playlist name: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(user, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    long from = browsePlaylist(system, *playlist, "Enter song number to move: ");
+    long to;
+    cout << "Enter new position: ";
+    cin >> to;
+    if (from < 1 || to < 1 || !system.movePlaylistEntry(user, playlist.get(), from - 1, to - 1)) {
+        cout << "Invalid song selection.\n";
+        return;
+    }
+    cout << "Song moved.\n";
+}
+
+void userFollowPlaylist(User* user, MusicSystem& system) {
+    string owner, name;
+    cout << "Enter playlist owner (leave empty for a system playlist): ";
+    cin.ignore();
+    getline(cin, owner);
+    cout << "Enter playlist name: ";
+    getline(cin, name);
+    shared_ptr<Playlist> playlist = system.sharePlaylistOf(owner, name);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    if (!system.followPlaylist(user, owner, name)) {
+        cout << "You already follow this playlist.\n";
+        return;
+    }
+    cout << "Playlist added to favorites.\n";
+}
+
+void userUnfollowPlaylist(User* user, MusicSystem& system) {
+    PageCursor cursor;
+    long idx = browse(cursor, [&](PageCursor& c) { showUserPlaylists(system, user, true, c); },
+        "Enter playlist number to remove from favorites: ");
+    if (idx < 1 || !system.unfollowPlaylist(user, idx - 1)) {
+        cout << "Invalid playlist number.\n";
+        return;
+    }
+    cout << "Playlist removed from favorites.\n";
+}
+
+void userForkPlaylist(User* user, MusicSystem& system) {
+    PageCursor cursor;
+    long idx = browse(cursor, [&](PageCursor& c) { showUserPlaylists(system, user, true, c); },
+        "Enter playlist number to copy: ");
+    string name;
+    if (idx < 1 || idx > (long)system.favoriteSummaries(user).size()) {
+        cout << "Invalid playlist number.\n";
+        return;
+    }
+    cout << "Enter name for your copy: ";
+    cin.ignore();
+    getline(cin, name);
+    if (!system.forkPlaylist(user, idx - 1, name)) {
+        cout << "Playlist already exists.\n";
+        return;
+    }
+    cout << "Playlist copied to your personal playlists.\n";
+}
+
+void userCreatePlaylist(User* user, MusicSystem& system) {
+    string name;
+    cout << "Enter new playlist name: ";
+    cin.ignore();
+    getline(cin, name);
+    if (!system.addUserPlaylist(user, name)) {
+        cout << "Playlist already exists.\n";
+        return;
+    }
+    cout << "Playlist created.\n";
+}
+
+void userDeletePlaylist(User* user, MusicSystem& system) {
+    string name;
+    cout << "Enter playlist name to delete: ";
+    cin.ignore();
+    getline(cin, name);
+    if (!system.sharePlaylist(user, name)) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    system.deleteUserPlaylist(user, name);
+    cout << "Playlist deleted.\n";
+}
+
+void userPlaylistPlayback(User* user, MusicSystem& system) {
+    string playlistName;
+    cout << "Enter playlist name to play: ";
+    cin.ignore();
+    getline(cin, playlistName);
+    shared_ptr<Playlist> playlist = system.sharePlaylist(user, playlistName);
+    if (!playlist) {
+        cout << "Playlist not found.\n";
+        return;
+    }
+    int mode;
+    cout << "Select playback mode:\n1. Sequential\n2. Shuffle\n3. Repeat\n4. Autoplay\nChoice: ";
+    cin >> mode;
+    if (mode == 1) system.setPlaybackMode(playlist.get(), SEQUENTIAL);
+    else if (mode == 2) system.setPlaybackMode(playlist.get(), SHUFFLE);
+    else if (mode == 3) system.setPlaybackMode(playlist.get(), REPEAT);
+    else if (mode == 4) system.setPlaybackMode(playlist.get(), AUTOPLAY);
+    else {
+        cout << "Invalid playback mode. Default sequential used.\n";
+        system.setPlaybackMode(playlist.get(), SEQUENTIAL);
+    }
+    char cmd;
+    cout << "Playing playlist \"" << playlist->name << "\". Commands: n = next, p = previous, q = quit\n";
+    cout << "Current song: " << system.describeSong(system.playbackStep(playlist.get(), 0)) << '\n';
+    while (true) {
+        cout << "Command: ";
+        cin >> cmd;
+        if (cmd == 'n') {
+            cout << "Now playing: " << system.describeSong(system.playbackStep(playlist.get(), 1)) << '\n';
+        }
+        else if (cmd == 'p') {
+            cout << "Now playing: " << system.describeSong(system.playbackStep(playlist.get(), -1)) << '\n';
+        }
+        else if (cmd == 'q') {
+            break;
+        }
+        else {
+            cout << "Unknown command.\n";
+        }
+    }
+}
+
+void advancedSearchInteractive(MusicSystem& system) {
+    string genre, artist, keyword, fromYear, toYear, sortBy, limit;
+    cout << "Leave a field empty to skip it.\n";
+    cin.ignore();
+    cout << "Genre: "; getline(cin, genre);
+    cout << "Artist contains: "; getline(cin, artist);
+    cout << "Keyword: "; getline(cin, keyword);
+    cout << "From year: "; getline(cin, fromYear);
+    cout << "To year: "; getline(cin, toYear);
+    cout << "Sort by (name/artist/year): "; getline(cin, sortBy);
+    cout << "Limit: "; getline(cin, limit);
+    vector<Predicate> preds;
+    if (!genre.empty()) preds.push_back(Predicate::genreIs(genre));
+    if (!artist.empty()) preds.push_back(Predicate::artistContains(artist));
+    if (!keyword.empty()) preds.push_back(Predicate::keyword(keyword));
+    if (!fromYear.empty() || !toYear.empty()) {
+        int from = fromYear.empty() ? INT_MIN : atoi(fromYear.c_str());
+        int to = toYear.empty() ? INT_MAX : atoi(toYear.c_str());
+        preds.push_back(Predicate::yearBetween(from, to));
+    }
+    SortField field = SORT_CATALOG;
+    if (sortBy == "name") field = SORT_NAME;
+    else if (sortBy == "artist") field = SORT_ARTIST;
+    else if (sortBy == "year") field = SORT_YEAR;
+    size_t lim = limit.empty() ? 0 : (size_t)atol(limit.c_str());
+    QueryCursor cursor = system.query(SongQuery(Predicate::allOf(preds), field, false, lim));
+    cout << "Plan: " << (cursor.plan.empty() ? "none" : cursor.plan) << '\n';
+    browseSongs(system, SongPages::of(move(cursor.ids)));
+}
+
+void showTopCharts(MusicSystem& system) {
+    cout << "Chart (saved/favorites): ";
+    string kind; cin >> kind;
+    if (kind != "saved" && kind != "favorites") {
+        cout << "Invalid chart.\n";
+        return;
+    }
+    cout << "Trending only? (y/n): ";
+    string trending; cin >> trending;
+    cout << "Genre (blank for all): ";
+    string genre; cin.ignore(); getline(cin, genre);
+    vector<pair<SongId, double>> top = system.topSongs(kind == "saved" ? CHART_SAVED : CHART_FAVORITE, genre, trending == "y", 20);
+    if (top.empty()) {
+        cout << "No songs charted yet.\n";
+        return;
+    }
+    system.read([&](const CatalogVersion& c) {
+        OutputBuffer out;
+        for (size_t i = 0; i < top.size(); ++i) {
+            SongView s = c.songs[top[i].first];
+            out << i + 1 << ". " << s.name << " by " << s.artistName << " (" << s.genre << ", score " << top[i].second << ")\n";
+        }
+    });
+}
+
+void userMenu(MusicSystem& system, User* user) {
+    while (true) {
+        cout << "\nUser Menu:\n"
+            << "1. View Saved Songs\n"
+            << "2. View Favorite Songs\n"
+            << "3. View Favorite Playlists\n"
+            << "4. View Personal Playlists\n"
+            << "5. Create Playlist\n"
+            << "6. Delete Playlist\n"
+            << "7. Add Song to Playlist\n"
+            << "8. Remove Song from Playlist\n"
+            << "9. Search Songs\n"
+            << "10. Filter Songs by Artist\n"
+            << "11. Filter Songs by Year\n"
+            << "12. Filter Songs by Genre\n"
+            << "13. Sort Songs Alphabetically\n"
+            << "14. Add Song to Saved Songs\n"
+            << "15. Remove Song from Saved Songs\n"
+            << "16. Add Song to Favorite Songs\n"
+            << "17. Remove Song from Favorite Songs\n"
+            << "18. Playback Playlist\n"
+            << "19. View Artist Page\n"
+            << "20. Filter Songs by Year Range\n"
+            << "21. Advanced Search\n"
+            << "22. Reorder Playlist\n"
+            << "23. Follow Playlist\n"
+            << "24. Unfollow Playlist\n"
+            << "25. Copy Favorite Playlist\n"
+            << "26. Top Charts\n"
+            << "27. Logout\n"
+            << "Choose option: ";
+        int opt; cin >> opt;
+        switch (opt) {
+        case 1: browseSongSet(system, user, true); break;
+        case 2: browseSongSet(system, user, false); break;
+        case 3: {
+            PageCursor cursor;
+            browse(cursor, [&](PageCursor& c) { showUserPlaylists(system, user, true, c); });
+            break;
+        }
+        case 4: {
+            PageCursor cursor;
+            browse(cursor, [&](PageCursor& c) { showUserPlaylists(system, user, false, c); });
+            break;
+        }
+        case 5: userCreatePlaylist(user, system); break;
+        case 6: userDeletePlaylist(user, system); break;
+        case 7: userAddSongToPlaylist(user, system); break;
+        case 8: userRemoveSongFromPlaylist(user, system); break;
+        case 9: {
+            cout << "Enter keyword to search: ";
+            string kw; cin.ignore(); getline(cin, kw);
+            vector<SearchHit> results = system.rankedSearch(kw, 20);
+            cout << "Search Results:\n";
+            system.displaySearchHits(results);
+            break;
+        }
+        case 10: {
+            cout << "Enter artist name: ";
+            string artist; cin.ignore(); getline(cin, artist);
+            browseSongs(system, system.filterSongsByArtist(artist));
+            break;
+        }
+        case 11: {
+            cout << "Enter release year: ";
+            int year; cin >> year;
+            browseSongs(system, system.filterSongsByYear(year));
+            break;
+        }
+        case 12: {
+            cout << "Enter genre: ";
+            string genre; cin.ignore(); getline(cin, genre);
+            browseSongs(system, system.filterSongsByGenre(genre));
+            break;
+        }
+        case 13: browseSongs(system, system.sortSongsAlphabetically()); break;
+        case 14: {
+            cout << "System Songs:\n";
+            long idx = browseSongs(system, system.allSongs(), "Enter song number to add to saved songs: ");
+            if (idx < 1 || idx > (long)system.songCount()) cout << "Invalid song number.\n";
+            else system.saveSong(user, (SongId)(idx - 1));
+            break;
+        }
+        case 15: {
+            SongId song = browseSongSet(system, user, true, "Enter song number to remove from saved songs: ");
+            if (song == NO_SONG) cout << "Invalid song number.\n";
+            else system.unsaveSong(user, song);
+            break;
+        }
+        case 16: {
+            cout << "System Songs:\n";
+            long idx = browseSongs(system, system.allSongs(), "Enter song number to add to favorite songs: ");
+            if (idx < 1 || idx > (long)system.songCount()) cout << "Invalid song number.\n";
+            else system.favoriteSong(user, (SongId)(idx - 1));
+            break;
+        }
+        case 17: {
+            SongId song = browseSongSet(system, user, false, "Enter song number to remove from favorite songs: ");
+            if (song == NO_SONG) cout << "Invalid song number.\n";
+            else system.unfavoriteSong(user, song);
+            break;
+        }
+        case 18: userPlaylistPlayback(user, system); break;
+        case 19: {
+            cout << "Enter artist name: ";
+            string artist; cin.ignore(); getline(cin, artist);
+            if (!system.hasArtist(artist)) {
+                cout << "Artist not found.\n";
+                break;
+            }
+            PageCursor cursor;
+            browse(cursor, [&](PageCursor& c) {
+                system.read([&](const CatalogVersion& catalog) {
+                    const Artist* page = catalog.findArtist(artist);
+                    c.resize(page->releasedSongs.size());
+                    page->displayInfo(catalog.songs, c);
+                });
+            });
+            break;
+        }
+        case 20: {
+            int fromYear, toYear;
+            cout << "Enter first year: "; cin >> fromYear;
+            cout << "Enter last year: "; cin >> toYear;
+            browseSongs(system, system.filterSongsByYearRange(fromYear, toYear));
+            break;
+        }
+        case 21: advancedSearchInteractive(system); break;
+        case 22: userReorderPlaylist(user, system); break;
+        case 23: userFollowPlaylist(user, system); break;
+        case 24: userUnfollowPlaylist(user, system); break;
+        case 25: userForkPlaylist(user, system); break;
+        case 26: showTopCharts(system); break;
+        case 27: return;
+        default: cout << "Invalid option.\n";
+        }
+    }
 }
\ No newline at end of file